@@ -9,6 +9,10 @@ SYSTEM_THREAD(ENABLED);
 
 retained CloudConfigData<256> retainedConfig;
 
+// Paths to nested values in "f"
+CloudConfigPath f1Path("f.f1");
+CloudConfigPath f2Path("f.f2");
+
 void logJson();
 
 void setup() {
@@ -57,10 +61,9 @@ void logJson() {
             Log.info("%u: %s", ii, iter.value().toString().data());
         }
 
-        JSONValue obj = CloudConfig::instance().getJSONValueForKey("f");
         Log.info("f1=%d f2=%d",
-            CloudConfigStorage::getJSONValueForKey(obj, "f1").toInt(),
-            CloudConfigStorage::getJSONValueForKey(obj, "f2").toInt());
+            CloudConfig::instance().getInt(f1Path),
+            CloudConfig::instance().getInt(f2Path));
     }
     else {
         Log.info("no config set");
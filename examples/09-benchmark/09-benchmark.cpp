@@ -0,0 +1,126 @@
+#include "CloudConfigRK.h"
+
+SerialLogHandler logHandler;
+
+SYSTEM_THREAD(ENABLED);
+
+// Measures parse time, heap usage, and lookup time against the number of keys, and the number
+// of bytes written for each storage method when one value changes. Run it before and after
+// changing the library, or the configuration format, to catch performance regressions.
+//
+// This does not use the cloud. The results are written to the USB serial debug log.
+
+const size_t MAX_KEYS = 64;
+const size_t NUM_LOOKUPS = 1000;
+const size_t EEPROM_OFFSET = 0;
+
+// Not retained, as the data is regenerated for each test
+CloudConfigData<1024> parseCopyData;
+CloudConfigData<1024> tokenData;
+CloudConfigTokenPool<MAX_KEYS * 2 + 1> tokenPool;
+
+CloudConfigStorageRetained *parseCopyStorage;
+CloudConfigStorageRetained *tokenStorage;
+CloudConfigStorageEEPROM<1024> *eepromStorage;
+#if HAL_PLATFORM_FILESYSTEM
+CloudConfigStorageFile<1024> *fileStorage;
+#endif
+
+char keys[MAX_KEYS][6];
+char json[1024];
+
+void buildJson(size_t numKeys, int value);
+void benchmarkStorage(const char *name, CloudConfigStorageRetained *storage, size_t numKeys);
+void benchmarkSave(const char *name, CloudConfigStorageData *storage);
+
+void setup() {
+    // This two lines are here so you can see the debug logs. You probably
+    // don't want them in your code.
+    waitFor(Serial.isConnected, 10000);
+    delay(2000);
+
+    for(size_t ii = 0; ii < MAX_KEYS; ii++) {
+        snprintf(keys[ii], sizeof(keys[ii]), "k%u", (unsigned)ii);
+    }
+
+    parseCopyStorage = new CloudConfigStorageRetained(&parseCopyData, sizeof(parseCopyData));
+    parseCopyStorage->setup();
+
+    tokenStorage = new CloudConfigStorageRetained(&tokenData, sizeof(tokenData));
+    tokenStorage->withTokenPool(tokenPool);
+    tokenStorage->setup();
+
+    Log.info("keys,bytes,parser,parse us,heap bytes,lookup ns/op");
+    for(size_t numKeys = 4; numKeys <= MAX_KEYS; numKeys *= 2) {
+        benchmarkStorage("parseCopy", parseCopyStorage, numKeys);
+        benchmarkStorage("tokenPool", tokenStorage, numKeys);
+    }
+
+    eepromStorage = new CloudConfigStorageEEPROM<1024>(EEPROM_OFFSET);
+    eepromStorage->setup();
+#if HAL_PLATFORM_FILESYSTEM
+    fileStorage = new CloudConfigStorageFile<1024>("/usr/benchmark.dat");
+    fileStorage->setup();
+#endif
+
+    Log.info("storage,data bytes,bytes written,write amplification");
+    benchmarkSave("EEPROM", eepromStorage);
+#if HAL_PLATFORM_FILESYSTEM
+    benchmarkSave("File", fileStorage);
+#endif
+}
+
+void loop() {
+}
+
+void buildJson(size_t numKeys, int value) {
+    size_t len = 0;
+
+    json[len++] = '{';
+    for(size_t ii = 0; ii < numKeys; ii++) {
+        len += snprintf(&json[len], sizeof(json) - len, "%s\"%s\":%d", (ii > 0) ? "," : "", keys[ii], (ii == 0) ? value : (int)ii);
+    }
+    snprintf(&json[len], sizeof(json) - len, "}");
+}
+
+void benchmarkStorage(const char *name, CloudConfigStorageRetained *storage, size_t numKeys) {
+    buildJson(numKeys, 0);
+
+    uint32_t freeBefore = System.freeMemory();
+    unsigned long start = micros();
+    storage->updateData(json);
+    unsigned long parseUs = micros() - start;
+    uint32_t freeAfter = System.freeMemory();
+
+    // The sum is logged so the lookups can't be optimized out
+    int sum = 0;
+    start = micros();
+    for(size_t ii = 0; ii < NUM_LOOKUPS; ii++) {
+        sum += storage->getInt(keys[ii % numKeys]);
+    }
+    unsigned long lookupNs = (micros() - start) * 1000 / NUM_LOOKUPS;
+
+    Log.info("%u,%u,%s,%lu,%ld,%lu (%d)", (unsigned)numKeys, (unsigned)strlen(json), name, parseUs,
+        (long)freeBefore - (long)freeAfter, lookupNs, sum);
+}
+
+void benchmarkSave(const char *name, CloudConfigStorageData *storage) {
+    // Save the full data once, then change one value
+    buildJson(MAX_KEYS, 1);
+    storage->updateData(json);
+
+    char oldJson[sizeof(json)];
+    strcpy(oldJson, json);
+    buildJson(MAX_KEYS, 2);
+    storage->updateData(json);
+
+    // Write amplification is the bytes written for each byte of data that changed
+    size_t changed = 0;
+    for(size_t ii = 0; json[ii]; ii++) {
+        if (json[ii] != oldJson[ii]) {
+            changed++;
+        }
+    }
+    size_t written = storage->getLastSaveBytes();
+    Log.info("%s,%u,%u,%.1f", name, (unsigned)strlen(json), (unsigned)written, (double)written / (double)changed);
+}
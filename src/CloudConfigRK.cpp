@@ -1,6 +1,19 @@
 #include "CloudConfigRK.h"
 
+#include <cerrno>
+#include <climits>
+
 CloudConfig *CloudConfig::_instance;
+CloudConfig *CloudConfig::_namedInstances;
+
+const CloudConfig::StateHandler CloudConfig::stateHandlers[] = {
+    &CloudConfig::stateStart,                   // START
+    &CloudConfig::stateWaitCloudConnected,      // WAIT_CLOUD_CONNECTED
+    &CloudConfig::stateWaitAfterCloudConnected, // WAIT_AFTER_CLOUD_CONNECTED
+    &CloudConfig::stateWaitToUpdate,            // WAIT_TO_UPDATE
+    &CloudConfig::stateStartUpdate,             // START_UPDATE
+    &CloudConfig::stateWaitUpdateComplete       // WAIT_UPDATE_COMPLETE
+};
 
 //
 // CloudConfigStorageData
@@ -33,6 +46,23 @@ void CloudConfigStorageData::validate() {
         memset(getJsonData(), 0, dataSize);
     }
 
+    if (isBinaryData()) {
+        // The hash is of the original JSON data, so it can't be recomputed
+        if (!isValidBinary(getJsonData(), dataSize)) {
+            Log.info("binary data not valid, resetting");
+            header->flags &= ~CloudConfig::FLAG_BINARY;
+            header->dataHash = 0;
+            memset(getJsonData(), 0, dataSize);
+        }
+    }
+    else
+    if (header->dataHash == 0) {
+        // Data saved by older versions does not have the hash set. Otherwise the hash is 
+        // not recomputed, as the magic bytes were checked and it is expensive for large data.
+        const char *json = getJsonData();
+        header->dataHash = crc32(json, strlen(json));
+    }
+
     parse();
 }
 
@@ -45,11 +75,36 @@ char *CloudConfigStorageData::getJsonData() {
 }
 
 bool CloudConfigStorageData::updateData(const char *json) {
+    return setData(json) && save();
+}
+
+bool CloudConfigStorageData::setData(const char *json) {
     size_t jsonLen = strlen(json);
+
+    if (binaryFormat) {
+        // Convert into a temporary buffer so the current data is not lost if it does not fit
+        char *buf = new(std::nothrow) char[dataSize];
+        size_t binaryLen = buf ? jsonToBinary(json, buf, dataSize) : 0;
+        if (binaryLen) {
+            memcpy(getJsonData(), buf, binaryLen);
+            header->flags |= CloudConfig::FLAG_BINARY;
+            header->dataHash = crc32(json, jsonLen);
+        }
+        delete[] buf;
+
+        if (binaryLen) {
+            parse();
+            return true;
+        }
+        Log.info("could not convert to binary format, storing as JSON");
+    }
+
     if (jsonLen < (dataSize - 1)) {
         strcpy(getJsonData(), json);
+        header->flags &= ~CloudConfig::FLAG_BINARY;
+        header->dataHash = crc32(json, jsonLen);
         parse();
-        return save();
+        return true;
     }
     else {
         // Too long, reject
@@ -57,252 +112,3988 @@ bool CloudConfigStorageData::updateData(const char *json) {
     }
 }
 
+size_t CloudConfigStorageData::getUsedDataSize() const {
+    if (isBinaryData()) {
+        uint16_t binaryLen;
+        memcpy(&binaryLen, &getJsonData()[2], sizeof(binaryLen));
+        return binaryLen;
+    }
+    return strlen(getJsonData()) + 1;
+}
+
+bool CloudConfigStorageData::isBinaryData() const {
+    return header && (header->flags & CloudConfig::FLAG_BINARY) != 0;
+}
 
-//
-// CloudConfigStorage
-//
-// [static]
-JSONValue CloudConfigStorage::getJSONValueForKey(JSONValue parentObj, const char *key) {
-    JSONObjectIterator iter(parentObj);
-    while(iter.next()) {
-        if (strcmp((const char *)iter.name(), key) == 0) {
-            // Found
-            return iter.value();
-        }
+bool CloudConfigStorageData::isValidLoadedData(int count) const {
+    if (count < (int)(sizeof(CloudConfigDataHeader) + 1)) {
+        return false;
     }
-    return JSONValue(); // Invalid JSONValue
+
+    const char *json = getJsonData();
+    if (isBinaryData()) {
+        // The dataHash is of the original JSON, so it can't be checked here. isValidBinary() 
+        // checks the CRC-32 stored in the binary data instead, which detects a partial write.
+        size_t binaryLen = isValidBinary(json, dataSize);
+        return binaryLen != 0 && count >= (int)(sizeof(CloudConfigDataHeader) + binaryLen);
+    }
+
+    size_t jsonLen = 0;
+    while(jsonLen < dataSize && json[jsonLen]) {
+        jsonLen++;
+    }
+    if (jsonLen >= dataSize) {
+        // Not null terminated
+        return false;
+    }
+
+    if (header->dataHash != 0 && header->dataHash != crc32(json, jsonLen)) {
+        // Partially written
+        return false;
+    }
+    return true;
+}
+
+bool CloudConfigStorageData::isSameData(const char *json) {
+    size_t jsonLen = strlen(json);
+    if (header->dataHash != crc32(json, jsonLen)) {
+        return false;
+    }
+    if (isBinaryData()) {
+        // The original JSON is not stored, so the hash is all that can be compared
+        return true;
+    }
+    return strcmp(getJsonData(), json) == 0;
 }
 
 // [static]
-JSONValue CloudConfigStorage::getJSONValueAtIndex(JSONValue parentObj, size_t index) {
-    JSONObjectIterator iter(parentObj);
-    size_t ii = 0;
-    while(iter.next()) {
-        if (ii == index) {
-            // Found
-            return iter.value();
+uint32_t CloudConfigStorageData::crc32(const void *data, size_t len, uint32_t crc) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc ^= p[ii];
+        for(size_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
         }
     }
-    return JSONValue(); // Invalid JSONValue
+    return ~crc;
 }
 
+#if HAL_PLATFORM_FILESYSTEM
 
 //
-// CloudConfig
+// CloudConfigStorageFileBase
 //
-
-CloudConfig &CloudConfig::instance() {
-    if (!_instance) {
-        _instance = new CloudConfig();
+void CloudConfigStorageFileBase::setup() {
+    int fd = open(path, O_RDWR | O_CREAT);
+    if (fd != -1) {
+        readFile(fd, 0);
+        close(fd);   
     }
-    return *_instance;
+
+    // Remove the temporary file if a previous atomic save did not complete
+    unlink(getTempPath());
+
+    validate();
 }
 
+void CloudConfigStorageFileBase::readFile(int fd, size_t headerBytes) {
+    // The file may be shorter than the buffer as only the used part is saved
+    uint8_t *buf = (uint8_t *)header;
+    memset(&buf[headerBytes], 0, getTotalSize() - headerBytes);
 
-CloudConfig::CloudConfig() {
+    int count = read(fd, &buf[headerBytes], getTotalSize() - headerBytes);
+    if (count >= 0) {
+        count += headerBytes;
+    }
+    if (!isValidLoadedData(count)) {
+        Log.info("resetting file contents");
 
+        // File contents do not appear to be valid; do not use
+        memset(buf, 0, getTotalSize());
+    }
 }
 
-CloudConfig::~CloudConfig() {
+bool CloudConfigStorageFileBase::save() {
+    // Save to file
+    Log.info("save to file");
 
-}
+    String savePath = atomicSave ? getTempPath() : path;
+    int saveSize = (int)(sizeof(CloudConfigDataHeader) + getUsedDataSize());
 
-void CloudConfig::setup() {
-    if (!storageMethod) {
-        // A storage method is always required
-        return;
-    }
+    lastSaveBytes = 0;
 
-    storageMethod->setup();
-    
-    if (updateMethod) {
-        // An update method is not required. CloudConfigStorageStatic for example
-        // cannot be update because the data is in code flash.
-        updateMethod->setup();
+    int fd = open(savePath, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd == -1) {
+        Log.info("save to file open failed %s", savePath.c_str());
+        return false;
+    }
 
-        // However the state machine only runs when both storageMethod and
-        // updateMethod are non-null. Without an update handler the state
-        // machine can't do anything
-        stateHandler = &CloudConfig::stateStart;
+    bool success = (write(fd, header, saveSize) == saveSize);
+    if (success && atomicSave) {
+        success = (fsync(fd) == 0);
+    }
+    close(fd);   
 
+    if (success && atomicSave) {
+        success = (rename(savePath, path) == 0);
+    }
+    if (!success) {
+        Log.info("save to file failed");
+        if (atomicSave) {
+            unlink(savePath);
+        }
+        return false;
     }
 
+    lastSaveBytes = saveSize;
+    Log.info("save to file done");
+    return true;
 }
 
-void CloudConfig::loop() {
-    // Give loop time to the storage and update methods if necessary
-    storageMethod->loop();
-    if (updateMethod) {
-        updateMethod->loop();
+bool CloudConfigStorageFileBase::saveHeader() {
+    if (atomicSave) {
+        // Overwriting the header in place could leave a partially written header
+        return save();
     }
 
-    // State machine
-    if (stateHandler) {
-        stateHandler(*this);
+    int fd = open(path, O_WRONLY);
+    if (fd == -1) {
+        return save();
+    }
+
+    bool success = (write(fd, header, sizeof(CloudConfigDataHeader)) == (int)sizeof(CloudConfigDataHeader));
+    close(fd);
+
+    lastSaveBytes = success ? sizeof(CloudConfigDataHeader) : 0;
+    if (!success) {
+        Log.info("save header to file failed");
     }
+    return success;
 }
 
-void CloudConfig::stateStart() {
-    // Handle retrieve on start
+//
+// CloudConfigStorageFileDynamic
+//
+void CloudConfigStorageFileDynamic::setup() {
+    CloudConfigDataHeader fileHeader;
+    size_t headerBytes = 0;
+    size_t newDataSize = ALLOC_INCREMENT;
 
-    if (storageMethod->hasJsonData() && dataCallback) {
-        // Send notification if enabled and we have data
-        dataCallback();
+    int fd = open(path, O_RDWR | O_CREAT);
+    if (fd != -1) {
+        // Use the buffer size from the saved header, if valid
+        if (read(fd, &fileHeader, sizeof(fileHeader)) == (int)sizeof(fileHeader)) {
+            headerBytes = sizeof(fileHeader);
+            if (fileHeader.magic == CloudConfig::DATA_MAGIC &&
+                fileHeader.headerSize == (uint8_t)sizeof(CloudConfigDataHeader) &&
+                fileHeader.dataSize >= ALLOC_INCREMENT && 
+                fileHeader.dataSize <= maxDataSize) {
+                newDataSize = fileHeader.dataSize;
+            }
+        }
     }
 
-    // Handle retrieve periodically
-    stateHandler = &CloudConfig::stateWaitCloudConnected;
-}
+    if (!allocate(newDataSize)) {
+        Log.error("could not allocate config buffer");
+        if (fd != -1) {
+            close(fd);
+        }
 
-void CloudConfig::stateWaitCloudConnected() {
-    if (!Particle.connected() || !Time.isValid()) {
+        // Use an empty buffer so the data can be safely accessed, but there is no data
+        memset(&emptyBuffer, 0, sizeof(emptyBuffer));
+        withData(&emptyBuffer.header, sizeof(emptyBuffer.jsonData));
+        validate();
         return;
     }
 
-    Log.info("cloud connected");
+    if (fd != -1) {
+        memcpy(header, &fileHeader, headerBytes);
+        readFile(fd, headerBytes);
+        close(fd);
+    }
 
-    // Cloud connection is up (and we have the time, which we will need shortly)
-    stateHandler = &CloudConfig::stateWaitAfterCloudConnected;
-    stateTime = millis();
+    unlink(getTempPath());
+
+    validate();
 }
 
-void CloudConfig::stateWaitAfterCloudConnected() {
-    if (millis() - stateTime < updateMethod->waitAfterCloudConnectedMs) {
-        return;
+bool CloudConfigStorageFileDynamic::setData(const char *json) {
+    // The base class requires jsonLen < (dataSize - 1)
+    size_t neededSize = strlen(json) + 2;
+    if (neededSize > dataSize) {
+        if (neededSize > maxDataSize) {
+            Log.info("data too large %u > %u", neededSize, maxDataSize);
+            return false;
+        }
+
+        size_t newDataSize = ((neededSize + ALLOC_INCREMENT - 1) / ALLOC_INCREMENT) * ALLOC_INCREMENT;
+        if (newDataSize > maxDataSize) {
+            newDataSize = maxDataSize;
+        }
+        if (!allocate(newDataSize)) {
+            Log.error("could not allocate config buffer");
+            return false;
+        }
     }
 
-    // We're cloud connected and waited briefly (2 seconds) to make
-    // sure registration is complete. This delay isn't necessary in 2.0.0
-    // or later but it doesn't hurt.
-    if (!storageMethod->hasJsonData() || updateFrequency == UPDATE_AT_RESTART) {
-        // Need to update data as we do not have it, or we should update at every restart
-        Log.info("no data or update at restart");
-        stateHandler = &CloudConfig::stateStartUpdate;
+    return CloudConfigStorageData::setData(json);
+}
+
+bool CloudConfigStorageFileDynamic::allocate(size_t newDataSize) {
+    uint8_t *buf = new(std::nothrow) uint8_t[sizeof(CloudConfigDataHeader) + newDataSize];
+    if (!buf) {
+        return false;
     }
-    else {
-        Log.info("wait for update");
-        stateTime = millis();
-        stateHandler = &CloudConfig::stateWaitToUpdate;
+    memset(buf, 0, sizeof(CloudConfigDataHeader) + newDataSize);
+
+    uint8_t *oldBuf = (uint8_t *)header;
+    if (oldBuf) {
+        memcpy(buf, oldBuf, getTotalSize());
+        if (!isEmptyBuffer()) {
+            delete[] oldBuf;
+        }
+    }
+
+    withData((CloudConfigDataHeader *)buf, newDataSize);
+    if (oldBuf) {
+        // Keep the header valid for the new size. On first allocation, validate() does this.
+        header->dataSize = (uint16_t)newDataSize;
     }
+    return true;
 }
 
-void CloudConfig::stateWaitToUpdate() {
-    if (millis() - stateTime < 10000) {
-        return;
+#endif /* HAL_PLATFORM_FILESYSTEM */
+
+//
+// CloudConfigStorageTable
+//
+int CloudConfigStorageTable::getInt(const char *key) {
+    const CloudConfigTableEntry *entry = findEntry(key);
+    if (!entry) {
+        return 0;
+    }
+    if (entry->type == JSON_TYPE_STRING) {
+        return (int) strtol(entry->stringValue, NULL, 10);
     }
+    return entry->intValue;
+}
 
-    // Run these checks every 10 seconds
-    if (Time.isValid() && updateFrequency > 0) {
-        if (Time.now() - storageMethod->getDataHeader()->lastCheck > updateFrequency) {
-            // Time to update
-            Log.info("checking for time update");
-            stateHandler = &CloudConfig::stateStartUpdate;
-        }
+bool CloudConfigStorageTable::getBool(const char *key) {
+    const CloudConfigTableEntry *entry = findEntry(key);
+    if (!entry) {
+        return false;
+    }
+    if (entry->type == JSON_TYPE_STRING) {
+        return strcmp(entry->stringValue, "true") == 0 || strtod(entry->stringValue, NULL) != 0;
     }
+    return entry->doubleValue != 0;
 }
 
-void CloudConfig::stateStartUpdate() {
-    Log.info("stateStartUpdate");
-    storageMethod->getDataHeader()->lastCheck = Time.now();
-    updateDataStatus = UpdateDataStatus::IN_PROGRESS;
-    stateTime = millis();
-    stateHandler = &CloudConfig::stateWaitUpdateComplete;
+double CloudConfigStorageTable::getDouble(const char *key) {
+    const CloudConfigTableEntry *entry = findEntry(key);
+    if (!entry) {
+        return 0;
+    }
+    if (entry->type == JSON_TYPE_STRING) {
+        return strtod(entry->stringValue, NULL);
+    }
+    return entry->doubleValue;
+}
 
-    updateMethod->startUpdate();
+const char *CloudConfigStorageTable::getString(const char *key) {
+    const CloudConfigTableEntry *entry = findEntry(key);
+    if (!entry || entry->type != JSON_TYPE_STRING) {
+        return "";
+    }
+    return entry->stringValue;
 }
 
-void CloudConfig::stateWaitUpdateComplete() {
-    if (updateDataStatus == UpdateDataStatus::IN_PROGRESS) {
-        if (millis() - stateTime > updateMethod->updateTimeoutMs) {
-            // Timeout
-            Log.info("stateWaitUpdateComplete timeout");
-            updateDataStatus = UpdateDataStatus::TIMEOUT;
-            stateTime = millis();
-            stateHandler = &CloudConfig::stateWaitToUpdate;
-            return;
+bool CloudConfigStorageTable::copyString(const char *key, char *buf, size_t bufSize) {
+    const CloudConfigTableEntry *entry = findEntry(key);
+    if (!entry) {
+        buf[0] = 0;
+        return false;
+    }
+
+    switch(entry->type) {
+    case JSON_TYPE_STRING:
+        strncpy(buf, entry->stringValue, bufSize - 1);
+        buf[bufSize - 1] = 0;
+        break;
+
+    case JSON_TYPE_BOOL:
+        snprintf(buf, bufSize, "%s", entry->intValue ? "true" : "false");
+        break;
+
+    default:
+        if (entry->doubleValue == (double) entry->intValue) {
+            snprintf(buf, bufSize, "%d", entry->intValue);
         }
         else {
-            // Still in progress
-            return;
+            snprintf(buf, bufSize, "%g", entry->doubleValue);
         }
+        break;
     }
+    return true;
+}
 
-    // Not in progress anymore. 
-    Log.info("stateWaitUpdateComplete complete");
-    
-    // Wait to update again
-    stateTime = millis();
-    stateHandler = &CloudConfig::stateWaitToUpdate;
+const CloudConfigTableEntry *CloudConfigStorageTable::findEntry(const char *key) const {
+    uint32_t hash = hashKey(key);
+
+    if (index) {
+        // Find the first entry with this hash, then check each entry with the same hash
+        size_t low = 0;
+        size_t high = numEntries;
+        while(low < high) {
+            size_t mid = (low + high) / 2;
+            if (entries[index[mid]].hash < hash) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        for(; low < numEntries && entries[index[low]].hash == hash; low++) {
+            if (strcmp(entries[index[low]].key, key) == 0) {
+                return &entries[index[low]];
+            }
+        }
+        return NULL;
+    }
+
+    for(size_t ii = 0; ii < numEntries; ii++) {
+        if (entries[ii].hash == hash && strcmp(entries[ii].key, key) == 0) {
+            return &entries[ii];
+        }
+    }
+    return NULL;
 }
 
+const char * const CloudConfigStorageTable::getJsonData() const {
+    if (jsonData) {
+        return jsonData;
+    }
+
+    // Calls append() for each part of the JSON, first to get the length, then to copy
+    size_t len = 0;
+    size_t bufSize = 0;
+    auto append = [&](const char *str) {
+        size_t strLen = strlen(str);
+        if (jsonData && len + strLen < bufSize) {
+            strcpy(&jsonData[len], str);
+        }
+        len += strLen;
+    };
 
-bool CloudConfig::updateData(const char *json) {
-    Log.info("updateData called %s", json);
-    updateDataStatus = UpdateDataStatus::SUCCESS;
+    for(int pass = 0; pass < 2; pass++) {
+        len = 0;
+        append("{");
+        for(size_t ii = 0; ii < numEntries; ii++) {
+            const CloudConfigTableEntry &entry = entries[ii];
+            char temp[32];
 
-    if (storageMethod) {
-        storageMethod->updateData(json);
+            if (ii > 0) {
+                append(",");
+            }
+            len += escapeString(entry.key, strlen(entry.key), jsonData ? &jsonData[len] : NULL, jsonData ? bufSize - len : 0);
+            append(":");
+            switch(entry.type) {
+            case JSON_TYPE_STRING:
+                len += escapeString(entry.stringValue, strlen(entry.stringValue), jsonData ? &jsonData[len] : NULL, jsonData ? bufSize - len : 0);
+                break;
+
+            case JSON_TYPE_BOOL:
+                append(entry.intValue ? "true" : "false");
+                break;
+
+            default:
+                // Use the shortest precision that converts back to the same value
+                snprintf(temp, sizeof(temp), "%.15g", entry.doubleValue);
+                if (strtod(temp, NULL) != entry.doubleValue) {
+                    snprintf(temp, sizeof(temp), "%.17g", entry.doubleValue);
+                }
+                append(temp);
+                break;
+            }
+        }
+        append("}");
 
-        if (dataCallback) {
-            // Send notification if enabled and we have data
-            dataCallback();
+        if (pass == 0) {
+            bufSize = len + 1;
+            jsonData = new(std::nothrow) char[bufSize];
+            if (!jsonData) {
+                Log.error("could not allocate table JSON");
+                return "";
+            }
         }
     }
+    return jsonData;
+}
 
-    return true;
+//
+// CloudConfigStorageLayered
+//
+void CloudConfigStorageLayered::setup() {
+    defaults->setup();
+    overrides->setup();
+    parse();
 }
 
+void CloudConfigStorageLayered::parse() {
+    parseGeneration++;
 
-void CloudConfig::updateDataFailed() {
-    updateDataStatus = UpdateDataStatus::FAILURE;
+    // The layers are parsed by their own setup() and updateData(). The merged data and the 
+    // JSONValue created from it are only built if needed.
+    delete[] mergedJson;
+    mergedJson = 0;
+    jsonObj = JSONValue();
+    clearKeyIndex();
+    jsonObjStale = true;
 }
 
-
-void CloudConfigUpdateFunction::setup() {
-    Particle.function(name, &CloudConfigUpdateFunction::functionHandler, this);
+const char * const CloudConfigStorageLayered::getJsonData() const {
+    if (!overrides->hasJsonData() && !defaults->isBinaryData()) {
+        return defaults->getJsonData();
+    }
+    if (!defaults->hasJsonData() && !overrides->isBinaryData()) {
+        return overrides->getJsonData();
+    }
+    if (!mergedJson) {
+        buildMergedJson();
+    }
+    return mergedJson ? mergedJson : "";
 }
 
+void CloudConfigStorageLayered::buildMergedJson() const {
+    // The layers are copied as they may be in binary format
+    size_t defaultsLen = defaults->getJsonText(NULL, 0);
+    size_t overridesLen = overrides->getJsonText(NULL, 0);
+    size_t bufSize = defaultsLen + overridesLen + 3;
+    char *buf = new(std::nothrow) char[bufSize + defaultsLen + 1 + overridesLen + 1];
+    if (!buf) {
+        Log.error("could not allocate merged config");
+        return;
+    }
+    char *target = &buf[bufSize];
+    char *patch = &target[defaultsLen + 1];
+    defaults->getJsonText(target, defaultsLen + 1);
+    overrides->getJsonText(patch, overridesLen + 1);
 
-int CloudConfigUpdateFunction::functionHandler(String param) {
-    CloudConfig::instance().updateData(param);
-    return 0;
+    // A null in the overrides means use the default, the same as getLayer()
+    if (CloudConfigStorage::mergePatch(target, patch, buf, bufSize, false)) {
+        mergedJson = new(std::nothrow) char[strlen(buf) + 1];
+        if (mergedJson) {
+            strcpy(mergedJson, buf);
+        }
+    }
+    else {
+        Log.info("could not merge overrides into defaults");
+    }
+    delete[] buf;
 }
 
-
-void CloudConfigUpdateSubscription::setup() {
-    Particle.subscribe(eventName, &CloudConfigUpdateSubscription::subscriptionHandler, this);
+bool CloudConfigStorageLayered::updateData(const char *json) {
+    bool result = overrides->updateData(json);
+    parse();
+    return result;
 }
 
-void CloudConfigUpdateSubscription::subscriptionHandler(const char *eventName, const char *eventData) {
-    CloudConfig::instance().updateData(eventData);
+bool CloudConfigStorageLayered::setData(const char *json) {
+    bool result = overrides->setData(json);
+    parse();
+    return result;
 }
 
+
 //
-// CloudConfigUpdateWebhook
+// CloudConfigPath
 //
-CloudConfigUpdateWebhook::CloudConfigUpdateWebhook(const char *eventName) {
-    // This is the request event name
-    requestEventName = eventName;
+CloudConfigPath::CloudConfigPath(const char *path) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= MAX_PATH_LEN) {
+        return;
+    }
+    strcpy(pathBuf, path);
 
-    // This is the subscription event name (hook-response)
-    withEventName(eventName);
-}
+    size_t num = 0;
+    size_t pos = 0;
+    char c = pathBuf[0];
+    while(c) {
+        if (num >= MAX_SEGMENTS) {
+            return;
+        }
+        Segment &seg = segments[num++];
 
-CloudConfigUpdateWebhook &CloudConfigUpdateWebhook::withEventName(const char *eventName) {
-    // Response Template:
-    // {{PARTICLE_DEVICE_ID}}/hook-response/{{PARTICLE_EVENT_NAME}}
-    String s = String::format("%s/hook-response/%s/", System.deviceID().c_str(), eventName);
+        if (c == '[') {
+            // Array index
+            char *end;
+            if (pathBuf[pos + 1] < '0' || pathBuf[pos + 1] > '9') {
+                return;
+            }
+            unsigned long index = strtoul(&pathBuf[pos + 1], &end, 10);
+            if (*end != ']' || index > 0xffff) {
+                return;
+            }
+            seg.isKey = false;
+            seg.offset = 0;
+            seg.index = (uint16_t) index;
 
-    CloudConfigUpdateSubscription::withEventName(s);
-    return *this;
+            pos = (end - pathBuf) + 1;
+            c = pathBuf[pos];
+            if (c != 0 && c != '.' && c != '[') {
+                return;
+            }
+        }
+        else {
+            // Key name, null terminated in place
+            size_t start = pos;
+            while(pathBuf[pos] && pathBuf[pos] != '.' && pathBuf[pos] != '[') {
+                pos++;
+            }
+            if (pos == start) {
+                return;
+            }
+            c = pathBuf[pos];
+            pathBuf[pos] = 0;
+
+            seg.isKey = true;
+            seg.offset = (uint8_t) start;
+            seg.index = 0;
+        }
+
+        if (c == '.') {
+            // Must be followed by a key name
+            c = pathBuf[++pos];
+            if (c == 0 || c == '.' || c == '[') {
+                return;
+            }
+        }
+    }
+    numSegments = num;
 }
 
-void CloudConfigUpdateWebhook::startUpdate() {
-    Log.info("CloudConfigUpdateWebhook::startUpdate %s", requestEventName.c_str());
+//
+// CloudConfigStorage
+//
+CloudConfigStorage &CloudConfigStorage::withTokenPool(CloudConfigToken *tokens, size_t maxTokens, uint16_t *tokenIndex, size_t tokenIndexSize, CloudConfigTokenCache *cache) {
+    if (tokenIndexSize == 0) {
+        Log.error("token index size must not be 0, not using token pool");
+        return *this;
+    }
+    if ((tokenIndexSize & (tokenIndexSize - 1)) != 0) {
+        // The index is probed using a mask, so use the largest power of 2 that fits
+        size_t size = 1;
+        while(size * 2 <= tokenIndexSize) {
+            size *= 2;
+        }
+        Log.info("token index size %u is not a power of 2, using %u", (unsigned)tokenIndexSize, (unsigned)size);
+        tokenIndexSize = size;
+    }
 
-    Particle.publish(requestEventName, "");
+    this->tokens = tokens;
+    this->maxTokens = maxTokens;
+    this->tokenIndex = tokenIndex;
+    this->tokenIndexSize = tokenIndexSize;
+    this->tokenCache = cache;
+    return *this;
 }
 
+void CloudConfigStorage::parse() {
+    parseGeneration++;
+    tokenCacheHit = false;
 
+    // The string pool is only built if getString() is used
+    clearStringPool();
+    stringPoolStale = false;
 
+    if (tokenCache && isBinaryData()) {
+        tokenCache->magic = 0;
+    }
 
+    if (isBinaryData()) {
+        // Values are read directly from the binary data. As with the in-place parser, 
+        // the JSONValue is only created if needed.
+        binaryData = (const uint8_t *)getJsonData();
+        jsonObj = JSONValue();
+        clearKeyIndex();
+        jsonObjStale = true;
+        stringPoolStale = true;
+        if (tokens) {
+            numTokens = 0;
+            buildTokenIndex();
+        }
+        return;
+    }
+    binaryData = 0;
+
+    if (!tokens) {
+        jsonObj = JSONValue::parseCopy(getJsonData());
+        buildKeyIndex();
+        stringPoolStale = true;
+        return;
+    }
+
+    // In-place parser. The JSONValue is only created if one of the methods that 
+    // returns a JSONValue is called.
+    jsonObj = JSONValue();
+    clearKeyIndex();
+    jsonObjStale = true;
+
+    const char *json = getJsonData();
+    size_t jsonLen = strlen(json);
+    if (isTokenCacheValid(jsonLen)) {
+        // Tokens in retained memory are still valid for this data
+        numTokens = tokenCache->numTokens;
+        tokenCacheHit = true;
+        stringPoolStale = true;
+        return;
+    }
+    if (tokenCache) {
+        // Invalidate first, in case of a reset before the cache is saved again
+        tokenCache->magic = 0;
+    }
+
+    int result = tokenize(json, jsonLen, tokens, maxTokens);
+    if (result < 0) {
+        if (json[0]) {
+            Log.info("tokenize failed (data not valid or more than %u tokens)", maxTokens);
+        }
+        result = 0;
+    }
+    numTokens = (size_t) result;
+
+    buildTokenIndex();
+
+    CloudConfigDataHeader *header = getDataHeader();
+    if (tokenCache && header && header->dataHash && jsonLen <= 0xffff) {
+        tokenCache->dataHash = header->dataHash;
+        tokenCache->dataLen = (uint16_t) jsonLen;
+        tokenCache->numTokens = (uint16_t) numTokens;
+        tokenCache->maxTokens = (uint16_t) maxTokens;
+        tokenCache->indexSize = (uint16_t) tokenIndexSize;
+        tokenCache->checksum = getTokenCacheChecksum();
+        tokenCache->magic = CloudConfigTokenCache::MAGIC;
+    }
+
+    stringPoolStale = true;
+}
+
+uint32_t CloudConfigStorage::getTokenCacheChecksum() const {
+    // Same as hashKey(), over the fields after checksum
+    const uint8_t *p = (const uint8_t *)&tokenCache->dataLen;
+    const uint8_t *end = (const uint8_t *)&tokenCache[1];
+    uint32_t hash = 2166136261 ^ tokenCache->dataHash;
+    for(; p < end; p++) {
+        hash = (hash ^ *p) * 16777619;
+    }
+    return hash;
+}
+
+bool CloudConfigStorage::isTokenCacheValid(size_t jsonLen) {
+    CloudConfigDataHeader *header = getDataHeader();
+    if (!tokenCache || !header || header->dataHash == 0) {
+        // The hash is required as it's the only check that the data was not changed
+        return false;
+    }
+
+    if (tokenCache->magic != CloudConfigTokenCache::MAGIC ||
+        tokenCache->dataHash != header->dataHash ||
+        tokenCache->dataLen != jsonLen ||
+        tokenCache->maxTokens != maxTokens ||
+        tokenCache->indexSize != tokenIndexSize ||
+        tokenCache->numTokens > maxTokens) {
+        return false;
+    }
+    return tokenCache->checksum == getTokenCacheChecksum();
+}
+
+void CloudConfigStorage::parseJSONValue() {
+    if (jsonObjStale) {
+        jsonObjStale = false;
+        if (binaryData) {
+            size_t len = getJsonText(NULL, 0);
+            char *json = new(std::nothrow) char[len + 1];
+            if (!json) {
+                return;
+            }
+            getJsonText(json, len + 1);
+            jsonObj = JSONValue::parseCopy(json);
+            delete[] json;
+        }
+        else {
+            jsonObj = JSONValue::parseCopy(getJsonData());
+        }
+        buildKeyIndex();
+    }
+}
+
+size_t CloudConfigStorage::getJsonText(char *buf, size_t bufSize) {
+    size_t len = 0;
+
+    // Appends to buf, truncating if necessary, but always updating len
+    auto append = [&](const char *data, size_t dataLen) {
+        for(size_t ii = 0; ii < dataLen; ii++, len++) {
+            if (len + 1 < bufSize) {
+                buf[len] = data[ii];
+            }
+        }
+    };
+
+    // Appends a JSON string including the double quotes
+    auto appendString = [&](const char *str, size_t strLen) {
+        len += escapeString(str, strLen, (len < bufSize) ? &buf[len] : NULL, (len < bufSize) ? bufSize - len : 0);
+    };
+
+    if (!binaryData) {
+        const char *json = getJsonData();
+        append(json, strlen(json));
+    }
+    else {
+        // Entries are stored in the original order
+        size_t numKeys = binaryData[1];
+        const uint8_t *entry = &binaryData[BINARY_HEADER_SIZE];
+
+        append("{", 1);
+        for(size_t ii = 0; ii < numKeys; ii++) {
+            if (ii > 0) {
+                append(",", 1);
+            }
+            appendString(getBinaryKey(entry), getBinaryKeyLen(entry));
+            append(":", 1);
+
+            size_t textLen;
+            switch(getBinaryType(entry)) {
+            case BINARY_STRING: {
+                const char *text = getBinaryText(entry, &textLen);
+                appendString(text, textLen);
+                break;
+            }
+
+            case BINARY_JSON: {
+                const char *text = getBinaryText(entry, &textLen);
+                append(text, textLen);
+                break;
+            }
+
+            default: {
+                char temp[32];
+                size_t tempLen = formatBinaryValue(entry, temp, sizeof(temp));
+                append(temp, tempLen);
+                break;
+            }
+            }
+            entry = getNextBinaryEntry(entry);
+        }
+        append("}", 1);
+    }
+
+    if (bufSize > 0) {
+        buf[(len < bufSize) ? len : (bufSize - 1)] = 0;
+    }
+    return len;
+}
+
+JSONValue CloudConfigStorage::getJSONValueForKey(const char *key) {
+    parseJSONValue();
+
+    if (!keyIndex) {
+        // No index (not an object, or could not allocate), use a linear search
+        return getJSONValueForKey(jsonObj, key);
+    }
+
+    uint32_t hash = hashKey(key);
+    size_t mask = keyIndexSize - 1;
+
+    for(size_t ii = hash & mask; keyIndex[ii].name; ii = (ii + 1) & mask) {
+        if (keyIndex[ii].hash == hash && strcmp(keyIndex[ii].name, key) == 0) {
+            // Found
+            return keyIndex[ii].value;
+        }
+    }
+    return JSONValue(); // Invalid JSONValue
+}
+
+void CloudConfigStorage::buildKeyIndex() {
+    clearKeyIndex();
+
+    if (!jsonObj.isObject()) {
+        return;
+    }
+
+    JSONObjectIterator iter(jsonObj);
+
+    size_t size = getHashTableSize(iter.count());
+
+    keyIndex = new(std::nothrow) KeyIndexEntry[size];
+    if (!keyIndex) {
+        return;
+    }
+    keyIndexSize = size;
+
+    for(size_t ii = 0; ii < keyIndexSize; ii++) {
+        keyIndex[ii].name = 0;
+    }
+
+    size_t mask = keyIndexSize - 1;
+
+    while(iter.next()) {
+        const char *name = (const char *)iter.name();
+        uint32_t hash = hashKey(name);
+
+        size_t ii = hash & mask;
+        while(keyIndex[ii].name && strcmp(keyIndex[ii].name, name) != 0) {
+            ii = (ii + 1) & mask;
+        }
+        if (keyIndex[ii].name) {
+            // Duplicate key
+            continue;
+        }
+        keyIndex[ii].hash = hash;
+        keyIndex[ii].name = name;
+        keyIndex[ii].value = iter.value();
+    }
+}
+
+void CloudConfigStorage::clearKeyIndex() {
+    if (keyIndex) {
+        delete[] keyIndex;
+        keyIndex = 0;
+    }
+    keyIndexSize = 0;
+}
+
+void CloudConfigStorage::buildStringPool() {
+    clearStringPool();
+
+    // Calls fn(name, nameLen, value, valueLen, escaped) for each top level primitive value
+    auto forEachValue = [&](std::function<void(const char *, size_t, const char *, size_t, bool)> fn) {
+        if (binaryData) {
+            // Strings are returned directly from the binary data, so only numbers, booleans, and null
+            const uint8_t *entry = &binaryData[BINARY_HEADER_SIZE];
+            for(size_t ii = 0; ii < binaryData[1]; ii++, entry = getNextBinaryEntry(entry)) {
+                uint8_t type = getBinaryType(entry);
+                if (type != BINARY_STRING && type != BINARY_JSON) {
+                    char value[32];
+                    size_t valueLen = formatBinaryValue(entry, value, sizeof(value));
+                    fn(getBinaryKey(entry), getBinaryKeyLen(entry), value, valueLen, false);
+                }
+            }
+        }
+        else
+        if (tokens) {
+            if (numTokens == 0 || tokens[0].type != JSON_TYPE_OBJECT) {
+                return;
+            }
+            const char *json = getJsonData();
+            for(size_t keyToken = 1; keyToken + 1 < numTokens; keyToken += 1 + tokens[keyToken + 1].count) {
+                const CloudConfigToken &keyTok = tokens[keyToken];
+                const CloudConfigToken &valueTok = tokens[keyToken + 1];
+                if (valueTok.type != JSON_TYPE_OBJECT && valueTok.type != JSON_TYPE_ARRAY) {
+                    fn(&json[keyTok.start], keyTok.end - keyTok.start, 
+                        &json[valueTok.start], valueTok.end - valueTok.start, valueTok.type == JSON_TYPE_STRING);
+                }
+            }
+        }
+        else {
+            JSONObjectIterator iter(jsonObj);
+            while(iter.next()) {
+                JSONValue value = iter.value();
+                if (!value.isObject() && !value.isArray()) {
+                    JSONString name = iter.name();
+                    JSONString str = value.toString();
+                    fn(name.data(), name.size(), str.data(), str.size(), false);
+                }
+            }
+        }
+    };
+
+    // Keys in the in-place parser are also escaped, but unescaping never makes a string longer
+    size_t numValues = 0;
+    size_t poolSize = 0;
+    forEachValue([&](const char *name, size_t nameLen, const char *value, size_t valueLen, bool escaped) {
+        numValues++;
+        poolSize += nameLen + 1 + valueLen + 1;
+    });
+    if (numValues == 0) {
+        return;
+    }
+
+    size_t size = getHashTableSize(numValues);
+
+    stringPool = new(std::nothrow) char[poolSize];
+    stringIndex = new(std::nothrow) StringPoolEntry[size];
+    if (!stringPool || !stringIndex) {
+        clearStringPool();
+        return;
+    }
+    stringIndexSize = size;
+
+    // Hash table of the values, only used while building the pool to find identical values.
+    // If it can't be allocated, values are not shared.
+    const char **valueIndex = new(std::nothrow) const char *[size];
+
+    for(size_t ii = 0; ii < stringIndexSize; ii++) {
+        stringIndex[ii].name = 0;
+        if (valueIndex) {
+            valueIndex[ii] = 0;
+        }
+    }
+
+    size_t mask = stringIndexSize - 1;
+    size_t poolLen = 0;
+
+    // Keys in binary format data are stored unescaped
+    bool keysEscaped = (tokens && !binaryData);
+
+    // Copies a string into the pool, returns a pointer to it
+    auto addString = [&](const char *str, size_t len, bool escaped) -> char * {
+        char *dst = &stringPool[poolLen];
+        if (escaped) {
+            len = unescapeString(str, len, dst, len + 1);
+        }
+        else {
+            memcpy(dst, str, len);
+            dst[len] = 0;
+        }
+        poolLen += len + 1;
+        return dst;
+    };
+
+    forEachValue([&](const char *name, size_t nameLen, const char *value, size_t valueLen, bool escaped) {
+        size_t savedLen = poolLen;
+        const char *poolName = addString(name, nameLen, keysEscaped);
+        uint32_t hash = hashKey(poolName);
+
+        size_t ii = hash & mask;
+        while(stringIndex[ii].name && strcmp(stringIndex[ii].name, poolName) != 0) {
+            ii = (ii + 1) & mask;
+        }
+        if (stringIndex[ii].name) {
+            // Duplicate key
+            poolLen = savedLen;
+            return;
+        }
+
+        size_t valueStart = poolLen;
+        const char *poolValue = addString(value, valueLen, escaped);
+        if (valueIndex) {
+            size_t jj;
+            for(jj = hashKey(poolValue) & mask; valueIndex[jj]; jj = (jj + 1) & mask) {
+                if (strcmp(valueIndex[jj], poolValue) == 0) {
+                    // Same value as an earlier key, share it
+                    poolValue = valueIndex[jj];
+                    poolLen = valueStart;
+                    break;
+                }
+            }
+            if (!valueIndex[jj]) {
+                valueIndex[jj] = poolValue;
+            }
+        }
+
+        stringIndex[ii].hash = hash;
+        stringIndex[ii].name = poolName;
+        stringIndex[ii].value = poolValue;
+    });
+
+    delete[] valueIndex;
+}
+
+void CloudConfigStorage::clearStringPool() {
+    if (stringIndex) {
+        delete[] stringIndex;
+        stringIndex = 0;
+    }
+    if (stringPool) {
+        delete[] stringPool;
+        stringPool = 0;
+    }
+    stringIndexSize = 0;
+}
+
+// [static]
+uint32_t CloudConfigStorage::hashKey(const char *key, size_t keyLen) {
+    uint32_t hash = 2166136261;
+    for(size_t ii = 0; ii < keyLen; ii++) {
+        hash ^= (uint8_t)key[ii];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// [static]
+size_t CloudConfigStorage::getHashTableSize(size_t numEntries) {
+    size_t size = 4;
+    while(size < numEntries * 2) {
+        size <<= 1;
+    }
+    return size;
+}
+
+void CloudConfigStorage::buildTokenIndex() {
+    for(size_t ii = 0; ii < tokenIndexSize; ii++) {
+        tokenIndex[ii] = 0;
+    }
+
+    if (numTokens == 0 || tokens[0].type != JSON_TYPE_OBJECT) {
+        return;
+    }
+
+    const char *json = getJsonData();
+    size_t mask = tokenIndexSize - 1;
+
+    // Key tokens are followed by their value token, then next key is after the whole value
+    for(size_t keyToken = 1; keyToken + 1 < numTokens; keyToken += 1 + tokens[keyToken + 1].count) {
+        const CloudConfigToken &tok = tokens[keyToken];
+        const char *name = &json[tok.start];
+        size_t nameLen = tok.end - tok.start;
+
+        // Keys are hashed and compared unescaped, the same as the key passed to findToken().
+        // The number of probes is limited in case there are more keys than index entries.
+        size_t ii = hashEscapedKey(name, nameLen) & mask;
+        size_t probes;
+        for(probes = 0; probes < tokenIndexSize && tokenIndex[ii]; probes++, ii = (ii + 1) & mask) {
+            const CloudConfigToken &tok2 = tokens[tokenIndex[ii] - 1];
+            if ((size_t)(tok2.end - tok2.start) == nameLen && memcmp(&json[tok2.start], name, nameLen) == 0) {
+                // Same escaped key. Differently escaped duplicates are both indexed, and
+                // findToken() finds the first.
+                break;
+            }
+        }
+        if (probes == tokenIndexSize) {
+            Log.info("token index full (%u entries), not all keys can be found", (unsigned)tokenIndexSize);
+            break;
+        }
+        if (!tokenIndex[ii]) {
+            // Not a duplicate key
+            tokenIndex[ii] = (uint16_t)(keyToken + 1);
+        }
+    }
+}
+
+int CloudConfigStorage::findToken(const char *key) const {
+    if (!tokens || numTokens == 0) {
+        return -1;
+    }
+
+    const char *json = getJsonData();
+    size_t keyLen = strlen(key);
+    size_t mask = tokenIndexSize - 1;
+
+    size_t ii = hashKey(key, keyLen) & mask;
+    for(size_t probes = 0; probes < tokenIndexSize && tokenIndex[ii]; probes++, ii = (ii + 1) & mask) {
+        size_t keyToken = tokenIndex[ii] - 1;
+        const CloudConfigToken &tok = tokens[keyToken];
+        if (isSameKey(&json[tok.start], tok.end - tok.start, key, keyLen)) {
+            // Found, return the value token
+            return (int)keyToken + 1;
+        }
+    }
+    return -1;
+}
+
+bool CloudConfigStorage::hasKey(const char *key) {
+    if (binaryData) {
+        return findBinaryEntry(key) != NULL;
+    }
+    if (tokens) {
+        return findToken(key) >= 0;
+    }
+    return getJSONValueForKey(key).isValid();
+}
+
+bool CloudConfigStorage::isNull(const char *key) {
+    if (binaryData) {
+        const uint8_t *entry = findBinaryEntry(key);
+        return entry && getBinaryType(entry) == BINARY_NULL;
+    }
+    if (tokens) {
+        int index = findToken(key);
+        return index >= 0 && tokens[index].type == JSON_TYPE_NULL;
+    }
+    return getJSONValueForKey(key).isNull();
+}
+
+int CloudConfigStorage::getInt(const char *key) {
+    if (binaryData) {
+        const uint8_t *entry = findBinaryEntry(key);
+        uint8_t type = entry ? getBinaryType(entry) : BINARY_NULL;
+        if (isBinaryNumber(type)) {
+            return (int) getBinaryNumber(entry);
+        }
+        if (type == BINARY_STRING) {
+            return (int) strtol(getBinaryText(entry), NULL, 10);
+        }
+        return (type == BINARY_TRUE) ? 1 : 0;
+    }
+
+    if (!tokens) {
+        return getJSONValueForKey(key).toInt();
+    }
+    return tokenToInt(findToken(key));
+}
+
+int CloudConfigStorage::tokenToInt(int index) const {
+    if (index < 0) {
+        return 0;
+    }
+    const CloudConfigToken &tok = tokens[index];
+    const char *value = &getJsonData()[tok.start];
+
+    switch(tok.type) {
+    case JSON_TYPE_BOOL:
+        return (value[0] == 't') ? 1 : 0;
+
+    case JSON_TYPE_NUMBER:
+    case JSON_TYPE_STRING:
+        // strtol stops at the delimiter or closing double quote
+        return (int) strtol(value, NULL, 10);
+
+    default:
+        return 0;
+    }
+}
+
+bool CloudConfigStorage::getBool(const char *key) {
+    if (binaryData) {
+        const uint8_t *entry = findBinaryEntry(key);
+        uint8_t type = entry ? getBinaryType(entry) : BINARY_NULL;
+        if (type == BINARY_STRING) {
+            const char *value = getBinaryText(entry);
+            return strcmp(value, "true") == 0 || strtod(value, NULL) != 0;
+        }
+        if (isBinaryNumber(type)) {
+            return getBinaryNumber(entry) != 0;
+        }
+        return type == BINARY_TRUE;
+    }
+
+    if (!tokens) {
+        return getJSONValueForKey(key).toBool();
+    }
+    return tokenToBool(findToken(key));
+}
+
+bool CloudConfigStorage::tokenToBool(int index) const {
+    if (index < 0) {
+        return false;
+    }
+    const CloudConfigToken &tok = tokens[index];
+    const char *value = &getJsonData()[tok.start];
+
+    switch(tok.type) {
+    case JSON_TYPE_BOOL:
+        return value[0] == 't';
+
+    case JSON_TYPE_NUMBER:
+        return strtod(value, NULL) != 0;
+
+    case JSON_TYPE_STRING:
+        if ((tok.end - tok.start) == 4 && strncmp(value, "true", 4) == 0) {
+            return true;
+        }
+        return strtod(value, NULL) != 0;
+
+    default:
+        return false;
+    }
+}
+
+double CloudConfigStorage::getDouble(const char *key) {
+    if (binaryData) {
+        const uint8_t *entry = findBinaryEntry(key);
+        uint8_t type = entry ? getBinaryType(entry) : BINARY_NULL;
+        if (isBinaryNumber(type)) {
+            return getBinaryNumber(entry);
+        }
+        if (type == BINARY_STRING) {
+            return strtod(getBinaryText(entry), NULL);
+        }
+        return (type == BINARY_TRUE) ? 1 : 0;
+    }
+
+    if (!tokens) {
+        return getJSONValueForKey(key).toDouble();
+    }
+    return tokenToDouble(findToken(key));
+}
+
+double CloudConfigStorage::tokenToDouble(int index) const {
+    if (index < 0) {
+        return 0;
+    }
+    const CloudConfigToken &tok = tokens[index];
+    const char *value = &getJsonData()[tok.start];
+
+    switch(tok.type) {
+    case JSON_TYPE_BOOL:
+        return (value[0] == 't') ? 1 : 0;
+
+    case JSON_TYPE_NUMBER:
+    case JSON_TYPE_STRING:
+        return strtod(value, NULL);
+
+    default:
+        return 0;
+    }
+}
+
+const char *CloudConfigStorage::getString(const char *key) {
+    if (binaryData) {
+        // Strings are stored unescaped and null terminated so they can be returned directly
+        const uint8_t *entry = findBinaryEntry(key);
+        if (!entry) {
+            return "";
+        }
+        if (getBinaryType(entry) == BINARY_STRING) {
+            return getBinaryText(entry);
+        }
+    }
+
+    if (stringPoolStale) {
+        stringPoolStale = false;
+        buildStringPool();
+    }
+
+    if (stringIndex) {
+        uint32_t hash = hashKey(key);
+        size_t mask = stringIndexSize - 1;
+
+        for(size_t ii = hash & mask; stringIndex[ii].name; ii = (ii + 1) & mask) {
+            if (stringIndex[ii].hash == hash && strcmp(stringIndex[ii].name, key) == 0) {
+                return stringIndex[ii].value;
+            }
+        }
+        // Not found, or an object or array, which are not converted to strings
+        return "";
+    }
+
+    // The string pool could not be allocated. A JSONString from a temporary JSONValue is not 
+    // valid after returning, so use copyString() instead.
+    return "";
+}
+
+bool CloudConfigStorage::copyString(const char *key, char *buf, size_t bufSize) {
+    if (binaryData) {
+        const uint8_t *entry = findBinaryEntry(key);
+        if (entry && getBinaryType(entry) == BINARY_STRING) {
+            strncpy(buf, getBinaryText(entry), bufSize - 1);
+            buf[bufSize - 1] = 0;
+        }
+        else
+        if (entry && getBinaryType(entry) == BINARY_JSON) {
+            // Objects and arrays are not converted to strings, same as JSONValue::toString()
+            buf[0] = 0;
+        }
+        else {
+            formatBinaryValue(entry, buf, bufSize);
+        }
+        return entry != NULL;
+    }
+
+    if (!tokens) {
+        JSONValue value = getJSONValueForKey(key);
+        strncpy(buf, value.toString().data(), bufSize - 1);
+        buf[bufSize - 1] = 0;
+        return value.isValid();
+    }
+    return tokenToString(findToken(key), buf, bufSize);
+}
+
+bool CloudConfigStorage::tokenToString(int index, char *buf, size_t bufSize) const {
+    if (index < 0 || tokens[index].type == JSON_TYPE_OBJECT || tokens[index].type == JSON_TYPE_ARRAY) {
+        // Objects and arrays are not converted to strings, same as JSONValue::toString()
+        buf[0] = 0;
+        return index >= 0;
+    }
+
+    const CloudConfigToken &tok = tokens[index];
+    const char *value = &getJsonData()[tok.start];
+    if (tok.type == JSON_TYPE_STRING) {
+        unescapeString(value, tok.end - tok.start, buf, bufSize);
+    }
+    else {
+        size_t len = tok.end - tok.start;
+        if (len > bufSize - 1) {
+            len = bufSize - 1;
+        }
+        memcpy(buf, value, len);
+        buf[len] = 0;
+    }
+    return true;
+}
+
+JSONValue CloudConfigStorage::getJSONValueAtPath(CloudConfigPath &path) {
+    if (path.valueStorage == this && path.valueGeneration == parseGeneration) {
+        return path.value;
+    }
+
+    JSONValue value;
+    for(size_t ii = 0; ii < path.numSegments; ii++) {
+        const CloudConfigPath::Segment &seg = path.segments[ii];
+        const char *name = &path.pathBuf[seg.offset];
+
+        if (ii == 0) {
+            // Top level key names use the key index
+            value = seg.isKey ? getJSONValueForKey(name) : getJSONValueAtIndex(getJSONValue(), seg.index);
+        }
+        else {
+            value = seg.isKey ? getJSONValueForKey(value, name) : getJSONValueAtIndex(value, seg.index);
+        }
+        if (!value.isValid()) {
+            break;
+        }
+    }
+
+    path.valueStorage = this;
+    path.valueGeneration = parseGeneration;
+    path.value = value;
+    return value;
+}
+
+int CloudConfigStorage::findPathToken(CloudConfigPath &path) {
+    if (!tokens || numTokens == 0) {
+        return -1;
+    }
+    if (path.tokenStorage == this && path.tokenGeneration == parseGeneration) {
+        return path.tokenIndex;
+    }
+
+    int index = path.isValid() ? 0 : -1;
+    for(size_t ii = 0; ii < path.numSegments && index >= 0; ii++) {
+        const CloudConfigPath::Segment &seg = path.segments[ii];
+        const CloudConfigToken &tok = tokens[index];
+
+        if (seg.isKey) {
+            const char *name = &path.pathBuf[seg.offset];
+            if (tok.type != JSON_TYPE_OBJECT) {
+                index = -1;
+            }
+            else
+            if (index == 0) {
+                // Top level key names use the key index
+                index = findToken(name);
+            }
+            else {
+                const char *json = getJsonData();
+                size_t nameLen = strlen(name);
+                size_t keyToken = index + 1;
+
+                index = -1;
+                for(size_t jj = 0; jj < tok.size; jj++, keyToken += 1 + tokens[keyToken + 1].count) {
+                    const CloudConfigToken &keyTok = tokens[keyToken];
+                    if (isSameKey(&json[keyTok.start], keyTok.end - keyTok.start, name, nameLen)) {
+                        index = (int)keyToken + 1;
+                        break;
+                    }
+                }
+            }
+        }
+        else {
+            if (tok.type != JSON_TYPE_ARRAY || seg.index >= tok.size) {
+                index = -1;
+            }
+            else {
+                // Skip over the earlier values, including any nested objects and arrays
+                size_t valueToken = index + 1;
+                for(size_t jj = 0; jj < seg.index; jj++) {
+                    valueToken += tokens[valueToken].count;
+                }
+                index = (int)valueToken;
+            }
+        }
+    }
+
+    path.tokenStorage = this;
+    path.tokenGeneration = parseGeneration;
+    path.tokenIndex = index;
+    return index;
+}
+
+bool CloudConfigStorage::hasKey(CloudConfigPath &path) {
+    if (path.isTopLevelKey()) {
+        return hasKey(path.getFirstKey());
+    }
+    if (tokens && !binaryData) {
+        return findPathToken(path) >= 0;
+    }
+    return getJSONValueAtPath(path).isValid();
+}
+
+int CloudConfigStorage::getInt(CloudConfigPath &path) {
+    if (path.isTopLevelKey()) {
+        return getInt(path.getFirstKey());
+    }
+    if (tokens && !binaryData) {
+        return tokenToInt(findPathToken(path));
+    }
+    return getJSONValueAtPath(path).toInt();
+}
+
+bool CloudConfigStorage::getBool(CloudConfigPath &path) {
+    if (path.isTopLevelKey()) {
+        return getBool(path.getFirstKey());
+    }
+    if (tokens && !binaryData) {
+        return tokenToBool(findPathToken(path));
+    }
+    return getJSONValueAtPath(path).toBool();
+}
+
+double CloudConfigStorage::getDouble(CloudConfigPath &path) {
+    if (path.isTopLevelKey()) {
+        return getDouble(path.getFirstKey());
+    }
+    if (tokens && !binaryData) {
+        return tokenToDouble(findPathToken(path));
+    }
+    return getJSONValueAtPath(path).toDouble();
+}
+
+bool CloudConfigStorage::copyString(CloudConfigPath &path, char *buf, size_t bufSize) {
+    if (path.isTopLevelKey()) {
+        return copyString(path.getFirstKey(), buf, bufSize);
+    }
+    if (tokens && !binaryData) {
+        return tokenToString(findPathToken(path), buf, bufSize);
+    }
+    JSONValue value = getJSONValueAtPath(path);
+    strncpy(buf, value.toString().data(), bufSize - 1);
+    buf[bufSize - 1] = 0;
+    return value.isValid();
+}
+
+// [static]
+int CloudConfigStorage::tokenize(const char *json, size_t jsonLen, CloudConfigToken *tokens, size_t maxTokens) {
+    size_t numTokens = 0;
+    int parent = -1;
+    bool wantKey = false;
+    bool wantColon = false;
+    bool haveValue = false;
+
+    // Allocates a new token, returns NULL if out of tokens
+    auto newToken = [&](uint8_t type, size_t start) -> CloudConfigToken * {
+        if (numTokens >= maxTokens || start > 0xffff) {
+            return NULL;
+        }
+        CloudConfigToken *tok = &tokens[numTokens++];
+        tok->type = type;
+        tok->reserved = 0;
+        tok->size = 0;
+        tok->start = (uint16_t) start;
+        tok->end = (uint16_t) start;
+        tok->count = 1;
+        tok->parent = (int16_t) parent;
+        if (parent >= 0 && (tokens[parent].type == JSON_TYPE_ARRAY || wantKey)) {
+            // Count values in arrays and keys in objects
+            tokens[parent].size++;
+        }
+        return tok;
+    };
+
+    for(size_t pos = 0; pos < jsonLen && json[pos]; pos++) {
+        char c = json[pos];
+        switch(c) {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            break;
+
+        case '{':
+        case '[': {
+            if (wantKey || haveValue || (parent < 0 && numTokens > 0)) {
+                return -1;
+            }
+            CloudConfigToken *tok = newToken((c == '{') ? JSON_TYPE_OBJECT : JSON_TYPE_ARRAY, pos);
+            if (!tok) {
+                return -1;
+            }
+            parent = (int)numTokens - 1;
+            wantKey = (c == '{');
+            break;
+        }
+
+        case '}':
+        case ']': {
+            if (parent < 0 || tokens[parent].type != ((c == '}') ? JSON_TYPE_OBJECT : JSON_TYPE_ARRAY)) {
+                return -1;
+            }
+            if (wantColon || (!haveValue && tokens[parent].size > 0)) {
+                // Trailing comma, or key without a value
+                return -1;
+            }
+            CloudConfigToken &tok = tokens[parent];
+            tok.end = (uint16_t)(pos + 1);
+            tok.count = (uint16_t)(numTokens - parent);
+            parent = tok.parent;
+            wantKey = false;
+            haveValue = true;
+            break;
+        }
+
+        case ':':
+            if (!wantColon) {
+                return -1;
+            }
+            wantColon = false;
+            haveValue = false;
+            break;
+
+        case ',':
+            if (parent < 0 || !haveValue || wantColon) {
+                return -1;
+            }
+            haveValue = false;
+            wantKey = (tokens[parent].type == JSON_TYPE_OBJECT);
+            break;
+
+        case '"': {
+            if (haveValue || (parent < 0 && numTokens > 0)) {
+                return -1;
+            }
+            CloudConfigToken *tok = newToken(JSON_TYPE_STRING, pos + 1);
+            if (!tok) {
+                return -1;
+            }
+            for(pos++; pos < jsonLen && json[pos] != '"'; pos++) {
+                if (json[pos] == 0) {
+                    return -1;
+                }
+                if (json[pos] == '\\') {
+                    pos++;
+                }
+            }
+            if (pos >= jsonLen) {
+                return -1;
+            }
+            tok->end = (uint16_t) pos;
+            wantColon = wantKey;
+            wantKey = false;
+            haveValue = true;
+            break;
+        }
+
+        default: {
+            if (wantKey || haveValue || (parent < 0 && numTokens > 0)) {
+                return -1;
+            }
+            uint8_t type;
+            if (c == 't' || c == 'f') {
+                type = JSON_TYPE_BOOL;
+            }
+            else
+            if (c == 'n') {
+                type = JSON_TYPE_NULL;
+            }
+            else
+            if (c == '-' || (c >= '0' && c <= '9')) {
+                type = JSON_TYPE_NUMBER;
+            }
+            else {
+                return -1;
+            }
+            CloudConfigToken *tok = newToken(type, pos);
+            if (!tok) {
+                return -1;
+            }
+            while(pos + 1 < jsonLen && json[pos + 1] && strchr(" \t\r\n,]}", json[pos + 1]) == NULL) {
+                pos++;
+            }
+            tok->end = (uint16_t)(pos + 1);
+
+            // Only the first character has been checked so far
+            const char *value = &json[tok->start];
+            size_t valueLen = tok->end - tok->start;
+            bool valid;
+            if (type == JSON_TYPE_NUMBER) {
+                valid = isValidNumber(value, valueLen);
+            }
+            else {
+                const char *literal = (c == 't') ? "true" : (c == 'f') ? "false" : "null";
+                valid = (valueLen == strlen(literal) && memcmp(value, literal, valueLen) == 0);
+            }
+            if (!valid) {
+                return -1;
+            }
+            haveValue = true;
+            break;
+        }
+        }
+    }
+
+    if (parent >= 0 || numTokens == 0) {
+        // Incomplete or empty
+        return -1;
+    }
+    return (int) numTokens;
+}
+
+// [static]
+bool CloudConfigStorage::isValidNumber(const char *str, size_t len) {
+    size_t ii = 0;
+    auto digits = [&]() {
+        size_t start = ii;
+        while(ii < len && str[ii] >= '0' && str[ii] <= '9') {
+            ii++;
+        }
+        return ii - start;
+    };
+
+    if (ii < len && str[ii] == '-') {
+        ii++;
+    }
+    // No leading zeros
+    if (ii < len && str[ii] == '0') {
+        ii++;
+    }
+    else
+    if (digits() == 0) {
+        return false;
+    }
+    if (ii < len && str[ii] == '.') {
+        ii++;
+        if (digits() == 0) {
+            return false;
+        }
+    }
+    if (ii < len && (str[ii] == 'e' || str[ii] == 'E')) {
+        ii++;
+        if (ii < len && (str[ii] == '+' || str[ii] == '-')) {
+            ii++;
+        }
+        if (digits() == 0) {
+            return false;
+        }
+    }
+    return ii == len;
+}
+
+// [static]
+int CloudConfigStorage::findObjectKey(const char *json, const CloudConfigToken *tokens, int objToken, const char *key, size_t keyLen) {
+    int keyToken = objToken + 1;
+    for(size_t ii = 0; ii < tokens[objToken].size; ii++) {
+        const CloudConfigToken &tok = tokens[keyToken];
+        if ((size_t)(tok.end - tok.start) == keyLen && memcmp(&json[tok.start], key, keyLen) == 0) {
+            return keyToken + 1;
+        }
+        keyToken += 1 + tokens[keyToken + 1].count;
+    }
+    return -1;
+}
+
+// [static]
+bool CloudConfigStorage::mergePatch(const char *target, const char *patch, char *buf, size_t bufSize, bool nullRemoves) {
+    // There can't be more tokens than half of the characters (primitive and comma), plus the outer token
+    size_t targetLen = strlen(target);
+    size_t patchLen = strlen(patch);
+    size_t targetMaxTokens = targetLen / 2 + 2;
+    size_t patchMaxTokens = patchLen / 2 + 2;
+
+    CloudConfigToken *targetTokens = new(std::nothrow) CloudConfigToken[targetMaxTokens + patchMaxTokens];
+    if (!targetTokens) {
+        return false;
+    }
+    CloudConfigToken *patchTokens = &targetTokens[targetMaxTokens];
+
+    bool result = false;
+    int numTargetTokens = targetLen ? tokenize(target, targetLen, targetTokens, targetMaxTokens) : 0;
+    int numPatchTokens = tokenize(patch, patchLen, patchTokens, patchMaxTokens);
+    if (numTargetTokens >= 0 && numPatchTokens > 0) {
+        size_t len = 0;
+
+        // Appends raw JSON data to buf
+        auto append = [&](const char *data, size_t dataLen) -> bool {
+            if (len + dataLen >= bufSize) {
+                return false;
+            }
+            memcpy(&buf[len], data, dataLen);
+            len += dataLen;
+            return true;
+        };
+
+        // Appends the JSON for a token, including the double quotes for strings
+        auto appendToken = [&](const char *json, const CloudConfigToken &tok) -> bool {
+            if (tok.type == JSON_TYPE_STRING) {
+                return append(&json[tok.start - 1], tok.end - tok.start + 2);
+            }
+            return append(&json[tok.start], tok.end - tok.start);
+        };
+
+        // Writes the result of merging patchToken into targetToken (-1 if there is no target value)
+        std::function<bool(int, int)> merge = [&](int targetToken, int patchToken) -> bool {
+            const CloudConfigToken &patchTok = patchTokens[patchToken];
+            if (patchTok.type != JSON_TYPE_OBJECT) {
+                // Non-object values replace the target
+                return appendToken(patch, patchTok);
+            }
+            if (targetToken >= 0 && targetTokens[targetToken].type != JSON_TYPE_OBJECT) {
+                // Patch is an object but target is not, so merge into an empty object
+                targetToken = -1;
+            }
+
+            bool first = true;
+            auto appendKey = [&](const char *json, const CloudConfigToken &keyTok) -> bool {
+                if (!first && !append(",", 1)) {
+                    return false;
+                }
+                first = false;
+                return appendToken(json, keyTok) && append(":", 1);
+            };
+
+            if (!append("{", 1)) {
+                return false;
+            }
+
+            if (targetToken >= 0) {
+                // Keys in the target, in their original order
+                int keyToken = targetToken + 1;
+                for(size_t ii = 0; ii < targetTokens[targetToken].size; ii++) {
+                    const CloudConfigToken &keyTok = targetTokens[keyToken];
+                    int patchValue = findObjectKey(patch, patchTokens, patchToken, &target[keyTok.start], keyTok.end - keyTok.start);
+                    if (patchValue < 0 || (!nullRemoves && patchTokens[patchValue].type == JSON_TYPE_NULL)) {
+                        // Not in patch (or null and nullRemoves is false), copy unchanged
+                        const CloudConfigToken &valueTok = targetTokens[keyToken + 1];
+                        if (!appendKey(target, keyTok) || !appendToken(target, valueTok)) {
+                            return false;
+                        }
+                    }
+                    else
+                    if (patchTokens[patchValue].type != JSON_TYPE_NULL) {
+                        if (!appendKey(target, keyTok) || !merge(keyToken + 1, patchValue)) {
+                            return false;
+                        }
+                    }
+                    // null in the patch removes the key from the target
+                    keyToken += 1 + targetTokens[keyToken + 1].count;
+                }
+            }
+
+            // Keys in the patch that are not in the target
+            int keyToken = patchToken + 1;
+            for(size_t ii = 0; ii < patchTok.size; ii++) {
+                const CloudConfigToken &keyTok = patchTokens[keyToken];
+                int valueToken = keyToken + 1;
+                bool inTarget = (targetToken >= 0) && findObjectKey(target, targetTokens, targetToken, &patch[keyTok.start], keyTok.end - keyTok.start) >= 0;
+                if (!inTarget && patchTokens[valueToken].type != JSON_TYPE_NULL) {
+                    if (!appendKey(patch, keyTok) || !merge(-1, valueToken)) {
+                        return false;
+                    }
+                }
+                keyToken += 1 + patchTokens[valueToken].count;
+            }
+
+            return append("}", 1);
+        };
+
+        if (merge((numTargetTokens > 0) ? 0 : -1, 0)) {
+            buf[len] = 0;
+            result = true;
+        }
+    }
+
+    delete[] targetTokens;
+    return result;
+}
+
+// [static]
+size_t CloudConfigStorage::jsonToBinary(const char *json, char *buf, size_t bufSize) {
+    size_t jsonLen = strlen(json);
+    size_t maxTokens = jsonLen / 2 + 2;
+    if (bufSize > 0xffff) {
+        bufSize = 0xffff;
+    }
+
+    CloudConfigToken *toks = new(std::nothrow) CloudConfigToken[maxTokens];
+    if (!toks) {
+        return 0;
+    }
+
+    size_t len = 0;
+    int numToks = tokenize(json, jsonLen, toks, maxTokens);
+
+    if (numToks > 0 && toks[0].type == JSON_TYPE_OBJECT && toks[0].size <= 0xff) {
+        size_t numKeys = 0;
+        size_t keyToken;
+
+        // Returns true if the key for keyToken appeared earlier in the object
+        auto isDuplicate = [&](size_t keyToken) -> bool {
+            const CloudConfigToken &tok = toks[keyToken];
+            return findObjectKey(json, toks, 0, &json[tok.start], tok.end - tok.start) != (int)keyToken + 1;
+        };
+
+        // Reserves space for count bytes, returning false if it does not fit
+        auto reserve = [&](size_t count) -> bool {
+            if (len + count > bufSize) {
+                len = 0;
+                return false;
+            }
+            return true;
+        };
+
+        // Writes a string or JSON length, 1 byte or 255 followed by a uint16_t
+        auto writeLength = [&](size_t pos, size_t textLen, bool longLength) {
+            if (longLength) {
+                uint16_t textLen16 = (uint16_t) textLen;
+                buf[pos] = (char) 0xff;
+                memcpy(&buf[pos + 1], &textLen16, sizeof(textLen16));
+            }
+            else {
+                buf[pos] = (char) textLen;
+            }
+        };
+
+        len = BINARY_HEADER_SIZE;
+        if (!reserve(0)) {
+            numToks = 0;
+        }
+
+        for(keyToken = 1; len && keyToken + 1 < (size_t)numToks; keyToken += 1 + toks[keyToken + 1].count) {
+            if (isDuplicate(keyToken)) {
+                continue;
+            }
+            const CloudConfigToken &keyTok = toks[keyToken];
+            const CloudConfigToken &valueTok = toks[keyToken + 1];
+            size_t start = len;
+
+            // Type and key length byte, key length byte for long keys, key. Unescaping never makes the key longer.
+            size_t keyLen = keyTok.end - keyTok.start;
+            bool longKey = (keyLen >= 15);
+            size_t keyPos = start + (longKey ? 2 : 1);
+            if (keyLen > 0xff || !reserve(keyPos - start + keyLen + 1)) {
+                len = 0;
+                break;
+            }
+            keyLen = unescapeString(&json[keyTok.start], keyLen, &buf[keyPos], keyLen + 1);
+            if (longKey) {
+                buf[start + 1] = (char) keyLen;
+            }
+            len = keyPos + keyLen;
+
+            const char *value = &json[valueTok.start];
+            size_t valueLen = valueTok.end - valueTok.start;
+            uint8_t type = BINARY_NULL;
+            switch(valueTok.type) {
+            case JSON_TYPE_NULL:
+                type = BINARY_NULL;
+                break;
+
+            case JSON_TYPE_BOOL:
+                type = (value[0] == 't') ? BINARY_TRUE : BINARY_FALSE;
+                break;
+
+            case JSON_TYPE_NUMBER: {
+                // Use the smallest type that holds the exact value
+                bool isInt = (strcspn(value, ".eE,]} \t\r\n") >= valueLen);
+                long long intValue = isInt ? strtoll(value, NULL, 10) : 0;
+                double doubleValue = strtod(value, NULL);
+                float floatValue = (float) doubleValue;
+                union {
+                    int8_t i8;
+                    int16_t i16;
+                    int32_t i32;
+                    float f;
+                    double d;
+                } num;
+                size_t numSize;
+
+                if (isInt && intValue >= INT8_MIN && intValue <= INT8_MAX) {
+                    type = BINARY_INT8;
+                    num.i8 = (int8_t) intValue;
+                    numSize = sizeof(num.i8);
+                }
+                else
+                if (isInt && intValue >= INT16_MIN && intValue <= INT16_MAX) {
+                    type = BINARY_INT16;
+                    num.i16 = (int16_t) intValue;
+                    numSize = sizeof(num.i16);
+                }
+                else
+                if (isInt && intValue >= INT32_MIN && intValue <= INT32_MAX) {
+                    type = BINARY_INT32;
+                    num.i32 = (int32_t) intValue;
+                    numSize = sizeof(num.i32);
+                }
+                else
+                if ((double) floatValue == doubleValue) {
+                    type = BINARY_FLOAT;
+                    num.f = floatValue;
+                    numSize = sizeof(num.f);
+                }
+                else {
+                    type = BINARY_DOUBLE;
+                    num.d = doubleValue;
+                    numSize = sizeof(num.d);
+                }
+                if (reserve(numSize)) {
+                    memcpy(&buf[len], &num, numSize);
+                    len += numSize;
+                }
+                break;
+            }
+
+            case JSON_TYPE_STRING:
+            default: {
+                // Length, value, null terminator
+                bool longLength = (valueLen >= 0xff);
+                size_t textPos = len + (longLength ? 3 : 1);
+                if (!reserve(textPos - len + valueLen + 1)) {
+                    break;
+                }
+                size_t textLen;
+                if (valueTok.type == JSON_TYPE_STRING) {
+                    type = BINARY_STRING;
+                    textLen = unescapeString(value, valueLen, &buf[textPos], valueLen + 1);
+                }
+                else {
+                    // Objects and arrays are stored as JSON text
+                    type = BINARY_JSON;
+                    textLen = valueLen;
+                    memcpy(&buf[textPos], value, valueLen);
+                    buf[textPos + valueLen] = 0;
+                }
+                writeLength(len, textLen, longLength);
+                len = textPos + textLen + 1;
+                break;
+            }
+            }
+            if (!len) {
+                break;
+            }
+            buf[start] = (char)((type << 4) | (longKey ? 15 : keyLen));
+            numKeys++;
+        }
+
+        if (len) {
+            uint16_t totalLen = (uint16_t) len;
+            buf[0] = (char) BINARY_MARKER;
+            buf[1] = (char) numKeys;
+            memcpy(&buf[2], &totalLen, sizeof(totalLen));
+
+            uint32_t crc = CloudConfigStorageData::crc32(&buf[BINARY_HEADER_SIZE], len - BINARY_HEADER_SIZE);
+            memcpy(&buf[4], &crc, sizeof(crc));
+        }
+    }
+
+    delete[] toks;
+    return len;
+}
+
+// [static]
+size_t CloudConfigStorage::isValidBinary(const char *data, size_t maxLen) {
+    if (maxLen < BINARY_HEADER_SIZE || (uint8_t)data[0] != BINARY_MARKER) {
+        return 0;
+    }
+
+    uint16_t totalLen;
+    uint32_t crc;
+    memcpy(&totalLen, &data[2], sizeof(totalLen));
+    memcpy(&crc, &data[4], sizeof(crc));
+
+    if (totalLen > maxLen || totalLen < BINARY_HEADER_SIZE) {
+        return 0;
+    }
+    if (crc != CloudConfigStorageData::crc32(&data[BINARY_HEADER_SIZE], totalLen - BINARY_HEADER_SIZE)) {
+        return 0;
+    }
+
+    // Make sure all of the entries are within the data
+    const uint8_t *end = (const uint8_t *)&data[totalLen];
+    const uint8_t *entry = (const uint8_t *)&data[BINARY_HEADER_SIZE];
+    for(size_t ii = 0; ii < (uint8_t)data[1]; ii++) {
+        if (entry + 2 > end || getBinaryValue(entry) > end) {
+            return 0;
+        }
+        entry = getNextBinaryEntry(entry);
+        if (entry > end) {
+            return 0;
+        }
+    }
+    return totalLen;
+}
+
+const uint8_t *CloudConfigStorage::findBinaryEntry(const char *key) const {
+    if (!binaryData) {
+        return NULL;
+    }
+
+    size_t keyLen = strlen(key);
+    const uint8_t *entry = &binaryData[BINARY_HEADER_SIZE];
+    for(size_t ii = 0; ii < binaryData[1]; ii++) {
+        if (getBinaryKeyLen(entry) == keyLen && memcmp(getBinaryKey(entry), key, keyLen) == 0) {
+            return entry;
+        }
+        entry = getNextBinaryEntry(entry);
+    }
+    return NULL;
+}
+
+// [static]
+const char *CloudConfigStorage::getBinaryText(const uint8_t *entry, size_t *len) {
+    const uint8_t *value = getBinaryValue(entry);
+    size_t textLen = value[0];
+    const char *text = (const char *)&value[1];
+    if (textLen == 0xff) {
+        uint16_t textLen16;
+        memcpy(&textLen16, &value[1], sizeof(textLen16));
+        textLen = textLen16;
+        text = (const char *)&value[3];
+    }
+    if (len) {
+        *len = textLen;
+    }
+    return text;
+}
+
+// [static]
+double CloudConfigStorage::getBinaryNumber(const uint8_t *entry) {
+    const uint8_t *value = getBinaryValue(entry);
+
+    switch(getBinaryType(entry)) {
+    case BINARY_INT8:
+        return (double)(int8_t) value[0];
+
+    case BINARY_INT16: {
+        int16_t value16;
+        memcpy(&value16, value, sizeof(value16));
+        return (double) value16;
+    }
+
+    case BINARY_INT32: {
+        int32_t value32;
+        memcpy(&value32, value, sizeof(value32));
+        return (double) value32;
+    }
+
+    case BINARY_FLOAT: {
+        float floatValue;
+        memcpy(&floatValue, value, sizeof(floatValue));
+        return (double) floatValue;
+    }
+
+    case BINARY_DOUBLE: {
+        double doubleValue;
+        memcpy(&doubleValue, value, sizeof(doubleValue));
+        return doubleValue;
+    }
+
+    default:
+        return 0;
+    }
+}
+
+// [static]
+const uint8_t *CloudConfigStorage::getNextBinaryEntry(const uint8_t *entry) {
+    const uint8_t *value = getBinaryValue(entry);
+
+    switch(getBinaryType(entry)) {
+    case BINARY_INT8:
+        return &value[1];
+
+    case BINARY_INT16:
+        return &value[2];
+
+    case BINARY_INT32:
+    case BINARY_FLOAT:
+        return &value[4];
+
+    case BINARY_DOUBLE:
+        return &value[8];
+
+    case BINARY_STRING:
+    case BINARY_JSON: {
+        size_t textLen;
+        const char *text = getBinaryText(entry, &textLen);
+        return (const uint8_t *)&text[textLen + 1];
+    }
+
+    default:
+        return value;
+    }
+}
+
+// [static]
+size_t CloudConfigStorage::formatBinaryValue(const uint8_t *entry, char *buf, size_t bufSize) {
+    int len = 0;
+    uint8_t type = entry ? getBinaryType(entry) : BINARY_STRING;
+
+    switch(type) {
+    case BINARY_NULL:
+        len = snprintf(buf, bufSize, "null");
+        break;
+
+    case BINARY_FALSE:
+        len = snprintf(buf, bufSize, "false");
+        break;
+
+    case BINARY_TRUE:
+        len = snprintf(buf, bufSize, "true");
+        break;
+
+    case BINARY_INT8:
+    case BINARY_INT16:
+    case BINARY_INT32:
+        len = snprintf(buf, bufSize, "%ld", (long) getBinaryNumber(entry));
+        break;
+
+    case BINARY_FLOAT:
+    case BINARY_DOUBLE: {
+        double value = getBinaryNumber(entry);
+
+        // Use the shortest precision that converts back to the same value
+        len = snprintf(buf, bufSize, "%.15g", value);
+        if (len < (int)bufSize && strtod(buf, NULL) != value) {
+            len = snprintf(buf, bufSize, "%.17g", value);
+        }
+        break;
+    }
+
+    default:
+        if (bufSize > 0) {
+            buf[0] = 0;
+        }
+        break;
+    }
+    return (len > 0) ? (size_t) len : 0;
+}
+
+// [static]
+size_t CloudConfigStorage::escapeString(const char *str, size_t strLen, char *buf, size_t bufSize) {
+    size_t len = 0;
+
+    // Appends to buf, truncating if necessary, but always updating len
+    auto append = [&](const char *data, size_t dataLen) {
+        for(size_t ii = 0; ii < dataLen; ii++, len++) {
+            if (len + 1 < bufSize) {
+                buf[len] = data[ii];
+            }
+        }
+    };
+
+    append("\"", 1);
+    for(size_t ii = 0; ii < strLen; ii++) {
+        char c = str[ii];
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', c };
+            append(escaped, 2);
+        }
+        else
+        if ((uint8_t)c < 0x20) {
+            char escaped[8];
+            switch(c) {
+            case '\b': strcpy(escaped, "\\b"); break;
+            case '\f': strcpy(escaped, "\\f"); break;
+            case '\n': strcpy(escaped, "\\n"); break;
+            case '\r': strcpy(escaped, "\\r"); break;
+            case '\t': strcpy(escaped, "\\t"); break;
+            default: snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)c); break;
+            }
+            append(escaped, strlen(escaped));
+        }
+        else {
+            append(&c, 1);
+        }
+    }
+    append("\"", 1);
+
+    if (bufSize > 0) {
+        buf[(len < bufSize) ? len : bufSize - 1] = 0;
+    }
+    return len;
+}
+
+// [static]
+size_t CloudConfigStorage::unescapeChar(const char *src, size_t srcLen, size_t &ii, char *utf8) {
+    char c = src[ii++];
+    if (c == '\\' && ii < srcLen) {
+        c = src[ii++];
+        switch(c) {
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u': 
+            if (ii + 3 < srcLen) {
+                char hex[5];
+                memcpy(hex, &src[ii], 4);
+                hex[4] = 0;
+                ii += 4;
+
+                // Encode as UTF-8. Surrogate pairs are not combined.
+                unsigned long code = strtoul(hex, NULL, 16);
+                if (code >= 0x800) {
+                    utf8[0] = (char)(0xe0 | (code >> 12));
+                    utf8[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+                    utf8[2] = (char)(0x80 | (code & 0x3f));
+                    return 3;
+                }
+                if (code >= 0x80) {
+                    utf8[0] = (char)(0xc0 | (code >> 6));
+                    utf8[1] = (char)(0x80 | (code & 0x3f));
+                    return 2;
+                }
+                c = (char) code;
+            }
+            break;
+
+        default:
+            // \" \\ and \/ are just the character
+            break;
+        }
+    }
+    utf8[0] = c;
+    return 1;
+}
+
+// [static]
+size_t CloudConfigStorage::unescapeString(const char *src, size_t srcLen, char *buf, size_t bufSize) {
+    size_t len = 0;
+
+    for(size_t ii = 0; ii < srcLen && len < bufSize - 1; ) {
+        char utf8[3];
+        size_t utf8Len = unescapeChar(src, srcLen, ii, utf8);
+        if (len + utf8Len > bufSize - 1) {
+            // Don't store a partial character
+            break;
+        }
+        memcpy(&buf[len], utf8, utf8Len);
+        len += utf8Len;
+    }
+    buf[len] = 0;
+
+    return len;
+}
+
+// [static]
+bool CloudConfigStorage::isSameKey(const char *src, size_t srcLen, const char *key, size_t keyLen) {
+    if (!memchr(src, '\\', srcLen)) {
+        // Common case: nothing to unescape
+        return srcLen == keyLen && memcmp(src, key, keyLen) == 0;
+    }
+
+    size_t keyPos = 0;
+    for(size_t ii = 0; ii < srcLen; ) {
+        char utf8[3];
+        size_t utf8Len = unescapeChar(src, srcLen, ii, utf8);
+        if (keyPos + utf8Len > keyLen || memcmp(&key[keyPos], utf8, utf8Len) != 0) {
+            return false;
+        }
+        keyPos += utf8Len;
+    }
+    return keyPos == keyLen;
+}
+
+// [static]
+uint32_t CloudConfigStorage::hashEscapedKey(const char *src, size_t srcLen) {
+    if (!memchr(src, '\\', srcLen)) {
+        return hashKey(src, srcLen);
+    }
+
+    // Same as hashKey(), over the unescaped key
+    uint32_t hash = 2166136261;
+    for(size_t ii = 0; ii < srcLen; ) {
+        char utf8[3];
+        size_t utf8Len = unescapeChar(src, srcLen, ii, utf8);
+        for(size_t jj = 0; jj < utf8Len; jj++) {
+            hash = (hash ^ (uint8_t)utf8[jj]) * 16777619;
+        }
+    }
+    return hash;
+}
+
+// [static]
+JSONValue CloudConfigStorage::getJSONValueForKey(JSONValue parentObj, const char *key) {
+    JSONObjectIterator iter(parentObj);
+    while(iter.next()) {
+        if (strcmp((const char *)iter.name(), key) == 0) {
+            // Found
+            return iter.value();
+        }
+    }
+    return JSONValue(); // Invalid JSONValue
+}
+
+// [static]
+JSONValue CloudConfigStorage::getJSONValueAtIndex(JSONValue parentObj, size_t index) {
+    JSONArrayIterator iter(parentObj);
+    for(size_t ii = 0; iter.next(); ii++) {
+        if (ii == index) {
+            // Found
+            return iter.value();
+        }
+    }
+    return JSONValue(); // Invalid JSONValue
+}
+
+
+//
+// CloudConfigChanges
+//
+CloudConfigChanges::~CloudConfigChanges() {
+    free(buf);
+}
+
+bool CloudConfigChanges::isChanged(const char *key) const {
+    if (!complete) {
+        return true;
+    }
+
+    size_t keyLen = strlen(key);
+    for(size_t offset = 0; offset < bufLen; ) {
+        const char *path = &buf[offset + 1];
+        size_t pathLen = strlen(path);
+
+        // Same key, something inside key changed, or an object that contains key changed
+        if (strncmp(path, key, (pathLen < keyLen) ? pathLen : keyLen) == 0) {
+            if (pathLen == keyLen || 
+                (pathLen > keyLen && path[keyLen] == '.') ||
+                (pathLen < keyLen && key[pathLen] == '.')) {
+                return true;
+            }
+        }
+        offset += pathLen + 2;
+    }
+    return false;
+}
+
+bool CloudConfigChanges::compare(const char *oldJson, const char *newJson, bool nested) {
+    clear();
+    if (!oldJson || !newJson) {
+        complete = false;
+        return false;
+    }
+
+    // Same token estimate as CloudConfigStorage::mergePatch
+    size_t oldLen = strlen(oldJson);
+    size_t newLen = strlen(newJson);
+    size_t oldMaxTokens = oldLen / 2 + 2;
+    size_t newMaxTokens = newLen / 2 + 2;
+
+    CloudConfigToken *oldTokens = new(std::nothrow) CloudConfigToken[oldMaxTokens + newMaxTokens];
+    if (!oldTokens) {
+        complete = false;
+        return false;
+    }
+    CloudConfigToken *newTokens = &oldTokens[oldMaxTokens];
+
+    int numOldTokens = oldLen ? CloudConfigStorage::tokenize(oldJson, oldLen, oldTokens, oldMaxTokens) : 0;
+    int numNewTokens = newLen ? CloudConfigStorage::tokenize(newJson, newLen, newTokens, newMaxTokens) : 0;
+    if (numOldTokens < 0 || numNewTokens < 0) {
+        delete[] oldTokens;
+        complete = false;
+        return false;
+    }
+
+    // Returns true if the old and new values are the same
+    std::function<bool(int, int)> isSame = [&](int oldToken, int newToken) -> bool {
+        const CloudConfigToken &oldTok = oldTokens[oldToken];
+        const CloudConfigToken &newTok = newTokens[newToken];
+        if (oldTok.type != newTok.type || oldTok.size != newTok.size) {
+            return false;
+        }
+        switch(oldTok.type) {
+        case JSON_TYPE_OBJECT: {
+            int keyToken = newToken + 1;
+            for(size_t ii = 0; ii < newTok.size; ii++) {
+                const CloudConfigToken &keyTok = newTokens[keyToken];
+                int oldValue = CloudConfigStorage::findObjectKey(oldJson, oldTokens, oldToken, &newJson[keyTok.start], keyTok.end - keyTok.start);
+                if (oldValue < 0 || !isSame(oldValue, keyToken + 1)) {
+                    return false;
+                }
+                keyToken += 1 + newTokens[keyToken + 1].count;
+            }
+            return true;
+        }
+
+        case JSON_TYPE_ARRAY: {
+            int oldValue = oldToken + 1;
+            int newValue = newToken + 1;
+            for(size_t ii = 0; ii < newTok.size; ii++) {
+                if (!isSame(oldValue, newValue)) {
+                    return false;
+                }
+                oldValue += oldTokens[oldValue].count;
+                newValue += newTokens[newValue].count;
+            }
+            return true;
+        }
+
+        default:
+            return (oldTok.end - oldTok.start) == (newTok.end - newTok.start) && 
+                memcmp(&oldJson[oldTok.start], &newJson[newTok.start], oldTok.end - oldTok.start) == 0;
+        }
+    };
+
+    // Path of the object being compared, including the trailing period
+    char path[MAX_PATH_LEN + 1];
+
+    // Adds a key in the object at path, which is prefixLen characters long
+    auto addKey = [&](Change change, size_t prefixLen, const char *json, const CloudConfigToken &keyTok) -> bool {
+        size_t keyLen = keyTok.end - keyTok.start;
+        size_t neededSize = bufLen + 1 + prefixLen + keyLen + 1;
+        if (neededSize > bufSize) {
+            char *newBuf = (char *)realloc(buf, neededSize + 64);
+            if (!newBuf) {
+                return false;
+            }
+            buf = newBuf;
+            bufSize = neededSize + 64;
+        }
+        buf[bufLen] = (char) change;
+        memcpy(&buf[bufLen + 1], path, prefixLen);
+        memcpy(&buf[bufLen + 1 + prefixLen], &json[keyTok.start], keyLen);
+        buf[bufLen + 1 + prefixLen + keyLen] = 0;
+        bufLen = neededSize;
+        count++;
+        return true;
+    };
+
+    // Adds the changes between two objects (-1 if there is no object). 
+    std::function<bool(int, int, size_t)> diff = [&](int oldToken, int newToken, size_t prefixLen) -> bool {
+        if (newToken >= 0) {
+            int keyToken = newToken + 1;
+            for(size_t ii = 0; ii < newTokens[newToken].size; ii++) {
+                const CloudConfigToken &keyTok = newTokens[keyToken];
+                size_t keyLen = keyTok.end - keyTok.start;
+                int newValue = keyToken + 1;
+                int oldValue = (oldToken >= 0) ? CloudConfigStorage::findObjectKey(oldJson, oldTokens, oldToken, &newJson[keyTok.start], keyLen) : -1;
+                if (oldValue < 0) {
+                    if (!addKey(Change::ADDED, prefixLen, newJson, keyTok)) {
+                        return false;
+                    }
+                }
+                else
+                if (!isSame(oldValue, newValue)) {
+                    if (nested && prefixLen + keyLen + 1 <= MAX_PATH_LEN &&
+                        oldTokens[oldValue].type == JSON_TYPE_OBJECT && newTokens[newValue].type == JSON_TYPE_OBJECT) {
+                        memcpy(&path[prefixLen], &newJson[keyTok.start], keyLen);
+                        path[prefixLen + keyLen] = '.';
+                        if (!diff(oldValue, newValue, prefixLen + keyLen + 1)) {
+                            return false;
+                        }
+                    }
+                    else
+                    if (!addKey(Change::CHANGED, prefixLen, newJson, keyTok)) {
+                        return false;
+                    }
+                }
+                keyToken += 1 + newTokens[newValue].count;
+            }
+        }
+
+        if (oldToken >= 0) {
+            int keyToken = oldToken + 1;
+            for(size_t ii = 0; ii < oldTokens[oldToken].size; ii++) {
+                const CloudConfigToken &keyTok = oldTokens[keyToken];
+                bool inNew = (newToken >= 0) && CloudConfigStorage::findObjectKey(newJson, newTokens, newToken, &oldJson[keyTok.start], keyTok.end - keyTok.start) >= 0;
+                if (!inNew && !addKey(Change::REMOVED, prefixLen, oldJson, keyTok)) {
+                    return false;
+                }
+                keyToken += 1 + oldTokens[keyToken + 1].count;
+            }
+        }
+        return true;
+    };
+
+    int oldObj = (numOldTokens > 0 && oldTokens[0].type == JSON_TYPE_OBJECT) ? 0 : -1;
+    int newObj = (numNewTokens > 0 && newTokens[0].type == JSON_TYPE_OBJECT) ? 0 : -1;
+    complete = diff(oldObj, newObj, 0);
+
+    delete[] oldTokens;
+    return complete;
+}
+
+size_t CloudConfigChanges::getOffset(size_t index) const {
+    size_t offset = 0;
+    for(size_t ii = 0; ii < index && offset < bufLen; ii++) {
+        offset += strlen(&buf[offset + 1]) + 2;
+    }
+    return offset;
+}
+
+
+//
+// CloudConfig
+//
+
+CloudConfig &CloudConfig::instance() {
+    if (!_instance) {
+        _instance = new CloudConfig();
+    }
+    return *_instance;
+}
+
+// [static]
+CloudConfig &CloudConfig::instance(const char *name) {
+    CloudConfig *result = findInstance(name);
+    if (!result) {
+        result = new CloudConfig(name);
+        result->nextInstance = _namedInstances;
+        _namedInstances = result;
+    }
+    return *result;
+}
+
+// [static]
+CloudConfig *CloudConfig::findInstance(const char *name) {
+    if (!name[0]) {
+        return &instance();
+    }
+    for(CloudConfig *cur = _namedInstances; cur; cur = cur->nextInstance) {
+        if (strcmp(cur->name, name) == 0) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+
+CloudConfig::CloudConfig(const char *name) : name(name) {
+    static_assert(sizeof(stateHandlers) / sizeof(stateHandlers[0]) == (size_t)State::STOPPED, "stateHandlers must have an entry for each State");
+
+    activeSnapshot.store(0);
+    snapshotReaders[0].store(0);
+    snapshotReaders[1].store(0);
+    snapshotGeneration.store(0);
+    pendingData.store(0);
+}
+
+CloudConfig::~CloudConfig() {
+
+}
+
+void CloudConfig::setup() {
+    if (!storageMethod) {
+        // A storage method is always required
+        return;
+    }
+
+    storageMethod->setup();
+    decodeFields();
+    publishSnapshot();
+
+    if (metricsEnabled) {
+        metricsSecondMs = millis();
+        if (metricsVariableName) {
+            Particle.variable(metricsVariableName, &CloudConfig::getMetricsJson, this);
+        }
+    }
+    
+    if (updateMethod) {
+        // An update method is not required. CloudConfigStorageStatic for example
+        // cannot be update because the data is in code flash.
+        updateMethod->setup();
+
+        // However the state machine only runs when both storageMethod and
+        // updateMethod are non-null. Without an update handler the state
+        // machine can't do anything
+        setState(State::START);
+
+    }
+
+}
+
+void CloudConfig::loop() {
+    // Give loop time to the storage and update methods if necessary
+    storageMethod->loop();
+    if (updateMethod) {
+        updateMethod->loop();
+    }
+
+    if (snapshotPending) {
+        publishSnapshot();
+    }
+
+    if (stagedCommit) {
+        commitLoop();
+    }
+
+    if (metricsEnabled && millis() - metricsSecondMs >= 1000) {
+        unsigned long elapsedMs = millis() - metricsSecondMs;
+        metrics.lookupsPerSec = (uint32_t)((uint64_t)(metrics.lookups - metricsLastLookups) * 1000 / elapsedMs);
+        metricsLastLookups = metrics.lookups;
+        metricsSecondMs = millis();
+    }
+
+    // State machine. When nothing is due, this is just two compares. Every state, including
+    // waiting for the cloud connection, sets wakeMs so the handlers don't run every loop.
+    if (state != State::STOPPED && (long)(millis() - wakeMs) >= 0) {
+        (this->*stateHandlers[(size_t)state])();
+    }
+}
+
+void CloudConfig::stateStart() {
+    // Handle retrieve on start
+
+    if (storageMethod->hasJsonData()) {
+        // Send notification if enabled and we have data. All of the keys are new.
+        if (dataChangeCallback) {
+            char *json = copyJsonTextForChanges();
+            changes.compare("", json, changesNested);
+            free(json);
+        }
+        callDataCallbacks();
+    }
+
+    // Handle retrieve periodically
+    setState(State::WAIT_CLOUD_CONNECTED);
+}
+
+void CloudConfig::stateWaitCloudConnected() {
+    if (!Particle.connected() || !Time.isValid()) {
+        // Don't check every loop while waiting to connect
+        wakeMs = millis() + CLOUD_CONNECTED_CHECK_MS;
+        return;
+    }
+
+    Log.info("cloud connected");
+
+    // Cloud connection is up (and we have the time, which we will need shortly)
+    setState(State::WAIT_AFTER_CLOUD_CONNECTED, updateMethod->waitAfterCloudConnectedMs);
+}
+
+void CloudConfig::stateWaitAfterCloudConnected() {
+    unsigned long waitMs = getConnectedWaitMs();
+    if (millis() - stateTime < waitMs) {
+        wakeMs = stateTime + waitMs;
+        return;
+    }
+
+    // We're cloud connected and waited briefly (2 seconds) to make
+    // sure registration is complete. This delay isn't necessary in 2.0.0
+    // or later but it doesn't hurt.
+    if (!storageMethod->hasUpdatedData() || updateFrequency == UPDATE_AT_RESTART || updateRequested) {
+        // Need to update data as we do not have it, or we should update at every restart
+        Log.info("no data, update at restart, or update requested");
+        setState(State::START_UPDATE);
+    }
+    else {
+        Log.info("wait for update");
+        setState(State::WAIT_TO_UPDATE);
+    }
+}
+
+void CloudConfig::stateWaitToUpdate() {
+    unsigned long waitMs = MAX_WAIT_TO_UPDATE_MS;
+    long interval = getUpdateInterval();
+
+    if (updateRequested) {
+        Log.info("update requested");
+        setState(State::START_UPDATE);
+        return;
+    }
+
+    if (Time.isValid() && interval > 0) {
+        long elapsed = (long)(Time.now() - storageMethod->getDataHeader()->lastCheck);
+        if (elapsed > interval) {
+            // Time to update
+            Log.info("checking for time update");
+            setState(State::START_UPDATE);
+            return;
+        }
+
+        // Sleep until the update is due instead of checking periodically
+        if ((unsigned long)(interval - elapsed + 1) < MAX_WAIT_TO_UPDATE_MS / 1000) {
+            waitMs = (unsigned long)(interval - elapsed + 1) * 1000;
+        }
+    }
+    wakeMs = millis() + waitMs;
+}
+
+void CloudConfig::stateStartUpdate() {
+    Log.info("stateStartUpdate");
+    updateRequested = false;
+    storageMethod->getDataHeader()->lastCheck = Time.now();
+
+    // Persist lastCheck so a restart doesn't cause an early update
+    storageMethod->saveHeader();
+    countSavedBytes();
+    updateDataStatus = UpdateDataStatus::IN_PROGRESS;
+    setState(State::WAIT_UPDATE_COMPLETE, updateMethod->updateTimeoutMs + 1);
+
+    updateMethod->startUpdate();
+}
+
+void CloudConfig::stateWaitUpdateComplete() {
+    if (updateDataStatus == UpdateDataStatus::IN_PROGRESS) {
+        if (millis() - stateTime > updateMethod->updateTimeoutMs) {
+            // Timeout
+            Log.info("stateWaitUpdateComplete timeout");
+            updateDataStatus = UpdateDataStatus::TIMEOUT;
+            updateFailures++;
+            if (metricsEnabled) {
+                metrics.timeoutCount++;
+                if (metricsCallback) {
+                    metricsCallback(metrics);
+                }
+            }
+            setState(State::WAIT_TO_UPDATE);
+            return;
+        }
+        else {
+            // Still in progress. updateData() and updateDataFailed() wake the state machine.
+            wakeMs = stateTime + updateMethod->updateTimeoutMs + 1;
+            return;
+        }
+    }
+
+    // Not in progress anymore. 
+    Log.info("stateWaitUpdateComplete complete");
+    if (updateDataStatus == UpdateDataStatus::FAILURE) {
+        updateFailures++;
+    }
+    else {
+        updateFailures = 0;
+    }
+
+    if (metricsEnabled) {
+        if (updateDataStatus == UpdateDataStatus::FAILURE) {
+            metrics.failureCount++;
+        }
+        else {
+            metrics.successCount++;
+        }
+        if (metricsCallback) {
+            metricsCallback(metrics);
+        }
+    }
+    
+    // Wait to update again
+    setState(State::WAIT_TO_UPDATE);
+}
+
+
+bool CloudConfig::updateData(const char *json) {
+    Log.info("updateData called %s", json);
+    countFetch();
+
+    if (schemaValidation && !validateFields(json)) {
+        // Keep the current data
+        updateDataFailed();
+        return false;
+    }
+
+    updateDataStatus = UpdateDataStatus::SUCCESS;
+    wakeMs = millis();
+
+    if (storageMethod && stagedCommit) {
+        // Only copy the data here, the rest is done from loop()
+        char *copy = new(std::nothrow) char[strlen(json) + 1];
+        if (!copy) {
+            updateDataFailed();
+            return false;
+        }
+        strcpy(copy, json);
+
+        // Replace any older data that has not been committed yet
+        delete[] pendingData.exchange(copy);
+        return true;
+    }
+
+    if (storageMethod) {
+        if (storageMethod->isSameData(json)) {
+            // Nothing changed, so there's no need to parse, save, or notify
+            Log.info("data unchanged");
+            return true;
+        }
+
+        // Same as storageMethod->updateData(), but separately timed
+        char *oldJson = copyJsonTextForChanges();
+        unsigned long startUs = micros();
+        if (!storageMethod->setData(json)) {
+            // Too large or could not be stored. The current data is kept, so there is nothing to 
+            // decode, save, or notify.
+            Log.info("could not store data");
+            free(oldJson);
+            updateDataFailed();
+            return false;
+        }
+        countParseTime(startUs);
+        storageMethod->saveData();
+        countSavedBytes();
+        decodeFields();
+        findChanges(oldJson);
+        free(oldJson);
+        publishSnapshot();
+
+        // Send notification if enabled and we have data
+        callDataCallbacks();
+    }
+
+    return true;
+}
+
+
+void CloudConfig::updateDataFailed() {
+    updateDataStatus = UpdateDataStatus::FAILURE;
+    wakeMs = millis();
+}
+
+bool CloudConfig::updateDataEncoded(const char *data) {
+    if (!CloudConfigPayload::isEncoded(data)) {
+        return updateData(data);
+    }
+
+    char *json = CloudConfigPayload::decode(data, getMaxDecodedSize());
+    if (!json) {
+        Log.info("could not decode data");
+        updateDataFailed();
+        return false;
+    }
+    bool result = updateData(json);
+    free(json);
+    return result;
+}
+
+void CloudConfig::updateDataNotModified() {
+    Log.info("updateDataNotModified called");
+    countFetch();
+    updateDataStatus = UpdateDataStatus::SUCCESS;
+    wakeMs = millis();
+
+    if (storageMethod && storageMethod->getDataHeader()) {
+        storageMethod->getDataHeader()->lastCheck = Time.now();
+        storageMethod->saveHeader();
+        countSavedBytes();
+    }
+}
+
+void CloudConfig::countFetch() {
+    if (metricsEnabled && state == State::WAIT_UPDATE_COMPLETE && updateDataStatus == UpdateDataStatus::IN_PROGRESS) {
+        // stateTime was set when the request was started
+        metrics.fetchMs = millis() - stateTime;
+        if (metrics.fetchMs > metrics.maxFetchMs) {
+            metrics.maxFetchMs = metrics.fetchMs;
+        }
+    }
+}
+
+void CloudConfig::countParseTime(unsigned long startUs) {
+    if (metricsEnabled) {
+        metrics.parseUs = micros() - startUs;
+        if (metrics.parseUs > metrics.maxParseUs) {
+            metrics.maxParseUs = metrics.parseUs;
+        }
+    }
+}
+
+String CloudConfig::getMetricsJson() const {
+    return String::format("{\"fetchMs\":%lu,\"maxFetchMs\":%lu,\"parseUs\":%lu,\"maxParseUs\":%lu,\"saved\":%lu,\"lookupsSec\":%lu,\"success\":%lu,\"failure\":%lu,\"timeout\":%lu}",
+        metrics.fetchMs, metrics.maxFetchMs, metrics.parseUs, metrics.maxParseUs,
+        (unsigned long)metrics.bytesSaved, (unsigned long)metrics.lookupsPerSec,
+        (unsigned long)metrics.successCount, (unsigned long)metrics.failureCount, (unsigned long)metrics.timeoutCount);
+}
+
+size_t CloudConfig::getMaxDecodedSize() const {
+    size_t maxDataSize = getMaxDataSize();
+    if (!maxDataSize || maxDataSize >= CloudConfigPayload::MAX_DECODED_SIZE) {
+        return CloudConfigPayload::MAX_DECODED_SIZE;
+    }
+    return maxDataSize + 1;
+}
+
+uint32_t CloudConfig::getDataHash() {
+    if (!storageMethod || !storageMethod->hasUpdatedData() || !storageMethod->getDataHeader()) {
+        return 0;
+    }
+    return storageMethod->getDataHeader()->dataHash;
+}
+
+bool CloudConfig::updateDataPatchEncoded(const char *data) {
+    if (!CloudConfigPayload::isEncoded(data)) {
+        return updateDataPatch(data);
+    }
+
+    char *patch = CloudConfigPayload::decode(data, getMaxDecodedSize());
+    if (!patch) {
+        Log.info("could not decode patch");
+        return false;
+    }
+    bool result = updateDataPatch(patch);
+    free(patch);
+    return result;
+}
+
+bool CloudConfig::updateDataPatch(const char *patch) {
+    Log.info("updateDataPatch called %s", patch);
+
+    if (!storageMethod) {
+        return false;
+    }
+
+    // With a staged commit, apply the patch to the newest data even if it's not committed yet
+    char *pending = pendingData.exchange(0);
+
+    // The target is copied as the data may be in binary format
+    size_t targetLen = pending ? strlen(pending) : storageMethod->getJsonText(NULL, 0);
+    size_t bufSize = targetLen + strlen(patch) + 3;
+    char *buf = new(std::nothrow) char[bufSize + targetLen + 1];
+    if (!buf) {
+        delete[] pending;
+        return false;
+    }
+    char *target = &buf[bufSize];
+    if (pending) {
+        strcpy(target, pending);
+        delete[] pending;
+    }
+    else {
+        storageMethod->getJsonText(target, targetLen + 1);
+    }
+
+    bool result = CloudConfigStorage::mergePatch(target, patch, buf, bufSize);
+    if (result) {
+        result = updateData(buf);
+    }
+    else {
+        Log.info("merge patch failed");
+    }
+    delete[] buf;
+
+    return result;
+}
+
+void CloudConfig::commitLoop() {
+    unsigned long startMs = millis();
+
+    do {
+        switch(commitStage) {
+        case CommitStage::IDLE: {
+            char *json = pendingData.exchange(0);
+            if (!json) {
+                return;
+            }
+            if (storageMethod->isSameData(json)) {
+                Log.info("data unchanged");
+            }
+            else {
+                char *oldJson = copyJsonTextForChanges();
+                unsigned long startUs = micros();
+                if (storageMethod->setData(json)) {
+                    countParseTime(startUs);
+                    decodeFields();
+                    findChanges(oldJson);
+                    publishSnapshot();
+                    commitStage = CommitStage::SAVE;
+                }
+                else {
+                    // Same as updateData() without a staged commit, skip save and notify
+                    Log.info("could not store data");
+                    updateDataFailed();
+                }
+                free(oldJson);
+            }
+            delete[] json;
+            break;
+        }
+
+        case CommitStage::SAVE:
+            storageMethod->saveData();
+            countSavedBytes();
+            commitStage = CommitStage::NOTIFY;
+            break;
+
+        case CommitStage::NOTIFY:
+            commitStage = CommitStage::IDLE;
+            callDataCallbacks();
+            break;
+        }
+    } while(millis() - startMs < commitTimeBudgetMs);
+}
+
+CloudConfig &CloudConfig::withUpdateJitter(long maxJitterSec) {
+    updateJitterSec = 0;
+    if (maxJitterSec > 0) {
+        // Derived from the device ID so it's the same after every restart but differs between devices
+        String deviceId = System.deviceID();
+        uint32_t hash = CloudConfigStorageData::crc32(deviceId.c_str(), deviceId.length());
+        updateJitterSec = (long)(hash % ((uint32_t)maxJitterSec + 1));
+    }
+    wakeMs = millis();
+    return *this;
+}
+
+long CloudConfig::getUpdateInterval() const {
+    if (updateFailures > 0 && backoffInitialSec > 0) {
+        long interval = backoffInitialSec;
+        for(unsigned int ii = 1; ii < updateFailures && interval < backoffMaxSec; ii++) {
+            interval *= 2;
+        }
+        if (interval > backoffMaxSec) {
+            interval = backoffMaxSec;
+        }
+        return interval + updateJitterSec;
+    }
+    if (updateFrequency > 0) {
+        return updateFrequency + updateJitterSec;
+    }
+    return -1;
+}
+
+unsigned long CloudConfig::getConnectedWaitMs() const {
+    unsigned long waitMs = updateMethod->waitAfterCloudConnectedMs;
+
+    // The jitter keeps devices that all reconnect at the same time from updating at once, but
+    // a device with no data should get it right away
+    if (storageMethod->hasUpdatedData()) {
+        waitMs += (unsigned long)updateJitterSec * 1000;
+    }
+    return waitMs;
+}
+
+long CloudConfig::getNextUpdateTime() {
+    if (state == State::STOPPED || !storageMethod || !storageMethod->getDataHeader()) {
+        return -1;
+    }
+    if (updateRequested || state == State::START_UPDATE) {
+        return 0;
+    }
+    if ((state == State::START || state == State::WAIT_CLOUD_CONNECTED || state == State::WAIT_AFTER_CLOUD_CONNECTED) &&
+        (!storageMethod->hasUpdatedData() || updateFrequency == UPDATE_AT_RESTART)) {
+        // Same check as stateWaitAfterCloudConnected()
+        return 0;
+    }
+
+    long interval = getUpdateInterval();
+    if (interval <= 0) {
+        return -1;
+    }
+    return storageMethod->getDataHeader()->lastCheck + interval;
+}
+
+bool CloudConfig::isUpdateDue() {
+    long nextUpdateTime = getNextUpdateTime();
+    if (nextUpdateTime == 0) {
+        return true;
+    }
+
+    // Same check as stateWaitToUpdate()
+    return nextUpdateTime > 0 && Time.isValid() && (long)Time.now() > nextUpdateTime;
+}
+
+unsigned long CloudConfig::getAwakeTimeMs() {
+    unsigned long awakeMs = 0;
+
+    if (isUpdateInProgress()) {
+        unsigned long elapsedMs = millis() - stateTime;
+        if (elapsedMs < updateMethod->updateTimeoutMs) {
+            awakeMs = updateMethod->updateTimeoutMs - elapsedMs;
+        }
+        if (!updateRequested) {
+            return awakeMs;
+        }
+        // Another update will be started after this one
+    }
+    else
+    if (!isUpdateDue()) {
+        return 0;
+    }
+
+    // Time until the update is started, which may not be until after connecting to the cloud
+    unsigned long connectedWaitMs = getConnectedWaitMs();
+    if (state == State::START || state == State::WAIT_CLOUD_CONNECTED) {
+        awakeMs += connectedWaitMs;
+    }
+    else
+    if (state == State::WAIT_AFTER_CLOUD_CONNECTED && millis() - stateTime < connectedWaitMs) {
+        awakeMs += connectedWaitMs - (millis() - stateTime);
+    }
+
+    return awakeMs + updateMethod->updateTimeoutMs;
+}
+
+CloudConfig &CloudConfig::withThreadSafeReads() {
+    if (!snapshots) {
+        snapshots = new(std::nothrow) CloudConfigStorageCopy[2];
+    }
+    return *this;
+}
+
+bool CloudConfig::publishSnapshot() {
+    if (!snapshots || !storageMethod) {
+        return true;
+    }
+
+    // Only the copy that's not active can be written, and only if the last reader has released it.
+    // A reader that pins it after this check sees that it's not active and retries.
+    int target = 1 - activeSnapshot.load();
+    if (snapshotReaders[target].load() != 0 || !snapshots[target].copyFrom(*storageMethod)) {
+        snapshotPending = true;
+        return false;
+    }
+    snapshots[target].generation = ++snapshotGeneration;
+    activeSnapshot.store(target);
+
+    snapshotPending = false;
+    return true;
+}
+
+char *CloudConfig::copyJsonTextForChanges() {
+    if (!dataChangeCallback) {
+        return NULL;
+    }
+
+    // getJsonText() also works for binary format and merges layered storage
+    size_t len = storageMethod->getJsonText(NULL, 0);
+    char *json = (char *)malloc(len + 1);
+    if (json) {
+        storageMethod->getJsonText(json, len + 1);
+    }
+    return json;
+}
+
+void CloudConfig::findChanges(const char *oldJson) {
+    if (!dataChangeCallback) {
+        return;
+    }
+
+    char *newJson = copyJsonTextForChanges();
+    if (!changes.compare(oldJson, newJson, changesNested)) {
+        Log.info("could not compare data for changes");
+    }
+    free(newJson);
+}
+
+void CloudConfig::callDataCallbacks() {
+    if (dataCallback) {
+        dataCallback();
+    }
+    if (dataChangeCallback) {
+        dataChangeCallback(changes);
+    }
+}
+
+void CloudConfig::decodeFields() {
+    for(CloudConfigFieldBase *field = fields; field; field = field->next) {
+        field->decode(*storageMethod);
+    }
+}
+
+bool CloudConfig::validateFields(const char *json) {
+    JSONValue obj = JSONValue::parseCopy(json);
+    if (!obj.isObject()) {
+        Log.info("data is not a JSON object");
+        return false;
+    }
+
+    for(CloudConfigFieldBase *field = fields; field; field = field->next) {
+        if (!field->validate(CloudConfigStorage::getJSONValueForKey(obj, field->getKey()))) {
+            Log.info("field %s is missing or not valid", field->getKey());
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void CloudConfigUpdateFunction::setup() {
+    Particle.function(name, &CloudConfigUpdateFunction::functionHandler, this);
+
+    if (patchName.length()) {
+        Particle.function(patchName, &CloudConfigUpdateFunction::patchFunctionHandler, this);
+    }
+}
+
+
+//
+// CloudConfigUpdate
+//
+CloudConfig &CloudConfigUpdate::getCloudConfig() const {
+    return cloudConfig ? *cloudConfig : CloudConfig::instance();
+}
+
+int CloudConfigUpdateFunction::functionHandler(String param) {
+    getCloudConfig().updateDataEncoded(param);
+    return 0;
+}
+
+int CloudConfigUpdateFunction::patchFunctionHandler(String param) {
+    return getCloudConfig().updateDataPatchEncoded(param) ? 0 : -1;
+}
+
+
+void CloudConfigUpdateSubscription::setup() {
+    Particle.subscribe(eventName, &CloudConfigUpdateSubscription::subscriptionHandler, this);
+
+    if (patchEventName.length()) {
+        Particle.subscribe(patchEventName, &CloudConfigUpdateSubscription::patchSubscriptionHandler, this);
+    }
+}
+
+void CloudConfigUpdateSubscription::subscriptionHandler(const char *eventName, const char *eventData) {
+    if (patchEventName.length() && strcmp(eventName, patchEventName) == 0) {
+        // Patch event that also matches the eventName prefix, handled by patchSubscriptionHandler
+        return;
+    }
+    getCloudConfig().updateDataEncoded(eventData);
+}
+
+void CloudConfigUpdateSubscription::patchSubscriptionHandler(const char *eventName, const char *eventData) {
+    if (strcmp(eventName, patchEventName) != 0) {
+        // Subscriptions are a prefix match, but only the exact event name is a patch
+        return;
+    }
+    getCloudConfig().updateDataPatchEncoded(eventData);
+}
+
+//
+// CloudConfigFieldBase
+//
+
+// [static]
+bool CloudConfigFieldBase::getValidValue(const JSONValue &jsonValue, int &result) {
+    if (jsonValue.isNumber()) {
+        double value = jsonValue.toDouble();
+        result = jsonValue.toInt();
+        return value == (double)result;
+    }
+    if (jsonValue.isString()) {
+        const char *str = jsonValue.toString().data();
+        char *end;
+        errno = 0;
+        long value = strtol(str, &end, 10);
+        if (end == str || *end != 0 || errno == ERANGE || value < INT_MIN || value > INT_MAX) {
+            return false;
+        }
+        result = (int) value;
+        return true;
+    }
+    return false;
+}
+
+// [static]
+bool CloudConfigFieldBase::getValidValue(const JSONValue &jsonValue, bool &result) {
+    if (jsonValue.isBool()) {
+        result = jsonValue.toBool();
+        return true;
+    }
+    if (jsonValue.isString()) {
+        const char *str = jsonValue.toString().data();
+        result = (strcmp(str, "true") == 0);
+        return result || strcmp(str, "false") == 0;
+    }
+    return false;
+}
+
+// [static]
+bool CloudConfigFieldBase::getValidValue(const JSONValue &jsonValue, double &result) {
+    if (jsonValue.isNumber()) {
+        result = jsonValue.toDouble();
+        return true;
+    }
+    if (jsonValue.isString()) {
+        const char *str = jsonValue.toString().data();
+        char *end;
+        result = strtod(str, &end);
+        return end != str && *end == 0;
+    }
+    return false;
+}
+
+//
+// CloudConfigStorageCopy
+//
+CloudConfigStorageCopy::~CloudConfigStorageCopy() {
+    delete[] buf;
+}
+
+bool CloudConfigStorageCopy::copyFrom(CloudConfigStorage &source) {
+    size_t len = source.getJsonText(NULL, 0);
+    if (len + 1 > bufSize) {
+        char *newBuf = new(std::nothrow) char[len + 1];
+        if (!newBuf) {
+            Log.error("could not allocate config copy");
+            return false;
+        }
+        delete[] buf;
+        buf = newBuf;
+        bufSize = len + 1;
+    }
+    source.getJsonText(buf, bufSize);
+    parse();
+
+    // Readers on other threads share this copy, so the string pool is built now instead of by
+    // the first getString(), which would modify the copy while another thread reads it
+    buildStringPool();
+    stringPoolStale = false;
+    return true;
+}
+
+//
+// CloudConfigSnapshot
+//
+CloudConfigSnapshot::CloudConfigSnapshot(CloudConfig &cloudConfig) : cloudConfig(&cloudConfig) {
+    if (!cloudConfig.snapshots) {
+        storage = cloudConfig.storageMethod;
+        return;
+    }
+
+    // Pin the active copy. If it changed before the reader count was incremented, the 
+    // publisher may be writing to it, so release it and try again.
+    while(true) {
+        int ii = cloudConfig.activeSnapshot.load();
+        cloudConfig.snapshotReaders[ii]++;
+        if (cloudConfig.activeSnapshot.load() == ii) {
+            index = ii;
+            break;
+        }
+        cloudConfig.snapshotReaders[ii]--;
+    }
+    storage = &cloudConfig.snapshots[index];
+    generation = cloudConfig.snapshots[index].generation;
+}
+
+CloudConfigSnapshot::~CloudConfigSnapshot() {
+    if (index >= 0) {
+        cloudConfig->snapshotReaders[index]--;
+    }
+}
+
+//
+// CloudConfigPayload
+//
+
+// [static]
+char *CloudConfigPayload::decode(const char *data, size_t maxSize) {
+    if (!isEncoded(data)) {
+        return NULL;
+    }
+
+    // Allocated on the heap as the Huffman tables are over 1K
+    CloudConfigPayload *payload = new(std::nothrow) CloudConfigPayload(&data[2], maxSize);
+    if (!payload) {
+        return NULL;
+    }
+
+    if (data[0] == 'z') {
+        payload->inflate();
+    }
+    else {
+        for(int c = payload->readByte(); c >= 0 && !payload->error; c = payload->readByte()) {
+            payload->put((uint8_t)c);
+        }
+    }
+
+    // The null terminator makes sure there is a buffer even for empty data
+    payload->put(0);
+    payload->outLen--;
+
+    char *result = payload->out;
+    if (payload->error || payload->outLen == 0) {
+        free(result);
+        result = NULL;
+    }
+    delete payload;
+    return result;
+}
+
+int CloudConfigPayload::readByte() {
+    while(base64Count < 8) {
+        char c = *src;
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        }
+        else
+        if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        }
+        else
+        if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        }
+        else
+        if (c == '+' || c == '-') {
+            value = 62;
+        }
+        else
+        if (c == '/' || c == '_') {
+            value = 63;
+        }
+        else {
+            // End of data or padding. Anything else is an error.
+            if (c != 0 && c != '=') {
+                error = true;
+            }
+            return -1;
+        }
+        src++;
+        base64Bits = (base64Bits << 6) | (uint32_t)value;
+        base64Count += 6;
+    }
+    base64Count -= 8;
+    return (int)((base64Bits >> base64Count) & 0xff);
+}
+
+uint32_t CloudConfigPayload::readBits(int numBits) {
+    while(bitCount < numBits) {
+        int c = readByte();
+        if (c < 0) {
+            error = true;
+            return 0;
+        }
+        bitBuf |= (uint32_t)c << bitCount;
+        bitCount += 8;
+    }
+    uint32_t result = bitBuf & ((1UL << numBits) - 1);
+    bitBuf >>= numBits;
+    bitCount -= numBits;
+    return result;
+}
+
+void CloudConfigPayload::put(uint8_t c) {
+    if (outLen + 1 > outSize) {
+        if (outLen + 1 > maxSize) {
+            error = true;
+            return;
+        }
+        // Grow by half, as the decompressed size is not known in advance
+        size_t newSize = outSize + outSize / 2 + 64;
+        if (newSize > maxSize) {
+            newSize = maxSize;
+        }
+        char *newOut = (char *)realloc(out, newSize);
+        if (!newOut) {
+            error = true;
+            return;
+        }
+        out = newOut;
+        outSize = newSize;
+    }
+    out[outLen++] = (char)c;
+}
+
+void CloudConfigPayload::inflate() {
+    // zlib header (RFC 1950): deflate method without a preset dictionary
+    uint32_t cmf = readBits(8);
+    uint32_t flg = readBits(8);
+    if (error || (cmf & 0x0f) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20) != 0) {
+        error = true;
+        return;
+    }
+
+    Huffman *codes = new(std::nothrow) Huffman[2];
+    if (!codes) {
+        error = true;
+        return;
+    }
+
+    bool finalBlock = false;
+    while(!finalBlock && !error) {
+        finalBlock = readBits(1) != 0;
+        switch(readBits(2)) {
+        case 0: {
+            // Stored block, begins on a byte boundary
+            bitBuf = 0;
+            bitCount = 0;
+            uint32_t len = readBits(16);
+            uint32_t nlen = readBits(16);
+            if (len != (~nlen & 0xffff)) {
+                error = true;
+            }
+            for(uint32_t ii = 0; ii < len && !error; ii++) {
+                put((uint8_t)readBits(8));
+            }
+            break;
+        }
+
+        case 1: {
+            // Fixed Huffman codes
+            uint8_t lengths[288];
+            memset(&lengths[0], 8, 144);
+            memset(&lengths[144], 9, 112);
+            memset(&lengths[256], 7, 24);
+            memset(&lengths[280], 8, 8);
+            buildHuffman(codes[0], lengths, 288);
+            memset(lengths, 5, 30);
+            // The fixed distance code is incomplete (30 of 32 codes), which is allowed
+            buildHuffman(codes[1], lengths, 30);
+            inflateBlock(codes[0], codes[1]);
+            break;
+        }
+
+        case 2:
+            readDynamicCodes(codes[0], codes[1]);
+            if (!error) {
+                inflateBlock(codes[0], codes[1]);
+            }
+            break;
+
+        default:
+            error = true;
+            break;
+        }
+    }
+    delete[] codes;
+
+    // Adler-32 of the decompressed data, big endian, on a byte boundary
+    bitBuf = 0;
+    bitCount = 0;
+    uint32_t adler = readBits(8) << 24;
+    adler |= readBits(8) << 16;
+    adler |= readBits(8) << 8;
+    adler |= readBits(8);
+
+    uint32_t a = 1, b = 0;
+    for(size_t ii = 0; ii < outLen; ii++) {
+        a = (a + (uint8_t)out[ii]) % 65521;
+        b = (b + a) % 65521;
+    }
+    if (adler != ((b << 16) | a)) {
+        error = true;
+    }
+}
+
+void CloudConfigPayload::inflateBlock(const Huffman &lengthCodes, const Huffman &distanceCodes) {
+    static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    while(!error) {
+        int symbol = decodeSymbol(lengthCodes);
+        if (symbol < 256) {
+            if (symbol >= 0) {
+                put((uint8_t)symbol);
+            }
+            continue;
+        }
+        if (symbol == 256) {
+            // End of block
+            break;
+        }
+
+        symbol -= 257;
+        if (symbol >= 29) {
+            error = true;
+            break;
+        }
+        size_t len = lengthBase[symbol] + readBits(lengthExtra[symbol]);
+
+        symbol = decodeSymbol(distanceCodes);
+        if (symbol < 0 || symbol >= 30) {
+            error = true;
+            break;
+        }
+        size_t distance = distanceBase[symbol] + readBits(distanceExtra[symbol]);
+        if (distance > outLen) {
+            error = true;
+            break;
+        }
+
+        // The output buffer is the window. The copy may overlap, so it's done a byte at a time.
+        for(size_t ii = 0; ii < len && !error; ii++) {
+            put((uint8_t)out[outLen - distance]);
+        }
+    }
+}
+
+void CloudConfigPayload::readDynamicCodes(Huffman &lengthCodes, Huffman &distanceCodes) {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    size_t numLengths = readBits(5) + 257;
+    size_t numDistances = readBits(5) + 1;
+    size_t numCodeLengths = readBits(4) + 4;
+    if (error || numLengths > 286 || numDistances > 30) {
+        error = true;
+        return;
+    }
+
+    // The code lengths are themselves Huffman coded, using lengthCodes temporarily
+    uint8_t lengths[286 + 30];
+    memset(lengths, 0, 19);
+    for(size_t ii = 0; ii < numCodeLengths; ii++) {
+        lengths[order[ii]] = (uint8_t)readBits(3);
+    }
+    if (buildHuffman(lengthCodes, lengths, 19) != 0) {
+        // The code length code must be complete
+        error = true;
+        return;
+    }
+
+    size_t index = 0;
+    while(index < numLengths + numDistances && !error) {
+        int symbol = decodeSymbol(lengthCodes);
+        if (symbol < 0) {
+            break;
+        }
+        if (symbol < 16) {
+            lengths[index++] = (uint8_t)symbol;
+            continue;
+        }
+
+        uint8_t value = 0;
+        size_t repeat;
+        if (symbol == 16) {
+            // Repeat the previous length 3 - 6 times
+            if (index == 0) {
+                error = true;
+                break;
+            }
+            value = lengths[index - 1];
+            repeat = 3 + readBits(2);
+        }
+        else
+        if (symbol == 17) {
+            repeat = 3 + readBits(3);
+        }
+        else {
+            repeat = 11 + readBits(7);
+        }
+        if (index + repeat > numLengths + numDistances) {
+            error = true;
+            break;
+        }
+        memset(&lengths[index], value, repeat);
+        index += repeat;
+    }
+
+    if (!error && lengths[256] == 0) {
+        // There must be an end of block code
+        error = true;
+    }
+    if (!error) {
+        int left = buildHuffman(lengthCodes, lengths, numLengths);
+        if (!isValidHuffman(lengthCodes, left)) {
+            error = true;
+            return;
+        }
+        left = buildHuffman(distanceCodes, &lengths[numLengths], numDistances);
+        if (!isValidHuffman(distanceCodes, left)) {
+            error = true;
+        }
+    }
+}
+
+int CloudConfigPayload::decodeSymbol(const Huffman &codes) {
+    // Canonical Huffman codes are sequential within each length, so the code can be decoded
+    // a bit at a time without a lookup table
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for(size_t len = 1; len < 16; len++) {
+        code |= (int)readBits(1);
+        if (error) {
+            return -1;
+        }
+        int count = codes.counts[len];
+        if (code - first < count) {
+            return codes.symbols[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    error = true;
+    return -1;
+}
+
+int CloudConfigPayload::buildHuffman(Huffman &codes, const uint8_t *lengths, size_t numSymbols) {
+    memset(codes.counts, 0, sizeof(codes.counts));
+    for(size_t ii = 0; ii < numSymbols; ii++) {
+        codes.counts[lengths[ii]]++;
+    }
+    codes.counts[0] = 0;
+
+    // Each length doubles the number of possible codes, less the ones used at that length
+    int left = 1;
+    for(size_t len = 1; len < 16; len++) {
+        left = (left << 1) - codes.counts[len];
+        if (left < 0) {
+            // Over-subscribed
+            return left;
+        }
+    }
+
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for(size_t len = 1; len < 15; len++) {
+        offsets[len + 1] = offsets[len] + codes.counts[len];
+    }
+    for(size_t ii = 0; ii < numSymbols; ii++) {
+        if (lengths[ii]) {
+            codes.symbols[offsets[lengths[ii]]++] = (uint16_t)ii;
+        }
+    }
+    return left;
+}
+
+// [static]
+bool CloudConfigPayload::isValidHuffman(const Huffman &codes, int left) {
+    if (left < 0) {
+        return false;
+    }
+    if (left > 0) {
+        for(size_t len = 2; len < 16; len++) {
+            if (codes.counts[len]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//
+// CloudConfigUpdateWebhook
+//
+CloudConfigUpdateWebhook::CloudConfigUpdateWebhook(const char *eventName) {
+    withEventName(eventName);
+}
+
+CloudConfigUpdateWebhook &CloudConfigUpdateWebhook::withEventName(const char *eventName) {
+    // This is the request event name
+    requestEventName = eventName;
+
+    // This is the subscription event name (hook-response)
+    // Response Template:
+    // {{PARTICLE_DEVICE_ID}}/hook-response/{{PARTICLE_EVENT_NAME}}
+    String s = String::format("%s/hook-response/%s/", System.deviceID().c_str(), eventName);
+
+    CloudConfigUpdateSubscription::withEventName(s);
+    return *this;
+}
+
+void CloudConfigUpdateWebhook::loop() {
+    if (partsReceived && millis() - partsStartMs > updateTimeoutMs) {
+        Log.info("discarding incomplete webhook response");
+        clearParts();
+    }
+}
+
+void CloudConfigUpdateWebhook::startUpdate() {
+    Log.info("CloudConfigUpdateWebhook::startUpdate %s", requestEventName.c_str());
+
+    clearParts();
+
+    char data[24];
+    data[0] = 0;
+    uint32_t dataHash = getCloudConfig().getDataHash();
+    if (conditionalRequest && dataHash) {
+        // Allows the server to respond with notModifiedResponse instead of the whole configuration
+        snprintf(data, sizeof(data), "{\"hash\":\"%08lx\"}", (unsigned long) dataHash);
+    }
+    Particle.publish(requestEventName, data);
+}
+
+void CloudConfigUpdateWebhook::subscriptionHandler(const char *eventName, const char *eventData) {
+    // The part number is after the subscription prefix
+    // {{PARTICLE_DEVICE_ID}}/hook-response/{{PARTICLE_EVENT_NAME}}/0
+    size_t part = 0;
+    const char *lastSlash = strrchr(eventName, '/');
+    if (lastSlash) {
+        part = (size_t) atoi(lastSlash + 1);
+    }
+    size_t len = strlen(eventData);
+
+    if (part == 0 && !partsReceived && notModifiedResponse && strcmp(eventData, notModifiedResponse) == 0) {
+        // The data has not changed since the hash sent with the request
+        getCloudConfig().updateDataNotModified();
+        return;
+    }
+
+    if (part == 0 && len < partSize && !partsReceived) {
+        // Common case: The whole response is in one part
+        getCloudConfig().updateDataEncoded(eventData);
+        return;
+    }
+
+    bool lengthMismatch = false;
+    if (partsTotalLen) {
+        // Already received the last part, so this part must be consistent with it
+        lengthMismatch = (len < partSize) ? (part * partSize + len != partsTotalLen) : (part * partSize + len > partsTotalLen);
+    }
+    if (part >= MAX_PARTS || len > partSize || lengthMismatch) {
+        Log.info("invalid webhook response part %u", part);
+        clearParts();
+        getCloudConfig().updateDataFailed();
+        return;
+    }
+
+    if (!partsReceived) {
+        partsStartMs = millis();
+    }
+
+    size_t maxLen = getMaxResponseLen();
+    if (maxLen && part * partSize + len > maxLen) {
+        Log.info("webhook response too large for storage, part %u", part);
+        clearParts();
+        getCloudConfig().updateDataFailed();
+        return;
+    }
+
+    // Make sure the buffer is large enough for this part and a null terminator
+    size_t neededSize = (part + 1) * partSize;
+    if (maxLen && neededSize > maxLen) {
+        neededSize = maxLen;
+    }
+    neededSize++;
+    if (neededSize > partsBufSize) {
+        char *newBuf = (char *)realloc(partsBuf, neededSize);
+        if (!newBuf) {
+            Log.error("could not allocate webhook response buffer");
+            clearParts();
+            getCloudConfig().updateDataFailed();
+            return;
+        }
+        partsBuf = newBuf;
+        partsBufSize = neededSize;
+    }
+
+    memcpy(&partsBuf[part * partSize], eventData, len);
+    partsReceived |= ((uint32_t)1 << part);
+    if (len < partSize) {
+        // Only the last part is shorter than partSize
+        partsTotalLen = part * partSize + len;
+    }
+
+    // Find the first part not yet received
+    size_t numParts = 0;
+    while(numParts < MAX_PARTS && (partsReceived & ((uint32_t)1 << numParts))) {
+        numParts++;
+    }
+    
+    bool complete = false;
+    if (partsTotalLen) {
+        complete = (numParts * partSize > partsTotalLen);
+    }
+    else
+    if (numParts == MAX_PARTS || (partsReceived >> numParts) == 0) {
+        // All of the parts received so far are contiguous and full size. If the total length is a 
+        // multiple of partSize there is no short last part, so check if the data is complete JSON.
+        partsBuf[numParts * partSize] = 0;
+        if (isCompleteData(partsBuf)) {
+            partsTotalLen = numParts * partSize;
+            complete = true;
+        }
+    }
+
+    if (complete) {
+        Log.info("webhook response complete, %u parts, %u bytes", numParts, partsTotalLen);
+        partsBuf[partsTotalLen] = 0;
+        getCloudConfig().updateDataEncoded(partsBuf);
+        clearParts();
+    }
+}
+
+bool CloudConfigUpdateWebhook::isCompleteData(const char *data) const {
+    if (!CloudConfigPayload::isEncoded(data)) {
+        return JSONValue::parseCopy(data).isValid();
+    }
+
+    // Truncated compressed data fails to decode, but truncated base64 JSON data may still decode
+    char *json = CloudConfigPayload::decode(data, getCloudConfig().getMaxDecodedSize());
+    bool complete = json && JSONValue::parseCopy(json).isValid();
+    free(json);
+    return complete;
+}
+
+size_t CloudConfigUpdateWebhook::getMaxResponseLen() const {
+    size_t maxDataSize = getCloudConfig().getMaxDataSize();
+    if (!maxDataSize) {
+        return 0;
+    }
+
+    // Encoded data is the b: or z: prefix and base64, which is 4 bytes for every 3
+    return 2 + (maxDataSize + 2) / 3 * 4;
+}
+
+void CloudConfigUpdateWebhook::clearParts() {
+    if (partsBuf) {
+        free(partsBuf);
+        partsBuf = 0;
+    }
+    partsBufSize = 0;
+    partsReceived = 0;
+    partsTotalLen = 0;
+}
+
+//
+// CloudConfigUpdateNotify
+//
+void CloudConfigUpdateNotify::setup() {
+    CloudConfigUpdateWebhook::setup();
+
+    Particle.subscribe(notifyEventName, &CloudConfigUpdateNotify::notifyHandler, this);
+}
+
+void CloudConfigUpdateNotify::loop() {
+    CloudConfigUpdateWebhook::loop();
+
+    if (notifyPending && millis() - notifyMs >= debounceMs) {
+        notifyPending = false;
+
+        // The data may have been updated by another update since the notification
+        if (!isCurrentVersion(pendingVersion)) {
+            Log.info("requesting version %s", pendingVersion.c_str());
+            getCloudConfig().requestUpdate();
+        }
+    }
+}
+
+void CloudConfigUpdateNotify::notifyHandler(const char *eventName, const char *eventData) {
+    if (isCurrentVersion(eventData)) {
+        // Also discards an earlier notification in the same burst that has not been requested yet
+        notifyPending = false;
+        return;
+    }
+
+    // Each notification restarts the debounce time
+    pendingVersion = eventData;
+    notifyPending = true;
+    notifyMs = millis();
+}
+
+bool CloudConfigUpdateNotify::isCurrentVersion(const char *version) {
+    CloudConfig &cloudConfig = getCloudConfig();
+
+    if (!versionKey) {
+        char hash[12];
+        snprintf(hash, sizeof(hash), "%08lx", (unsigned long) cloudConfig.getDataHash());
+        return strcmp(hash, version) == 0;
+    }
+
+    JSONValue value = cloudConfig.getJSONValueForKey(versionKey);
+    return value.isValid() && value.toString() == version;
+}
+
+//
+// CloudConfigDispatcher
+//
+void CloudConfigDispatcher::setup() {
+    Particle.subscribe(eventName, &CloudConfigDispatcher::subscriptionHandler, this);
+}
+
+void CloudConfigDispatcher::subscriptionHandler(const char *eventName, const char *eventData) {
+    // <eventName>/<instance name> or <eventName>/<instance name>/patch
+    size_t prefixLen = strlen(this->eventName);
+    if (strncmp(eventName, this->eventName, prefixLen) != 0 || eventName[prefixLen] != '/') {
+        return;
+    }
+    const char *instanceName = &eventName[prefixLen + 1];
+
+    char name[64];
+    const char *slash = strchr(instanceName, '/');
+    size_t nameLen = slash ? (size_t)(slash - instanceName) : strlen(instanceName);
+    if (nameLen >= sizeof(name)) {
+        return;
+    }
+    memcpy(name, instanceName, nameLen);
+    name[nameLen] = 0;
+
+    CloudConfig *cloudConfig = CloudConfig::findInstance(name);
+    if (!cloudConfig) {
+        Log.info("no instance for event %s", eventName);
+        return;
+    }
+
+    if (!slash) {
+        cloudConfig->updateDataEncoded(eventData);
+    }
+    else
+    if (strcmp(slash, "/patch") == 0) {
+        cloudConfig->updateDataPatchEncoded(eventData);
+    }
+}
@@ -3,6 +3,8 @@
 
 #include "Particle.h"
 
+#include <atomic>
+
 // Github repository: https://github.com/rickkas7/CloudConfigRK
 // License: MIT
 
@@ -25,7 +27,7 @@ struct CloudConfigDataHeader { // 20 bytes
     uint8_t    headerSize;
 
     /**
-     * @brief Flag bits, not currently used. Currently 0.
+     * @brief Flag bits. CloudConfig::FLAG_BINARY is set if the data is in binary format instead of JSON.
      */
     uint8_t    flags;
 
@@ -43,14 +45,20 @@ struct CloudConfigDataHeader { // 20 bytes
     long        lastCheck;
 
     /**
-     * @brief Reserved for future use, currently 0.
+     * @brief Incremented each time the data is saved to a new slot
+     * 
+     * Used by CloudConfigStorageEEPROM::withSlots() to find the most recently saved slot. It's 0
+     * when not using slots, and was a reserved field (0) in earlier versions.
      */
-    uint32_t    reserved2;
+    uint32_t    sequence;
 
     /**
-     * @brief Reserved for future use, currently 0.
+     * @brief CRC-32 of the JSON data (not including the null terminator)
+     * 
+     * Used to detect when an update contains the same data that is already stored. This was
+     * a reserved field (0) in version 0.0.2 and earlier.
      */
-    uint32_t    reserved1;
+    uint32_t    dataHash;
 
     /**
      * Data goes after this header
@@ -76,6 +84,258 @@ struct CloudConfigData {
     char jsonData[SIZE];
 };
 
+/**
+ * @brief A JSON token used by the in-place parser (see CloudConfigStorage::withTokenPool)
+ * 
+ * Tokens only store offsets into the JSON data, so the JSON data is never copied or modified.
+ */
+struct CloudConfigToken { // 12 bytes
+    /**
+     * @brief Type of token, one of the JSONType constants like JSON_TYPE_OBJECT or JSON_TYPE_STRING
+     */
+    uint8_t     type;
+
+    /**
+     * @brief Reserved for future use, currently 0.
+     */
+    uint8_t     reserved;
+
+    /**
+     * @brief Number of children. For an object, the number of key/value pairs. For an array, the number of values.
+     */
+    uint16_t    size;
+
+    /**
+     * @brief Offset of the first character. For strings, this is after the opening double quote.
+     */
+    uint16_t    start;
+
+    /**
+     * @brief Offset after the last character. For strings, this is the offset of the closing double quote.
+     */
+    uint16_t    end;
+
+    /**
+     * @brief Number of tokens in this value including this one, used to skip over nested objects and arrays.
+     */
+    uint16_t    count;
+
+    /**
+     * @brief Index of the enclosing object or array, or -1 for the outermost token
+     */
+    int16_t     parent;
+
+    /**
+     * @brief Returns the smallest power of 2 that is greater than or equal to n
+     */
+    static constexpr size_t powerOf2(size_t n) { return (n <= 1) ? 1 : 2 * powerOf2((n + 1) / 2); };
+};
+
+/**
+ * @brief State saved with a token pool so the tokens can be reused without parsing again
+ * 
+ * When the token pool is in retained memory, parse() after a restart or wake from sleep
+ * uses the saved tokens if the dataHash and length of the JSON data and the sizes of the token 
+ * pool match. The tokens themselves are not checked, as that would cost about as much as 
+ * tokenizing again; retained memory that is lost is detected by the checksum of this structure.
+ */
+struct CloudConfigTokenCache {
+    /**
+     * @brief Magic bytes, MAGIC if the rest of the structure is valid
+     */
+    uint32_t    magic;
+
+    /**
+     * @brief dataHash from CloudConfigDataHeader of the data that was tokenized
+     */
+    uint32_t    dataHash;
+
+    /**
+     * @brief Hash of the other fields in this structure, to detect corrupted retained memory
+     */
+    uint32_t    checksum;
+
+    /**
+     * @brief Length of the JSON data that was tokenized
+     */
+    uint16_t    dataLen;
+
+    /**
+     * @brief Number of tokens from the parse
+     */
+    uint16_t    numTokens;
+
+    /**
+     * @brief Size of the token pool, in case the firmware was changed to use a different size
+     */
+    uint16_t    maxTokens;
+
+    /**
+     * @brief Size of the key index table
+     */
+    uint16_t    indexSize;
+
+    /**
+     * @brief Value of magic when valid
+     */
+    static const uint32_t MAGIC = 0x4b6f5464;
+};
+
+/**
+ * @brief Structure containing a compile-time sized token pool for the in-place parser
+ * 
+ * @param MAX_TOKENS The maximum number of tokens. Each object, array, key, and value is one token,
+ * so {"a":123,"b":[1,2]} is 7 tokens.
+ * 
+ * This is typically allocated as a global variable and passed to CloudConfigStorage::withTokenPool().
+ * Each token is 12 bytes and the key index another 2 bytes per token, rounded up to a power of 2.
+ */
+template<size_t MAX_TOKENS>
+struct CloudConfigTokenPool {
+    /**
+     * @brief Size of the key index table. Always a power of 2 and at least twice the maximum number of keys.
+     */
+    static const size_t INDEX_SIZE = CloudConfigToken::powerOf2(MAX_TOKENS);
+
+    /**
+     * @brief The tokens
+     */
+    CloudConfigToken tokens[MAX_TOKENS];
+
+    /**
+     * @brief The key index table
+     */
+    uint16_t tokenIndex[INDEX_SIZE];
+
+    /**
+     * @brief Used to reuse the tokens when the pool is in retained memory
+     */
+    CloudConfigTokenCache cache;
+};
+
+class CloudConfigStorage;
+class CloudConfig;
+
+/**
+ * @brief A path to a nested value, like "f.f1", "e[2]", or "a.b[0].c"
+ * 
+ * The path is split into key names and array indexes once when constructed. When it's used, the 
+ * location of the value is cached until the data is parsed again, so repeated lookups of the same 
+ * path do not search the data. It's typically allocated as a global variable:
+ * 
+ * ```
+ * CloudConfigPath f1Path("f.f1");
+ * 
+ * int f1 = CloudConfig::instance().getInt(f1Path);
+ * ```
+ * 
+ * Key names cannot contain . or [ and can be at most MAX_PATH_LEN - 1 characters in total.
+ */
+class CloudConfigPath {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param path The path. It's copied, so it does not need to remain valid.
+     * 
+     * If the path is not valid or too long, isValid() returns false and lookups do not find anything.
+     */
+    CloudConfigPath(const char *path);
+
+    /**
+     * @brief Returns true if the path was successfully split into key names and indexes
+     */
+    bool isValid() const { return numSegments > 0; };
+
+    /**
+     * @brief Returns true if the path is a single top level key name
+     */
+    bool isTopLevelKey() const { return numSegments == 1 && segments[0].isKey; };
+
+    /**
+     * @brief Gets the top level key name (the part before the first . or [)
+     */
+    const char *getFirstKey() const { return &pathBuf[segments[0].offset]; };
+
+    /**
+     * @brief Maximum length of the path, including the null terminator
+     */
+    static const size_t MAX_PATH_LEN = 64;
+
+    /**
+     * @brief Maximum number of key names and indexes in a path
+     */
+    static const size_t MAX_SEGMENTS = 8;
+
+protected:
+    /**
+     * @brief A key name or array index in a path
+     */
+    struct Segment {
+        /**
+         * @brief true for a key name, false for an array index
+         */
+        bool isKey;
+
+        /**
+         * @brief For a key name, the offset of the name in pathBuf
+         */
+        uint8_t offset;
+
+        /**
+         * @brief For an array index, the index
+         */
+        uint16_t index;
+    };
+
+    /**
+     * @brief Copy of the path with the key names null terminated
+     */
+    char pathBuf[MAX_PATH_LEN];
+
+    /**
+     * @brief The key names and indexes
+     */
+    Segment segments[MAX_SEGMENTS];
+
+    /**
+     * @brief Number of entries in segments, 0 if the path is not valid
+     */
+    size_t numSegments = 0;
+
+    /**
+     * @brief Storage that tokenIndex was resolved against
+     */
+    const CloudConfigStorage *tokenStorage = 0;
+
+    /**
+     * @brief Parse generation that tokenIndex was resolved against, see CloudConfigStorage::getParseGeneration()
+     */
+    uint32_t tokenGeneration = 0;
+
+    /**
+     * @brief Index of the value token in the in-place parser tokens, or -1 if not found
+     */
+    int tokenIndex = -1;
+
+    /**
+     * @brief Storage that value was resolved against
+     */
+    const CloudConfigStorage *valueStorage = 0;
+
+    /**
+     * @brief Parse generation that value was resolved against
+     */
+    uint32_t valueGeneration = 0;
+
+    /**
+     * @brief The value, if resolved using JSONValue
+     */
+    JSONValue value;
+
+    friend class CloudConfigStorage;
+};
+
 /**
  * @brief Abstract base class of all storage methods
  * 
@@ -92,8 +352,18 @@ public:
 
     /**
      * @brief Returns true if there is JSON data field is not empty
+     * 
+     * This is virtual so CloudConfigStorageLayered can check its layers without merging them.
      */
-    bool hasJsonData() const { return getJsonData()[0] != 0; };
+    virtual bool hasJsonData() const { return getJsonData()[0] != 0; };
+
+    /**
+     * @brief Returns true if there is data that was loaded from persistent storage or received from an update method
+     * 
+     * CloudConfig uses this to decide if data must be requested from the update method. This is the
+     * same as hasJsonData() except for CloudConfigStorageLayered, where the defaults don't count.
+     */
+    virtual bool hasUpdatedData() const { return hasJsonData(); };
 
     /**
      * @brief Gets a pointer to the data header
@@ -110,20 +380,93 @@ public:
      * The CloudConfigStorageData class has an overload that can get a mutable pointer
      * so the data can be updated, but this base class does not have one, because the 
      * CloudConfigDataStatic can't update the data in program flash from the device.
+     * 
+     * If the data is stored in binary format (CloudConfigStorageData::withBinaryFormat()) this
+     * is not a c-string; use getJsonText() instead.
      */
     virtual const char * const getJsonData() const = 0;
 
+    /**
+     * @brief Copies the data as JSON text
+     * 
+     * @param buf Buffer to copy to, or NULL to just get the length. Always null terminated if bufSize > 0.
+     * 
+     * @param bufSize Size of buf in bytes
+     * 
+     * @return The length of the JSON text not including the null terminator, like snprintf. If this
+     * is >= bufSize, the text was truncated.
+     * 
+     * This works for both JSON and binary format data. For binary format data, the JSON is 
+     * generated from the binary data, and keys in nested objects and arrays keep their original order.
+     */
+    size_t getJsonText(char *buf, size_t bufSize);
+
+    /**
+     * @brief Returns true if the stored data is in binary format instead of JSON
+     * 
+     * Overridden in CloudConfigStorageData to check the header flags.
+     */
+    virtual bool isBinaryData() const { return false; };
+
     /**
      * @brief Called from setup(). Optional. Only needed if the storage method wants setup processing time.
      */
     virtual void setup() = 0;
 
+    /**
+     * @brief Use the in-place parser with a caller-allocated token pool
+     * 
+     * @param pool The token pool, typically a global CloudConfigTokenPool<> variable.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * Must be called before setup(). The data is tokenized in place, without copying the JSON
+     * data or allocating memory, and getInt(), getBool(), getDouble() and copyString() are read
+     * directly from the tokens. getString() uses the string pool, which is allocated on the heap.
+     * The methods that return a JSONValue still work, but the first call after each parse() 
+     * makes a JSONValue::parseCopy() of the data.
+     * 
+     * If the pool is declared retained and the storage method is retained memory, the tokens
+     * are reused after a restart or wake from sleep as long as the data has not changed, so
+     * setup() doesn't need to parse the data again.
+     */
+    template<size_t MAX_TOKENS>
+    CloudConfigStorage &withTokenPool(CloudConfigTokenPool<MAX_TOKENS> &pool) { 
+        return withTokenPool(pool.tokens, MAX_TOKENS, pool.tokenIndex, pool.INDEX_SIZE, &pool.cache); 
+    };
+
+    /**
+     * @brief Use the in-place parser with a caller-allocated token pool
+     * 
+     * @param tokens Array of tokens
+     * 
+     * @param maxTokens Number of elements in the tokens array
+     * 
+     * @param tokenIndex Array used for the key index table
+     * 
+     * @param tokenIndexSize Number of elements in the tokenIndex array. Must be a power of 2 and should be
+     * at least twice the number of keys. If it's not a power of 2 the next smaller power of 2 is used. If 
+     * it's 0, the token pool is not used.
+     * 
+     * @param cache Optional state used to reuse the tokens if they are in retained memory. NULL to always parse.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * It's usually easier to use the overload that takes a CloudConfigTokenPool<>. 
+     */
+    CloudConfigStorage &withTokenPool(CloudConfigToken *tokens, size_t maxTokens, uint16_t *tokenIndex, size_t tokenIndexSize, CloudConfigTokenCache *cache = 0);
+
+    /**
+     * @brief Returns true if the last parse() reused the tokens from the token cache
+     */
+    bool isTokenCacheHit() const { return tokenCacheHit; };
+
     /**
      * @brief Called after the JSON data is updated to parse the data using the JSON parser
      * 
      * You normally don't need to override this, but it is virtual in case you do.
      */
-    virtual void parse() { jsonObj = JSONValue::parseCopy(getJsonData()); };
+    virtual void parse();
 
     /**
      * @brief Called from loop(). Optional. Only needed if the storage method wants loop processing time.
@@ -135,7 +478,7 @@ public:
      * 
      * This is typically an object, but could be an array.
      */
-    JSONValue getJSONValue() { return jsonObj; };
+    JSONValue getJSONValue() { parseJSONValue(); return jsonObj; };
 
     /**
      * @brief Gets the value for a given key in the top-level outer JSON object
@@ -144,8 +487,11 @@ public:
      * 
      * @return A JSONValue object for that key. If the key does not exist in that object, an
      * empty JSONValue object that returns false for isValid() is returned.
+     * 
+     * This uses the key index built by parse(), so it does not need to iterate the object
+     * and compare every key name.
      */
-    JSONValue getJSONValueForKey(const char *key) { return getJSONValueForKey(jsonObj, key); }; 
+    JSONValue getJSONValueForKey(const char *key); 
 
     /**
      * @brief Gets the value for a given key in the a JSON object 
@@ -173,12 +519,12 @@ public:
      * There is no call to determine the length of the array; iterate until an invalid object
      * is returned.
      */
-    JSONValue getJSONValueAtIndex(size_t index) { return getJSONValueAtIndex(jsonObj, index); }; 
+    JSONValue getJSONValueAtIndex(size_t index) { return getJSONValueAtIndex(getJSONValue(), index); }; 
 
     /**
      * @brief Gets the value for a given index in the a JSON array
      * 
-     * @param parentObj A JSONValue for a JSON object to look in
+     * @param parentObj A JSONValue for a JSON array to look in
      * 
      * @param index 0 = first entry, 1 = second entry, ...
      * 
@@ -191,828 +537,3885 @@ public:
     static JSONValue getJSONValueAtIndex(JSONValue parentObj, size_t index); 
 
     /**
-     * @brief This method is called to update the data in storage method and parse it again
+     * @brief Gets the value at a path, like "f.f1" or "e[2]"
      * 
-     * @param json The new JSON data to save
+     * @param path The path, see CloudConfigPath. The resolved value is cached in path until the
+     * data is parsed again.
      * 
-     * This is subclassed in CloudConfigStorageData.
+     * @return A JSONValue object for the value. If it does not exist, an empty JSONValue object 
+     * that returns false for isValid() is returned.
      */
-    virtual bool updateData(const char *json) { return false; };
+    JSONValue getJSONValueAtPath(CloudConfigPath &path);
 
-protected:
     /**
-     * @brief Destructor. Base class destructor is empty. Also, you can't delete one of these.
+     * @brief Gets the value at a path, like "f.f1" or "e[2]"
+     * 
+     * @param path The path as a c-string. This is split every time; use a CloudConfigPath
+     * object if you look up the same path repeatedly.
      */
-    virtual ~CloudConfigStorage() {};
+    JSONValue getJSONValueAtPath(const char *path) { CloudConfigPath tempPath(path); return getJSONValueAtPath(tempPath); };
 
     /**
-     * @brief This class is not copyable
+     * @brief Returns true if there is a value at a path
      */
-    CloudConfigStorage(const CloudConfigStorage&) = delete;
+    bool hasKey(CloudConfigPath &path);
 
     /**
-     * @brief This class is not copyable
+     * @brief Gets an integer value at a path. If it does not exist, 0 is returned.
      */
-    CloudConfigStorage& operator=(const CloudConfigStorage&) = delete;
+    int getInt(CloudConfigPath &path);
 
     /**
-     * @brief The JSONValue object for the outermost JSON object (or array)
-     * 
-     * The parse() method sets this. The parse() method is called from setup() and updateData().
+     * @brief Gets a boolean value at a path. If it does not exist, false is returned.
      */
-    JSONValue jsonObj;
-};
+    bool getBool(CloudConfigPath &path);
 
-/**
- * @brief Abstract base class of all storage methods that use a CloudConfigData structure
- * 
- * Classes that include a CloudConfigDataHeader (Retained, EEPROM, File) all use this class as
- * a base class as it contains handy common features that simplify those implementations.
- */
-class CloudConfigStorageData : public CloudConfigStorage {
-public:
     /**
-     * @brief Default constructor
+     * @brief Gets a double value at a path. If it does not exist, 0 is returned.
      */
-    CloudConfigStorageData() {};
+    double getDouble(CloudConfigPath &path);
 
     /**
-     * @brief Constructor with header
-     * 
-     * This constructor is basically the same as using the default contructor then using withData()
-     * 
-     * @param header The pointer to the  CloudConfigDataHeader structure 
+     * @brief Copies a string value at a path into a buffer
      * 
-     * @param dataSize The size of the data after the header. The total size is sizeof(CloudConfigDataHeader) + dataSize.
+     * @return true if the value exists. If it does not exist, buf is set to an empty string.
      */
-    CloudConfigStorageData(CloudConfigDataHeader *header, size_t dataSize);
+    bool copyString(CloudConfigPath &path, char *buf, size_t bufSize);
 
     /**
-     * @brief Specify the data header and data location
-     * 
-     * @param header The pointer to the  CloudConfigDataHeader structure 
-     * 
-     * @param dataSize The size of the data after the header. The total size is sizeof(CloudConfigDataHeader) + dataSize.
+     * @brief Gets a counter that is incremented every time the data is parsed
      * 
-     * @return Returns *this so you can chain calls, fluent-style.
+     * Pointers returned by getString() and cached paths are valid until this changes.
      */
-    CloudConfigStorageData &withData(CloudConfigDataHeader *header, size_t dataSize);
+    uint32_t getParseGeneration() const { return parseGeneration; };
 
     /**
-     * @brief Gets a pointer to the CloudConfigDataHeader structure
+     * @brief Returns true if the top-level JSON object contains key
+     * 
+     * @param key The name of the key-value pair
      */
-    virtual CloudConfigDataHeader *getDataHeader() { return header; };
+    virtual bool hasKey(const char *key);
 
     /**
-     * @brief Validate the CloudConfigDataHeader
+     * @brief Returns true if the top-level JSON object contains key with a null value
      * 
-     * If not valid, then resets the entire structure to default values. This is common when the structure is
-     * first initialized.
+     * @param key The name of the key-value pair
      */
-    void validate();
+    virtual bool isNull(const char *key);
 
     /**
-     * @brief Gets a pointer to the JSON data for reading (const)
-     *
-     * This is right after the CloudConfigDataHeader structure.
+     * @brief Gets a top level JSON integer value by its key name
+     * 
+     * @param key The JSON key to retrieve
+     * 
+     * If the key does not exist, 0 is returned.
      */
-    const char * const getJsonData() const;
+    virtual int getInt(const char *key);
 
     /**
-     * @brief Returns the maximum size of the JSON data in characters
+     * @brief Gets a top level JSON boolean value by its key name
      * 
-     * The buffer is one byte larger than this because there is always a trailling null to make it
-     * a c-string.
+     * @param key The JSON key to retrieve
      * 
-     * @return Maximum number of characters of JSON data
+     * If the key does not exist, false is returned.
      */
-    size_t getMaxJsonDataSize() const { return dataSize - 1; };
+    virtual bool getBool(const char *key);
 
     /**
-     * @brief Gets a pointer to the JSON data for writing (not const)
-     *
-     * This is right after the CloudConfigDataHeader structure. This method is not available on all storage
-     * classes. For example, CloudStorageStatic stores the data in program flash, so it can't be written to.
+     * @brief Gets a top level JSON double value by its key name
+     * 
+     * @param key The JSON key to retrieve
+     * 
+     * If the key does not exist, 0 is returned.
      */
-    char *getJsonData();
+    virtual double getDouble(const char *key);
 
     /**
-     * @brief Gets the total size of the buffer including both the header and the JSON data
+     * @brief Gets a top level JSON string value by its key name
      * 
-     * This is the buffer size; the actual JSON string could be shorter as it's variable length.
+     * @param key The JSON key to retrieve
+     * 
+     * If the key does not exist, an empty string is returned.
+     * 
+     * The top level string, number, and boolean values are unescaped once, the first time this
+     * is called after the data is parsed, into a string pool owned by this object, so this is a 
+     * hash lookup that returns a pointer into the pool. The pointer remains valid until the data 
+     * is parsed again, which is before the next data callback. Identical values share the same 
+     * pointer. If there is not enough memory for the pool, an empty string is returned; use
+     * copyString() instead, which does not allocate memory.
      */
-    size_t getTotalSize() const { return sizeof(CloudConfigDataHeader) + dataSize; };
+    virtual const char *getString(const char *key);
 
     /**
-     * @brief This method is called after subclasses update the JSON data
+     * @brief Copies a top level JSON string value into a buffer
      * 
-     * The default implementation in this class is usually sufficient, but it can be overridden
-     * by subclasses if necessary.
+     * @param key The JSON key to retrieve
      * 
-     * - Checks to make sure json will fit in dataSize
-     * - Copies the JSON data (with trailing null)
-     * - Calls parse() to run the JSMN JSON parser on it and update jsonObj in the parent class
-     * - Calls save() to save the data in this storage method
+     * @param buf The buffer to copy to. It is always null terminated, even if the value is truncated.
+     * 
+     * @param bufSize The size of the buffer in bytes.
+     * 
+     * @return true if the key exists, false if not. If the key does not exist, buf is set to an empty string.
+     * 
+     * When using the in-place parser this does not allocate memory.
      */
-    virtual bool updateData(const char *json);
+    virtual bool copyString(const char *key, char *buf, size_t bufSize);
 
     /**
-     * @brief Save the data in the storage subclass. Must be implemented in subclasses!
+     * @brief Tokenize JSON data without modifying or copying it
      * 
-     * @return true on success or false on failure. 
+     * @param json The JSON data
+     * 
+     * @param jsonLen The length of the JSON data
+     * 
+     * @param tokens Array to store the tokens in
+     * 
+     * @param maxTokens Number of elements in the tokens array
+     * 
+     * @return The number of tokens, or -1 if the data is not valid JSON or there are not enough tokens.
+     * 
+     * Numbers must use the JSON number syntax, and the other primitives must be exactly true, false, 
+     * or null.
      */
-    virtual bool save() = 0;
+    static int tokenize(const char *json, size_t jsonLen, CloudConfigToken *tokens, size_t maxTokens);
 
-protected:
     /**
-     * @brief Pointer to the header with data after it
+     * @brief Returns true if str is a number in JSON syntax, for example -12, 0.5, or 1e-3
+     * 
+     * @param str The number (not null terminated)
+     * 
+     * @param len The length of str
      */
-    CloudConfigDataHeader *header;
+    static bool isValidNumber(const char *str, size_t len);
 
     /**
-     * @brief Size of the JSON data, not including sizeof(CloudConfigDataHeader)
+     * @brief Finds a key in an object token
+     * 
+     * @param json The JSON data that was tokenized
+     * 
+     * @param tokens The tokens from tokenize()
+     * 
+     * @param objToken Index of the object token
+     * 
+     * @param key The key to find, escaped the same way as in json (not null terminated)
+     * 
+     * @param keyLen The length of key
+     * 
+     * @return The index of the value token, or -1 if the key is not in the object.
+     * 
+     * If the object has the same key more than once the first one is found. Everything that
+     * handles duplicate keys uses the first one, the same as iterating the object.
      */
-    size_t dataSize;
-};
+    static int findObjectKey(const char *json, const CloudConfigToken *tokens, int objToken, const char *key, size_t keyLen);
 
+    /**
+     * @brief Apply a JSON merge patch (RFC 7386) to JSON data
+     * 
+     * @param target The existing JSON data. Can be an empty string if there is no data.
+     * 
+     * @param patch The patch. Keys in objects in the patch replace or are added to the target,
+     * except keys with a null value, which are removed from the target. Other values replace
+     * the target.
+     * 
+     * @param buf Buffer to store the result in. It is null terminated.
+     * 
+     * @param bufSize Size of buf in bytes. strlen(target) + strlen(patch) + 3 is always sufficient.
+     * 
+     * @param nullRemoves true (the default) to remove keys with a null value in the patch, as in RFC 7386.
+     * false to leave the target value unchanged instead, used by CloudConfigStorageLayered.
+     * 
+     * @return true on success, false if either is not valid JSON or buf is too small.
+     * 
+     * Values that are not changed are copied from target without being reformatted.
+     */
+    static bool mergePatch(const char *target, const char *patch, char *buf, size_t bufSize, bool nullRemoves = true);
 
-/**
- * @brief Abstract base class for updating cloud config data
- */
-class CloudConfigUpdate {
-public:
     /**
-     * @brief Default constructor
+     * @brief This method is called to update the data in storage method and parse it again
+     * 
+     * @param json The new JSON data to save
+     * 
+     * This is subclassed in CloudConfigStorageData.
      */
-    CloudConfigUpdate() {};
+    virtual bool updateData(const char *json) { return false; };
 
     /**
-     * @brief Called during setup() to allow update methods to have setup time 
+     * @brief Updates the data and parses it, but does not save it yet
      * 
-     * Optional for subclasses to override.
+     * @param json The new JSON data
+     * 
+     * Used by CloudConfig::withStagedCommit() to separate parsing from saving. Call saveData() 
+     * afterwards to save it. The default implementation calls updateData(), which also saves it.
      */
-    virtual void setup() {};
+    virtual bool setData(const char *json) { return updateData(json); };
 
     /**
-     * @brief Called during loop() to allow update methods to have loop time 
+     * @brief Saves the data set using setData()
      * 
-     * Optional for subclasses to override.
+     * The default implementation does nothing, as it was already saved by setData().
      */
-    virtual void loop() {};
+    virtual bool saveData() { return true; };
 
     /**
-     * @brief Called when subclasses should update the data from the cloud.
+     * @brief Saves only the header, for changes like lastCheck that don't modify the data
      * 
-     * Optional for subclasses to override, but typically useful to do so. It is
-     * called after cloud connected and after waitAfterCloudConnectedMs depending
-     * on the settings for updateFrequency.
+     * The default implementation does nothing.
+     */
+    virtual bool saveHeader() { return true; };
+
+    /**
+     * @brief Gets the number of bytes written to persistent storage by the last save or saveHeader()
      * 
-     * The subclass must call ConfigConfig::instance().updateData() or 
-     * ConfigConfig::instance().updateDataFailed() if this method is called.
+     * Used for CloudConfigMetrics. The base class returns 0.
      */
-    virtual void startUpdate() {};
+    virtual size_t getLastSaveBytes() const { return 0; };
 
     /**
-     * @brief How long to wait after cloud connected to update settings.
+     * @brief Gets the largest data that updateData() can store, in bytes
+     * 
+     * @return The size, or 0 if not limited or not known. The base class returns 0.
+     * 
+     * Used by CloudConfigUpdateWebhook to limit the size of a multi-part response.
      */
-    unsigned long waitAfterCloudConnectedMs = 2000;
+    virtual size_t getMaxDataSize() const { return 0; };
 
     /**
-     * @brief If a response is not received in this amount of time, an error is assumed
-     * and another attempt will be made later.
+     * @brief Returns true if json is the same as the data that is already stored
      * 
-     * If subclasses take a long time to retrieve data you may need to override this
-     * value from your subclass constructor or setup method.
+     * @param json The new JSON data
+     * 
+     * This is subclassed in CloudConfigStorageData. When true, CloudConfig::updateData() skips
+     * updating, parsing, and saving the data, and does not call the data callback.
      */
-    unsigned long updateTimeoutMs = 60000;
+    virtual bool isSameData(const char *json) { return false; };
 
 protected:
     /**
-     * @brief Destructor. Base class destructor is empty. Also, you can't delete one of these.
+     * @brief Entry in the key index hash table
      */
-    virtual ~CloudConfigUpdate() {};
+    struct KeyIndexEntry {
+        /**
+         * @brief Hash of the key name, from hashKey()
+         */
+        uint32_t hash;
+
+        /**
+         * @brief Key name. This points into the data owned by jsonObj. NULL for an empty slot.
+         */
+        const char *name;
+
+        /**
+         * @brief Value for this key
+         */
+        JSONValue value;
+    };
+
+    /**
+     * @brief Entry in the string pool hash table
+     */
+    struct StringPoolEntry {
+        /**
+         * @brief Hash of the key name, from hashKey()
+         */
+        uint32_t hash;
+
+        /**
+         * @brief Key name. This points into stringPool. NULL for an empty slot.
+         */
+        const char *name;
+
+        /**
+         * @brief Unescaped value. This points into stringPool.
+         */
+        const char *value;
+    };
+
+    /**
+     * @brief Destructor. You can't delete one of these.
+     */
+    virtual ~CloudConfigStorage() { clearKeyIndex(); clearStringPool(); };
 
     /**
      * @brief This class is not copyable
      */
-    CloudConfigUpdate(const CloudConfigUpdate&) = delete;
+    CloudConfigStorage(const CloudConfigStorage&) = delete;
 
     /**
      * @brief This class is not copyable
      */
-    CloudConfigUpdate& operator=(const CloudConfigUpdate&) = delete;
+    CloudConfigStorage& operator=(const CloudConfigStorage&) = delete;
 
-};
+    /**
+     * @brief Builds the key index for the top-level object in jsonObj
+     * 
+     * This is called from parse(). If you override parse(), call this after setting jsonObj.
+     * 
+     * The index is an open-addressed hash table (linear probing) that is at most half full. If the
+     * table cannot be allocated, getJSONValueForKey() falls back to iterating the object.
+     */
+    void buildKeyIndex();
 
-/**
- * @brief Singleton class for managing cloud-based configuration
- * 
- */
-class CloudConfig {
-public:
     /**
-     * @brief Magic bytes used to detect if EEPROM or retained memory has been initialized
+     * @brief Frees the key index
      */
-    static const uint32_t DATA_MAGIC = 0x7251dd53;
+    void clearKeyIndex();
 
     /**
-     * @brief Value used for updateFrequency to only request configuration data if it has never been saved
+     * @brief Builds the string pool used by getString()
+     * 
+     * This is called from getString() the first time after parse(), so the data is not copied on
+     * each boot if getString() is not used. CloudConfigStorageCopy calls it from copyFrom() instead,
+     * as the copy is read from other threads. The keys and unescaped values of the top level
+     * primitive values are copied into a single buffer, with identical values stored once, and 
+     * indexed by an open-addressed hash table. Identical values are found using a second hash
+     * table that is only allocated while building. For binary format data, only numbers, booleans,
+     * and null are in the pool, formatted as strings, as strings are returned from the binary data. 
+     * If the pool cannot be allocated, getString() returns an empty string.
      */
-    static const long UPDATE_ONCE = 0;
+    void buildStringPool();
 
     /**
-     * @brief Value used for updateFrequency to request configuration data on every restart
-     * 
-     * Note that this also means after every HIBERNATE sleep wake!
+     * @brief Frees the string pool
      */
-    static const long UPDATE_AT_RESTART = -1;
+    void clearStringPool();
 
     /**
-     * @brief Enumeration used for the status of updateData
+     * @brief Finds the value token for a path using the in-place parser tokens, using the cached value if possible
+     * 
+     * @return The token index, or -1 if not found or not using the in-place parser
      */
-    enum class UpdateDataStatus {
-        /**
-         * @brief updateData is not in progress
-         */
-        IDLE,
+    int findPathToken(CloudConfigPath &path);
 
-        /**
-         * @brief updateData is in progress (startData called, but updateData or updateDataFailed not called yet, and not at timeout)
-         */
-        IN_PROGRESS,
+    /**
+     * @brief Converts a primitive value token to int, as in getInt()
+     */
+    int tokenToInt(int index) const;
 
-        /**
-         * @brief After startData(), updateData() was called so the data was successfully retrieved.
-         */
-        SUCCESS,
+    /**
+     * @brief Converts a primitive value token to bool, as in getBool()
+     */
+    bool tokenToBool(int index) const;
 
-        /**
-         * @brief After startData(), updateDataFailed() was called so the data was not retrieved.
-         */
-        FAILURE,
+    /**
+     * @brief Converts a primitive value token to double, as in getDouble()
+     */
+    double tokenToDouble(int index) const;
 
-        /**
-         * @brief After startData(), neither updateData() nor updateDataFailed() were called by the timeout value
-         */
-        TIMEOUT
-    };
+    /**
+     * @brief Copies a value token to a buffer, unescaping it, as in copyString()
+     */
+    bool tokenToString(int index, char *buf, size_t bufSize) const;
 
     /**
-     * @brief Get the singleton instance of this class
+     * @brief Hash function used for the key index (32-bit FNV-1a)
      * 
-     * You always use CloudConfig::instance() to get a reference to the singleton instance of this
-     * class. You cannot construct one of these as a global or on the stack. The singleton instance
-     * will never be deleted.
+     * @param key The key name (c-string)
      */
-    static CloudConfig &instance();
-
+    static uint32_t hashKey(const char *key) { return hashKey(key, strlen(key)); };
 
     /**
-     * @brief Sets the storage method class, required before setup() is called.
-     * 
-     * @param storageMethod The CloudConfigStorage subclass instance to use to store and retrieve the data
-     * 
-     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * @brief Hash function used for the key index (32-bit FNV-1a)
      * 
-     * There can only be one storage method, and once set, cannot be changed or removed. 
+     * @param key The key name (not null terminated)
      * 
+     * @param keyLen Length of the key name
      */
-    CloudConfig &withStorageMethod(CloudConfigStorage *storageMethod) { this->storageMethod = storageMethod; return *this; };
+    static uint32_t hashKey(const char *key, size_t keyLen);
 
     /**
-     * @brief Sets the update method class, not required, but if used, call before setup() is called.
-     * 
-     * @param updateMethod The CloudConfigUpdate subclass instance to use to get data from the cloud
+     * @brief Gets the size of a hash table for numEntries entries
      * 
-     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
-     * 
-     * There can only be one update method, and once set, cannot be changed or removed. 
+     * The size is a power of 2 so it can be masked, and the table is at most half full so 
+     * probe sequences stay short.
      */
-    CloudConfig &withUpdateMethod(CloudConfigUpdate *updateMethod) { this->updateMethod = updateMethod; return *this; };
+    static size_t getHashTableSize(size_t numEntries);
 
+    /**
+     * @brief Make sure jsonObj is set, parsing a copy of the data if using the in-place parser or binary format
+     */
+    void parseJSONValue();
 
     /**
-     * @brief Sets the update frequency in seconds
-     * 
-     * @param updateFrequency update frequency in seconds
-     * 
-     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
-     * 
-     * See also the overload that takes a chrono literal, as well as withUpdateFrequencyOnce() and withUpdateFrequencyAtRestart().
-     * 
-     * Can be called after setup to change the update frequency.
+     * @brief Type of a value in binary format data
      */
-    CloudConfig &withUpdateFrequency(long updateFrequency) { this->updateFrequency = updateFrequency; return *this; };
+    enum BinaryType : uint8_t {
+        BINARY_NULL = 0,    //!< null, no value bytes
+        BINARY_FALSE,       //!< false, no value bytes 
+        BINARY_TRUE,        //!< true, no value bytes
+        BINARY_INT8,        //!< int8_t, 1 byte
+        BINARY_INT16,       //!< int16_t, 2 bytes
+        BINARY_INT32,       //!< int32_t, 4 bytes
+        BINARY_FLOAT,       //!< float, 4 bytes, used when the number is exactly representable as a float
+        BINARY_DOUBLE,      //!< double, 8 bytes
+        BINARY_STRING,      //!< length, unescaped string, null terminator
+        BINARY_JSON         //!< length, JSON text of an object or array, null terminator
+    };
 
     /**
-     * @brief Sets the update frequency as a chrono literal
+     * @brief First byte of binary format data
+     */
+    static const uint8_t BINARY_MARKER = 0xb2;
+
+    /**
+     * @brief Size of the header at the beginning of binary format data
+     * 
+     * - Marker (1 byte, BINARY_MARKER)
+     * - Number of keys (1 byte). Objects with more than 255 keys are stored as JSON.
+     * - Total length including this header (uint16_t)
+     * - CRC-32 of the data after this header (uint32_t)
+     * 
+     * This is followed by the entries in the original order. Each entry starts with a byte with the
+     * type (BinaryType) in the high 4 bits and the key length in the low 4 bits. If the key is 15
+     * bytes or longer the low 4 bits are 15 and the key length is in the next byte. The key is
+     * not null terminated, and is followed by the value. String and JSON lengths are 1 byte, or 
+     * 255 followed by a uint16_t for 255 bytes or longer. Multi-byte values are in native byte 
+     * order and are not aligned.
+     */
+    static const size_t BINARY_HEADER_SIZE = 8;
+
+    /**
+     * @brief Converts a JSON object to binary format
      * 
-     * @param chronoLiteral update frequency as a chrono literal. For example: 15min (15 minutes) or 24h (24 hours).
+     * @param json The JSON data. The outer value must be an object.
      * 
-     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * @param buf The buffer to write to
      * 
-     * See also withUpdateFrequencyOnce() and withUpdateFrequencyAtRestart().
+     * @param bufSize Size of buf in bytes
      * 
-     * Can be called after setup to change the update frequency.
+     * @return The length of the binary data on success, or 0 if the data is not a valid JSON object or it does not fit
      */
-    CloudConfig &withUpdateFrequency(std::chrono::seconds chronoLiteral) { this->updateFrequency = chronoLiteral.count(); return *this; };
+    static size_t jsonToBinary(const char *json, char *buf, size_t bufSize);
 
     /**
-     * @brief Sets the update frequency only if there is no saved value. 
+     * @brief Check binary format data
      * 
-     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * @param data The binary format data
      * 
-     * If there is no saved value, then the update occurs after connecting to the cloud.
+     * @param maxLen The size of the buffer containing data
      * 
-     * Should be done before setup() to make sure it takes effect in time.
+     * @return The length of the binary data if valid, or 0 if not valid
      */
-    CloudConfig &withUpdateFrequencyOnce() { this->updateFrequency = UPDATE_ONCE; return *this; };
+    static size_t isValidBinary(const char *data, size_t maxLen);
 
     /**
-     * @brief Sets the update frequency to update once after cloud connecting after restart.
+     * @brief Formats a binary format number or boolean value as JSON text
      * 
-     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * @param entry Pointer to the entry (type byte)
      * 
-     * This is anything that calls setup() so includes device reset and wake from HIBERNATE sleep mode.
+     * @param buf Buffer to write to. Always null terminated if bufSize > 0.
      * 
-     * Should be done before setup() to make sure it takes effect in time.
+     * @param bufSize Size of buf in bytes
+     * 
+     * @return Length of the text, like snprintf. Other types write an empty string and return 0.
      */
-    CloudConfig &withUpdateFrequencyAtRestart() { this->updateFrequency = UPDATE_AT_RESTART; return *this; };
+    static size_t formatBinaryValue(const uint8_t *entry, char *buf, size_t bufSize);
 
     /**
-     * @brief Adds a callback to be called after data is loaded or updated
-     * 
-     * @param dataCallback the callback function to call
+     * @brief Finds the entry for a key in binary format data
      * 
-     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
-     * 
-     * Must be called before setup().
-     * 
-     * The method should have this prototype:
-     *  
-     *   void callback(void);
+     * @return Pointer to the first byte of the entry, or NULL if not found or not using binary format
      * 
-     * The callback can also be a C++11 lambda, which you can use to call a C++ member function, if desired.
+     * This is a linear search, but only the entries with a key of the same length are compared.
      */
-    CloudConfig &withDataCallback(std::function<void(void)> dataCallback) { this->dataCallback = dataCallback; return *this; };
+    const uint8_t *findBinaryEntry(const char *key) const;
 
     /**
-     * @brief You must call setup() from your app's global setup after configuring it using the withXXX() methods
+     * @brief Gets the type of a binary format entry (BinaryType)
      */
-    void setup();
+    static uint8_t getBinaryType(const uint8_t *entry) { return entry[0] >> 4; };
 
     /**
-     * @brief You must call this from loop on every call to loop()
+     * @brief Gets the length of the key of a binary format entry
      */
-    void loop();
+    static size_t getBinaryKeyLen(const uint8_t *entry) { return ((entry[0] & 0x0f) < 15) ? (entry[0] & 0x0f) : entry[1]; };
 
-    //
-    // Convenience wrappers to access storage values
-    // 
+    /**
+     * @brief Gets a pointer the key of a binary format entry. It is not null terminated.
+     */
+    static const char *getBinaryKey(const uint8_t *entry) { return (const char *)&entry[((entry[0] & 0x0f) < 15) ? 1 : 2]; };
 
     /**
-     * @brief Gets the top level (outer) JSONValue object. 
-     * 
-     * This is typically an object, but could be an array.
+     * @brief Gets a pointer to the value of binary format entry, after the key
      */
-    JSONValue getJSONValue() { return storageMethod->getJSONValue(); };
+    static const uint8_t *getBinaryValue(const uint8_t *entry) { return (const uint8_t *)getBinaryKey(entry) + getBinaryKeyLen(entry); };
 
     /**
-     * @brief Gets the value for a given key in the top-level outer JSON object
+     * @brief Gets the null terminated text of a BINARY_STRING or BINARY_JSON entry
      * 
-     * @param key The name of the key-value pair
+     * @param entry The entry
+     * 
+     * @param len Filled in with the length, not including the null terminator. Can be NULL.
+     */
+    static const char *getBinaryText(const uint8_t *entry, size_t *len = NULL);
+
+    /**
+     * @brief Gets the value of a number entry (BINARY_INT8 to BINARY_DOUBLE) as a double. Other types are 0.
+     */
+    static double getBinaryNumber(const uint8_t *entry);
+
+    /**
+     * @brief Returns true if the type is BINARY_INT8, BINARY_INT16, or BINARY_INT32
+     */
+    static bool isBinaryInt(uint8_t type) { return type >= BINARY_INT8 && type <= BINARY_INT32; };
+
+    /**
+     * @brief Returns true if the type is one of the integer types, BINARY_FLOAT, or BINARY_DOUBLE
+     */
+    static bool isBinaryNumber(uint8_t type) { return type >= BINARY_INT8 && type <= BINARY_DOUBLE; };
+
+    /**
+     * @brief Gets a pointer to the entry after entry
+     */
+    static const uint8_t *getNextBinaryEntry(const uint8_t *entry);
+
+    /**
+     * @brief Builds the key index for the in-place parser into tokenIndex
+     */
+    void buildTokenIndex();
+
+    /**
+     * @brief Hash of the fields of tokenCache other than checksum
+     */
+    uint32_t getTokenCacheChecksum() const;
+
+    /**
+     * @brief Returns true if tokenCache matches the current data, so the tokens can be used without parsing
+     * 
+     * @param jsonLen Length of the JSON data
+     */
+    bool isTokenCacheValid(size_t jsonLen);
+
+    /**
+     * @brief Finds the value token for a top-level key when using the in-place parser
+     * 
+     * @param key The key name (c-string)
+     * 
+     * @return The index into tokens, or -1 if the key does not exist or not using the in-place parser.
+     */
+    int findToken(const char *key) const;
+
+    /**
+     * @brief Unescape a JSON string
+     * 
+     * @param src The JSON string data, after the opening double quote
+     * 
+     * @param srcLen The length of src, not including the closing double quote
+     * 
+     * @param buf The buffer to copy to. It is always null terminated.
+     * 
+     * @param bufSize The size of the buffer in bytes. Must be at least 1.
+     * 
+     * @return The number of bytes stored in buf, not including the null terminator.
+     */
+    static size_t unescapeString(const char *src, size_t srcLen, char *buf, size_t bufSize);
+
+    /**
+     * @brief Unescape one character of a JSON string
+     * 
+     * @param src The JSON string data, after the opening double quote
+     * 
+     * @param srcLen The length of src, not including the closing double quote
+     * 
+     * @param ii The index into src. Must be less than srcLen. It is advanced past the character and 
+     * its escape sequence, if any.
+     * 
+     * @param utf8 Buffer of at least 3 bytes. Not null terminated.
+     * 
+     * @return The number of bytes stored in utf8, 1 to 3.
+     */
+    static size_t unescapeChar(const char *src, size_t srcLen, size_t &ii, char *utf8);
+
+    /**
+     * @brief Compares a JSON string, which may contain escapes, with an unescaped key
+     * 
+     * @param src The JSON string data, after the opening double quote
+     * 
+     * @param srcLen The length of src, not including the closing double quote
+     * 
+     * @param key The key to compare to (not null terminated)
+     * 
+     * @param keyLen The length of key
+     * 
+     * This does not allocate memory, and is a plain memcmp() if src does not contain a backslash.
+     */
+    static bool isSameKey(const char *src, size_t srcLen, const char *key, size_t keyLen);
+
+    /**
+     * @brief Gets hashKey() of a JSON string, which may contain escapes, after unescaping it
+     */
+    static uint32_t hashEscapedKey(const char *src, size_t srcLen);
+
+    /**
+     * @brief Escape a string as a JSON string, including the double quotes
+     * 
+     * @param str The string to escape
+     * 
+     * @param strLen The length of str
+     * 
+     * @param buf The buffer to copy to, or NULL to only get the length. It is null terminated if bufSize > 0,
+     * truncating if necessary.
+     * 
+     * @param bufSize The size of the buffer in bytes
+     * 
+     * @return The length of the escaped string, not including the null terminator. This can be larger
+     * than bufSize if the buffer is too small.
+     */
+    static size_t escapeString(const char *str, size_t strLen, char *buf, size_t bufSize);
+
+    /**
+     * @brief The JSONValue object for the outermost JSON object (or array)
+     * 
+     * The parse() method sets this. The parse() method is called from setup() and updateData().
+     */
+    JSONValue jsonObj;
+
+    /**
+     * @brief Key index hash table, allocated by buildKeyIndex(). NULL if there is no index.
+     */
+    KeyIndexEntry *keyIndex = 0;
+
+    /**
+     * @brief Number of entries in keyIndex. Always 0 or a power of 2.
+     */
+    size_t keyIndexSize = 0;
+
+    /**
+     * @brief Incremented by parse(), see getParseGeneration()
+     */
+    uint32_t parseGeneration = 0;
+
+    /**
+     * @brief Buffer containing null terminated keys and values, allocated by buildStringPool()
+     */
+    char *stringPool = 0;
+
+    /**
+     * @brief String pool hash table, allocated by buildStringPool(). NULL if there is no string pool.
+     */
+    StringPoolEntry *stringIndex = 0;
+
+    /**
+     * @brief Number of entries in stringIndex. Always 0 or a power of 2.
+     */
+    size_t stringIndexSize = 0;
+
+    /**
+     * @brief true if buildStringPool() needs to be called before the string pool is used. Set by parse().
+     */
+    bool stringPoolStale = false;
+
+    /**
+     * @brief Token pool for the in-place parser, or NULL to use JSONValue::parseCopy()
+     */
+    CloudConfigToken *tokens = 0;
+
+    /**
+     * @brief Number of elements in tokens
+     */
+    size_t maxTokens = 0;
+
+    /**
+     * @brief Number of tokens from the last parse(), 0 if the data is empty or not valid
+     */
+    size_t numTokens = 0;
+
+    /**
+     * @brief Key index table for the in-place parser. Entries are the key token index + 1, or 0 for an empty slot.
+     */
+    uint16_t *tokenIndex = 0;
+
+    /**
+     * @brief Number of elements in tokenIndex. Always a power of 2.
+     */
+    size_t tokenIndexSize = 0;
+
+    /**
+     * @brief State used to reuse the tokens, or NULL if not used
+     */
+    CloudConfigTokenCache *tokenCache = 0;
+
+    /**
+     * @brief true if the last parse() reused the tokens from tokenCache
+     */
+    bool tokenCacheHit = false;
+
+    /**
+     * @brief true if jsonObj needs to be parsed from the data before use
+     * 
+     * Only used with the in-place parser and binary format, as jsonObj is only created when needed.
+     */
+    bool jsonObjStale = false;
+
+    /**
+     * @brief Pointer to the data if it is in binary format, NULL if it's JSON. Set by parse().
+     */
+    const uint8_t *binaryData = 0;
+};
+
+/**
+ * @brief Abstract base class of all storage methods that use a CloudConfigData structure
+ * 
+ * Classes that include a CloudConfigDataHeader (Retained, EEPROM, File) all use this class as
+ * a base class as it contains handy common features that simplify those implementations.
+ */
+class CloudConfigStorageData : public CloudConfigStorage {
+public:
+    /**
+     * @brief Default constructor
+     */
+    CloudConfigStorageData() {};
+
+    /**
+     * @brief Constructor with header
+     * 
+     * This constructor is basically the same as using the default contructor then using withData()
+     * 
+     * @param header The pointer to the  CloudConfigDataHeader structure 
+     * 
+     * @param dataSize The size of the data after the header. The total size is sizeof(CloudConfigDataHeader) + dataSize.
+     */
+    CloudConfigStorageData(CloudConfigDataHeader *header, size_t dataSize);
+
+    /**
+     * @brief Specify the data header and data location
+     * 
+     * @param header The pointer to the  CloudConfigDataHeader structure 
+     * 
+     * @param dataSize The size of the data after the header. The total size is sizeof(CloudConfigDataHeader) + dataSize.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     */
+    CloudConfigStorageData &withData(CloudConfigDataHeader *header, size_t dataSize);
+
+    /**
+     * @brief Store the data in a compact binary format instead of JSON text
+     * 
+     * @param binaryFormat true to enable (the default if the parameter is omitted) or false to disable
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * When enabled, the JSON data received in updateData() is converted once to a list of keys
+     * and typed values. Integers are stored in 1, 2, or 4 bytes, booleans and null in the type byte,
+     * and keys and strings with a 1-byte length and no quotes or escapes, so boot does not require 
+     * parsing. For example, {"a":123,"b":"testing","c":true,"d":1.5} is 40 bytes as JSON and
+     * 30 bytes in binary format including the 8 byte header. Nested objects and arrays are stored 
+     * as JSON text.
+     * 
+     * The outer JSON value must be an object. If the data is not an object or does not fit in 
+     * binary format, it's stored as JSON text. Data that is already stored in either format can be
+     * read regardless of this setting; the format is stored in the header flags.
+     */
+    CloudConfigStorageData &withBinaryFormat(bool binaryFormat = true) { this->binaryFormat = binaryFormat; return *this; };
+
+    /**
+     * @brief Gets a pointer to the CloudConfigDataHeader structure
+     */
+    virtual CloudConfigDataHeader *getDataHeader() { return header; };
+
+    /**
+     * @brief Validate the CloudConfigDataHeader
+     * 
+     * If not valid, then resets the entire structure to default values. This is common when the structure is
+     * first initialized.
+     */
+    void validate();
+
+    /**
+     * @brief Gets a pointer to the JSON data for reading (const)
+     *
+     * This is right after the CloudConfigDataHeader structure.
+     */
+    const char * const getJsonData() const;
+
+    /**
+     * @brief Returns the maximum size of the JSON data in characters
+     * 
+     * The buffer is one byte larger than this because there is always a trailling null to make it
+     * a c-string.
+     * 
+     * @return Maximum number of characters of JSON data
+     */
+    size_t getMaxJsonDataSize() const { return dataSize - 1; };
+
+    /**
+     * @brief Gets a pointer to the JSON data for writing (not const)
+     *
+     * This is right after the CloudConfigDataHeader structure. This method is not available on all storage
+     * classes. For example, CloudStorageStatic stores the data in program flash, so it can't be written to.
+     */
+    char *getJsonData();
+
+    /**
+     * @brief Gets the total size of the buffer including both the header and the JSON data
+     * 
+     * This is the buffer size; the actual JSON string could be shorter as it's variable length.
+     */
+    size_t getTotalSize() const { return sizeof(CloudConfigDataHeader) + dataSize; };
+
+    /**
+     * @brief Gets the number of bytes of data in use after the header
+     * 
+     * For JSON this is the length of the string including the null terminator. For binary 
+     * format data this is the length of the binary data.
+     */
+    size_t getUsedDataSize() const;
+
+    /**
+     * @brief Returns true if the data is in binary format, see withBinaryFormat()
+     */
+    virtual bool isBinaryData() const;
+
+    /**
+     * @brief This method is called after subclasses update the JSON data
+     * 
+     * The default implementation in this class is usually sufficient, but it can be overridden
+     * by subclasses if necessary.
+     * 
+     * - Calls setData() to copy and parse the data
+     * - Calls save() to save the data in this storage method
+     */
+    virtual bool updateData(const char *json);
+
+    /**
+     * @brief Updates and parses the data without saving it
+     * 
+     * - Checks to make sure json will fit in dataSize
+     * - Copies the JSON data (with trailing null) or converts it to binary format and updates dataHash in the header
+     * - Calls parse() to parse it
+     */
+    virtual bool setData(const char *json);
+
+    /**
+     * @brief Saves the data, calls save()
+     */
+    virtual bool saveData() { return save(); };
+
+    /**
+     * @brief Saves only the header, for changes like lastCheck that don't modify the data
+     * 
+     * The default implementation calls save(). EEPROM and file storage override this to write only the header.
+     */
+    virtual bool saveHeader() { return save(); };
+
+    /**
+     * @brief Returns true if json is the same as the data that is already stored
+     * 
+     * @param json The new JSON data
+     * 
+     * The CRC-32 in the header is checked first, so this is fast when the data is different.
+     * For binary format data, only the CRC-32 of the original JSON data can be compared.
+     */
+    virtual bool isSameData(const char *json);
+
+    /**
+     * @brief Calculate a CRC-32 (IEEE 802.3, same as zlib)
+     * 
+     * @param data Pointer to the data
+     * 
+     * @param len Length of the data in bytes
+     * 
+     * @param crc Initial value, or the result of a previous call to calculate the CRC in parts
+     */
+    static uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
+
+    /**
+     * @brief Save the data in the storage subclass. Must be implemented in subclasses!
+     * 
+     * @return true on success or false on failure. 
+     */
+    virtual bool save() = 0;
+
+    /**
+     * @brief Gets the number of bytes written to persistent storage by the last save()
+     * 
+     * This is 0 for retained memory, and for EEPROM only includes the bytes that changed.
+     */
+    virtual size_t getLastSaveBytes() const { return lastSaveBytes; };
+
+    /**
+     * @brief Gets the size of the data buffer, not including the header
+     */
+    virtual size_t getMaxDataSize() const { return dataSize; };
+
+protected:
+    /**
+     * @brief Pointer to the header with data after it
+     */
+    CloudConfigDataHeader *header = 0;
+
+    /**
+     * @brief Number of bytes written by the last save(). Set by subclasses that write to persistent storage.
+     */
+    size_t lastSaveBytes = 0;
+
+    /**
+     * @brief Used by subclasses to check data loaded from persistent storage before calling validate()
+     * 
+     * @param count The number of bytes read into the header and data buffer, or -1 on error
+     * 
+     * Checks that at least the header and a null terminator were read, that the JSON data is null 
+     * terminated, and that the dataHash in the header matches the data. Data saved by version
+     * 0.0.2 and earlier doesn't have a dataHash, so the hash is not checked when it is 0.
+     * For binary format data, the CRC-32 in the binary data header is checked instead of the 
+     * dataHash, as well as that all of the binary data was read.
+     * The bytes after count must already be zero.
+     */
+    bool isValidLoadedData(int count) const;
+
+    /**
+     * @brief Size of the JSON data, not including sizeof(CloudConfigDataHeader)
+     */
+    size_t dataSize = 0;
+
+    /**
+     * @brief true to store data in binary format, set using withBinaryFormat()
+     */
+    bool binaryFormat = false;
+};
+
+
+/**
+ * @brief Decoder for base64 and compressed configuration data sent to update methods
+ * 
+ * Encoded data begins with a prefix, which can't be the start of JSON data:
+ * 
+ * - `b:` followed by the base64 encoded JSON data.
+ * - `z:` followed by the base64 encoded zlib (RFC 1950, deflate) compressed JSON data, as created
+ * by `zlib.compress()` in Python, `zlib.deflateSync()` in node.js, or `pako.deflate()`.
+ * 
+ * Both the standard and URL-safe base64 alphabets are accepted, with or without padding. The 
+ * base64 data is decoded as it's decompressed, so the compressed data is never copied.
+ */
+class CloudConfigPayload {
+public:
+    /**
+     * @brief Returns true if data begins with one of the prefixes for encoded data
+     */
+    static bool isEncoded(const char *data) { return (data[0] == 'b' || data[0] == 'z') && data[1] == ':'; };
+
+    /**
+     * @brief Decodes encoded data
+     * 
+     * @param data The encoded data, beginning with a prefix
+     * 
+     * @param maxSize The largest decoded size, including the null terminator
+     * 
+     * @return A null terminated buffer allocated using malloc, which the caller must free, or 
+     * NULL if the data is not valid, is too large, or the buffer could not be allocated.
+     */
+    static char *decode(const char *data, size_t maxSize = MAX_DECODED_SIZE);
+
+    /**
+     * @brief Default maximum size of decoded data, the largest data a CloudConfigDataHeader can describe
+     */
+    static const size_t MAX_DECODED_SIZE = 65535;
+
+protected:
+    /**
+     * @brief Huffman code table for inflate, in canonical order
+     */
+    struct Huffman {
+        /**
+         * @brief Number of codes of each length, 0 - 15
+         */
+        uint16_t counts[16];
+
+        /**
+         * @brief Symbols ordered by code
+         */
+        uint16_t symbols[288];
+    };
+
+    /**
+     * @brief Constructor, used by decode()
+     */
+    CloudConfigPayload(const char *src, size_t maxSize) : src(src), maxSize(maxSize) {};
+
+    /**
+     * @brief Returns the next base64 decoded byte, or -1 at the end of the data
+     */
+    int readByte();
+
+    /**
+     * @brief Returns the next numBits bits of deflate data, least significant bit first
+     */
+    uint32_t readBits(int numBits);
+
+    /**
+     * @brief Appends a byte to the output buffer, enlarging it if necessary
+     */
+    void put(uint8_t c);
+
+    /**
+     * @brief Decompresses zlib data to the output buffer
+     */
+    void inflate();
+
+    /**
+     * @brief Decompresses one block of Huffman coded data
+     */
+    void inflateBlock(const Huffman &lengthCodes, const Huffman &distanceCodes);
+
+    /**
+     * @brief Reads the code lengths of a dynamic Huffman block and builds the tables
+     */
+    void readDynamicCodes(Huffman &lengthCodes, Huffman &distanceCodes);
+
+    /**
+     * @brief Decodes one Huffman coded symbol
+     */
+    int decodeSymbol(const Huffman &codes);
+
+    /**
+     * @brief Builds a Huffman table from the code length of each symbol
+     * 
+     * @return 0 if the code is complete, a negative value if the lengths are over-subscribed (not 
+     * a valid code), or a positive value if it's incomplete (some bit sequences are not codes).
+     */
+    int buildHuffman(Huffman &codes, const uint8_t *lengths, size_t numSymbols);
+
+    /**
+     * @brief Returns true if the result from buildHuffman() is a valid literal/length or distance code
+     * 
+     * As in zlib, an incomplete code is only allowed if it has no codes or a single code of length 1.
+     */
+    static bool isValidHuffman(const Huffman &codes, int left);
+
+    /**
+     * @brief Remaining encoded data
+     */
+    const char *src;
+
+    /**
+     * @brief Largest output size including the null terminator
+     */
+    size_t maxSize;
+
+    /**
+     * @brief Base64 bits that have been decoded but not returned by readByte() yet
+     */
+    uint32_t base64Bits = 0;
+
+    /**
+     * @brief Number of bits in base64Bits
+     */
+    int base64Count = 0;
+
+    /**
+     * @brief Deflate bits that have been read but not returned by readBits() yet
+     */
+    uint32_t bitBuf = 0;
+
+    /**
+     * @brief Number of bits in bitBuf
+     */
+    int bitCount = 0;
+
+    /**
+     * @brief Output buffer allocated using malloc
+     */
+    char *out = 0;
+
+    /**
+     * @brief Number of bytes in out
+     */
+    size_t outLen = 0;
+
+    /**
+     * @brief Allocated size of out
+     */
+    size_t outSize = 0;
+
+    /**
+     * @brief true if the data is not valid, too large, or out of memory
+     */
+    bool error = false;
+};
+
+
+/**
+ * @brief Abstract base class for updating cloud config data
+ */
+class CloudConfigUpdate {
+public:
+    /**
+     * @brief Default constructor
+     */
+    CloudConfigUpdate() {};
+
+    /**
+     * @brief Called during setup() to allow update methods to have setup time 
+     * 
+     * Optional for subclasses to override.
+     */
+    virtual void setup() {};
+
+    /**
+     * @brief Called during loop() to allow update methods to have loop time 
+     * 
+     * Optional for subclasses to override.
+     */
+    virtual void loop() {};
+
+    /**
+     * @brief Called when subclasses should update the data from the cloud.
+     * 
+     * Optional for subclasses to override, but typically useful to do so. It is
+     * called after cloud connected and after waitAfterCloudConnectedMs depending
+     * on the settings for updateFrequency.
+     * 
+     * The subclass must call getCloudConfig().updateData() or 
+     * getCloudConfig().updateDataFailed() if this method is called.
+     */
+    virtual void startUpdate() {};
+
+    /**
+     * @brief Gets the CloudConfig object this update method was added to using withUpdateMethod()
+     * 
+     * This is CloudConfig::instance() unless the update method was added to a named instance.
+     * Subclasses use this, not CloudConfig::instance(), to pass data to CloudConfig.
+     */
+    CloudConfig &getCloudConfig() const;
+
+    /**
+     * @brief How long to wait after cloud connected to update settings.
+     */
+    unsigned long waitAfterCloudConnectedMs = 2000;
+
+    /**
+     * @brief If a response is not received in this amount of time, an error is assumed
+     * and another attempt will be made later.
+     * 
+     * If subclasses take a long time to retrieve data you may need to override this
+     * value from your subclass constructor or setup method.
+     */
+    unsigned long updateTimeoutMs = 60000;
+
+protected:
+    /**
+     * @brief Destructor. Base class destructor is empty. Also, you can't delete one of these.
+     */
+    virtual ~CloudConfigUpdate() {};
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigUpdate(const CloudConfigUpdate&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigUpdate& operator=(const CloudConfigUpdate&) = delete;
+
+    /**
+     * @brief The CloudConfig this was added to, set by CloudConfig::withUpdateMethod(), or NULL for CloudConfig::instance()
+     */
+    CloudConfig *cloudConfig = 0;
+
+    friend class CloudConfig;
+};
+
+/**
+ * @brief Abstract base class for a configuration field declared in advance
+ * 
+ * Fields are added to CloudConfig using withField(). After the data is loaded in setup() and
+ * after each updateData(), the JSON value for the key is decoded into a native value that
+ * can be read without any JSON parsing or conversion.
+ * 
+ * Use CloudConfigField<> for int, bool, double, and long values and CloudConfigFieldString<>
+ * for strings. Fields are typically allocated as global variables and can't be deleted once added.
+ */
+class CloudConfigFieldBase {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param key The top-level JSON key for this field. This pointer is saved, so it's typically a string constant.
+     */
+    CloudConfigFieldBase(const char *key) : key(key) {};
+
+    /**
+     * @brief Gets the key passed to the constructor
+     */
+    const char *getKey() const { return key; };
+
+    /**
+     * @brief Decode the value from the JSON data. Implemented in subclasses.
+     * 
+     * @param storage The storage method to get the value for the key from. If the key does
+     * not exist, the default value should be used.
+     */
+    virtual void decode(CloudConfigStorage &storage) = 0;
+
+    /**
+     * @brief Checks the value for this field in new data. Implemented in subclasses.
+     * 
+     * @param jsonValue The value for the key in the new data, or an invalid JSONValue if the key does not exist.
+     * 
+     * @return true if the value can be decoded, is in range, and the key exists if it's required.
+     * 
+     * Only used when CloudConfig::withSchemaValidation() is enabled.
+     */
+    virtual bool validate(const JSONValue &jsonValue) const = 0;
+
+    /**
+     * @brief Requires the key to be in the data when CloudConfig::withSchemaValidation() is enabled
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     */
+    CloudConfigFieldBase &withRequired() { required = true; return *this; };
+
+protected:
+    /**
+     * @brief Destructor. Fields are never deleted once added.
+     */
+    virtual ~CloudConfigFieldBase() {};
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigFieldBase(const CloudConfigFieldBase&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigFieldBase& operator=(const CloudConfigFieldBase&) = delete;
+
+    /**
+     * @brief Gets an int value from storage (CloudConfigStorage::getInt)
+     */
+    static void getValue(CloudConfigStorage &storage, const char *key, int &result) { result = storage.getInt(key); };
+
+    /**
+     * @brief Gets a long value from storage (CloudConfigStorage::getInt)
+     */
+    static void getValue(CloudConfigStorage &storage, const char *key, long &result) { result = storage.getInt(key); };
+
+    /**
+     * @brief Gets a bool value from storage (CloudConfigStorage::getBool)
+     */
+    static void getValue(CloudConfigStorage &storage, const char *key, bool &result) { result = storage.getBool(key); };
+
+    /**
+     * @brief Gets a double value from storage (CloudConfigStorage::getDouble)
+     */
+    static void getValue(CloudConfigStorage &storage, const char *key, double &result) { result = storage.getDouble(key); };
+
+    /**
+     * @brief Checks and converts an int value. Numbers without a fraction and strings containing one are valid.
+     * 
+     * Values outside of the range of int, such as "99999999999", are not valid.
+     */
+    static bool getValidValue(const JSONValue &jsonValue, int &result);
+
+    /**
+     * @brief Checks and converts a long value. Numbers without a fraction and strings containing one are valid.
+     * 
+     * The value is limited to the range of int, not long, because CloudConfigField<long> reads it using
+     * CloudConfigStorage::getInt(). Larger values are not valid rather than being truncated.
+     */
+    static bool getValidValue(const JSONValue &jsonValue, long &result) { int temp; bool valid = getValidValue(jsonValue, temp); if (valid) { result = temp; } return valid; };
+
+    /**
+     * @brief Checks and converts a bool value. true, false, "true" and "false" are valid.
+     */
+    static bool getValidValue(const JSONValue &jsonValue, bool &result);
+
+    /**
+     * @brief Checks and converts a double value. Numbers and strings containing a number are valid.
+     */
+    static bool getValidValue(const JSONValue &jsonValue, double &result);
+
+    /**
+     * @brief The key passed to the constructor
+     */
+    const char *key;
+
+    /**
+     * @brief Next field in the list of fields in CloudConfig
+     */
+    CloudConfigFieldBase *next = 0;
+
+    /**
+     * @brief true if withRequired() was called
+     */
+    bool required = false;
+
+    friend class CloudConfig;
+};
+
+/**
+ * @brief A configuration field with a native type
+ * 
+ * @param T The type: int, long, bool, or double
+ * 
+ * For example:
+ * 
+ * ```
+ * CloudConfigField<int> fieldA("a", 10);
+ * ```
+ * 
+ * Then add it using CloudConfig::instance().withField(fieldA) before setup(). Reading the
+ * value using fieldA.get() or just fieldA is just a member load.
+ */
+template<class T>
+class CloudConfigField : public CloudConfigFieldBase {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param key The top-level JSON key for this field. This pointer is saved, so it's typically a string constant.
+     * 
+     * @param defaultValue The value to use when there is no configuration or the key does not exist.
+     */
+    CloudConfigField(const char *key, T defaultValue = T()) : CloudConfigFieldBase(key), value(defaultValue), defaultValue(defaultValue) {};
+
+    /**
+     * @brief Gets the decoded value
+     */
+    T get() const { return value; };
+
+    /**
+     * @brief Gets the decoded value
+     */
+    operator T() const { return value; };
+
+    /**
+     * @brief Decodes the value from JSON. Called from CloudConfig.
+     */
+    virtual void decode(CloudConfigStorage &storage) {
+        if (storage.hasKey(key)) {
+            getValue(storage, key, value);
+        }
+        else {
+            value = defaultValue;
+        }
+    }
+
+    /**
+     * @brief Checks the type and range of the value in new data. Called from CloudConfig.
+     */
+    virtual bool validate(const JSONValue &jsonValue) const {
+        if (!jsonValue.isValid()) {
+            return !required;
+        }
+        T temp;
+        if (!getValidValue(jsonValue, temp)) {
+            return false;
+        }
+        return !hasRange || (temp >= minValue && temp <= maxValue);
+    }
+
+    /**
+     * @brief Sets the range of valid values when CloudConfig::withSchemaValidation() is enabled
+     * 
+     * @param minValue The minimum value (inclusive)
+     * 
+     * @param maxValue The maximum value (inclusive)
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * Not used for bool fields.
+     */
+    CloudConfigField<T> &withRange(T minValue, T maxValue) { this->minValue = minValue; this->maxValue = maxValue; hasRange = true; return *this; };
+
+protected:
+    /**
+     * @brief The decoded value
+     */
+    T value;
+
+    /**
+     * @brief The default value passed to the constructor
+     */
+    T defaultValue;
+
+    /**
+     * @brief true if withRange() was called
+     */
+    bool hasRange = false;
+
+    /**
+     * @brief Minimum value, set using withRange()
+     */
+    T minValue = T();
+
+    /**
+     * @brief Maximum value, set using withRange()
+     */
+    T maxValue = T();
+};
+
+/**
+ * @brief A configuration field containing a string copied into a fixed size buffer
+ * 
+ * @param SIZE The size of the buffer in bytes. The maximum string length is SIZE - 1 and longer
+ * values are truncated.
+ * 
+ * The value is copied when decoded, so the pointer returned by get() remains valid and the
+ * contents are only changed when the configuration is updated.
+ */
+template<size_t SIZE>
+class CloudConfigFieldString : public CloudConfigFieldBase {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param key The top-level JSON key for this field. This pointer is saved, so it's typically a string constant.
+     * 
+     * @param defaultValue The value to use when there is no configuration or the key does not exist. Saved as a pointer.
+     */
+    CloudConfigFieldString(const char *key, const char *defaultValue = "") : CloudConfigFieldBase(key), defaultValue(defaultValue) { 
+        setValue(defaultValue);
+    };
+
+    /**
+     * @brief Gets the decoded value as a c-string
+     */
+    const char *get() const { return value; };
+
+    /**
+     * @brief Gets the decoded value as a c-string
+     */
+    operator const char *() const { return value; };
+
+    /**
+     * @brief Decodes the value from JSON. Called from CloudConfig.
+     */
+    virtual void decode(CloudConfigStorage &storage) {
+        if (!storage.copyString(key, value, SIZE)) {
+            setValue(defaultValue);
+        }
+    }
+
+    /**
+     * @brief Checks the value in new data. Called from CloudConfig.
+     * 
+     * Strings, numbers, and booleans are valid if they fit in SIZE - 1 characters without truncation.
+     */
+    virtual bool validate(const JSONValue &jsonValue) const {
+        if (!jsonValue.isValid()) {
+            return !required;
+        }
+        if (!jsonValue.isString() && !jsonValue.isNumber() && !jsonValue.isBool()) {
+            return false;
+        }
+        return strlen(jsonValue.toString().data()) < SIZE;
+    }
+
+protected:
+    /**
+     * @brief Copy a string into value, truncating if necessary
+     */
+    void setValue(const char *str) {
+        strncpy(value, str, SIZE - 1);
+        value[SIZE - 1] = 0;
+    }
+
+    /**
+     * @brief The decoded value (always null terminated)
+     */
+    char value[SIZE];
+
+    /**
+     * @brief The default value passed to the constructor
+     */
+    const char *defaultValue;
+};
+
+/**
+ * @brief Read-only copy of the configuration data, used for thread-safe reads
+ * 
+ * CloudConfig keeps two of these when CloudConfig::withThreadSafeReads() is used. You normally
+ * access them with a CloudConfigSnapshot object, not directly.
+ */
+class CloudConfigStorageCopy : public CloudConfigStorage {
+public:
+    /**
+     * @brief Constructor. The copy is empty until copyFrom() is called.
+     */
+    CloudConfigStorageCopy() {};
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~CloudConfigStorageCopy();
+
+    /**
+     * @brief Copies the data from another storage method as JSON and parses it
+     * 
+     * @param source The storage method to copy from
+     * 
+     * @return true on success, false if the buffer could not be allocated
+     * 
+     * The buffer is only reallocated if the data is larger than any previous data. The string pool
+     * is built here, before the copy is published, so getString() does not modify the copy.
+     */
+    bool copyFrom(CloudConfigStorage &source);
+
+    /**
+     * @brief Nothing to do, the data is set by copyFrom()
+     */
+    virtual void setup() {};
+
+    /**
+     * @brief Gets a const pointer to the JSON data
+     */
+    virtual const char * const getJsonData() const { return buf ? buf : ""; };
+
+    /**
+     * @brief Snapshot generation of this copy, set by CloudConfig when it is published
+     */
+    uint32_t generation = 0;
+
+protected:
+    /**
+     * @brief Buffer containing the JSON data, allocated on the heap
+     */
+    char *buf = 0;
+
+    /**
+     * @brief Size of buf in bytes
+     */
+    size_t bufSize = 0;
+};
+
+/**
+ * @brief Counters for monitoring updates, enabled using CloudConfig::withMetrics()
+ */
+struct CloudConfigMetrics {
+    /**
+     * @brief Milliseconds from startUpdate() to receiving the data, for the last update that succeeded
+     */
+    unsigned long fetchMs = 0;
+
+    /**
+     * @brief Largest value of fetchMs since restart
+     */
+    unsigned long maxFetchMs = 0;
+
+    /**
+     * @brief Microseconds to set and parse the data, for the last data that changed
+     */
+    unsigned long parseUs = 0;
+
+    /**
+     * @brief Largest value of parseUs since restart
+     */
+    unsigned long maxParseUs = 0;
+
+    /**
+     * @brief Total number of bytes written to persistent storage since restart
+     */
+    uint32_t bytesSaved = 0;
+
+    /**
+     * @brief Number of CloudConfig getter calls since restart
+     */
+    uint32_t lookups = 0;
+
+    /**
+     * @brief Number of CloudConfig getter calls in the last second
+     */
+    uint32_t lookupsPerSec = 0;
+
+    /**
+     * @brief Number of requested updates that succeeded, including not modified responses
+     */
+    uint32_t successCount = 0;
+
+    /**
+     * @brief Number of requested updates where the update method called updateDataFailed()
+     */
+    uint32_t failureCount = 0;
+
+    /**
+     * @brief Number of requested updates that timed out
+     */
+    uint32_t timeoutCount = 0;
+};
+
+/**
+ * @brief Keys that changed in an update, passed to the callback set using CloudConfig::withDataChangeCallback()
+ * 
+ * Keys that were added or changed are in the order they appear in the new data, followed by 
+ * keys that were removed. When nested changes are enabled, changes inside an object that is in 
+ * both the old and new data are reported as a path like "a.b" instead of the top-level key "a".
+ */
+class CloudConfigChanges {
+public:
+    /**
+     * @brief How a key changed
+     */
+    enum class Change : uint8_t {
+        ADDED = 1,      //!< Key is in the new data but not the old data
+        REMOVED,        //!< Key is in the old data but not the new data
+        CHANGED         //!< Key is in both, with a different value
+    };
+
+    /**
+     * @brief Default constructor
+     */
+    CloudConfigChanges() {};
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~CloudConfigChanges();
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigChanges(const CloudConfigChanges&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigChanges& operator=(const CloudConfigChanges&) = delete;
+
+    /**
+     * @brief Gets the number of keys that changed
+     */
+    size_t getCount() const { return count; };
+
+    /**
+     * @brief Gets a key that changed
+     * 
+     * @param index 0 <= index < getCount()
+     * 
+     * @return The key, or for nested changes, the path with keys separated by periods. 
+     */
+    const char *getKey(size_t index) const { return &buf[getOffset(index) + 1]; };
+
+    /**
+     * @brief Gets how a key changed
+     * 
+     * @param index 0 <= index < getCount()
+     */
+    Change getChange(size_t index) const { return (Change) buf[getOffset(index)]; };
+
+    /**
+     * @brief Returns true if key was added, removed, or changed
+     * 
+     * @param key A top-level key, or a path like "a.b". A path is changed if it or an enclosing
+     * object changed, and a key is changed if anything in it changed.
+     * 
+     * Always returns true if isComplete() is false.
+     */
+    bool isChanged(const char *key) const;
+
+    /**
+     * @brief Returns false if the changes could not be determined
+     * 
+     * This happens if there is not enough memory to compare the data, or the data is not valid JSON.
+     * isChanged() returns true for every key in this case.
+     */
+    bool isComplete() const { return complete; };
+
+    /**
+     * @brief Finds the keys that are different between two JSON objects
+     * 
+     * @param oldJson The previous data. Can be an empty string if there was no data, or NULL if it is not known.
+     * 
+     * @param newJson The new data
+     * 
+     * @param nested true to report changes inside of objects, false to only report top-level keys
+     * 
+     * @return true if successful. If false, isComplete() is false.
+     * 
+     * Values are compared by their JSON text, except that objects are compared by their keys 
+     * regardless of order. If either is not an object, it's treated as an empty object.
+     */
+    bool compare(const char *oldJson, const char *newJson, bool nested);
+
+    /**
+     * @brief Removes all of the changes
+     */
+    void clear() { bufLen = 0; count = 0; complete = true; };
+
+    /**
+     * @brief Maximum length of the path of a nested object, the same as CloudConfigPath
+     * 
+     * Changes in objects with a longer path are reported as a change to the object.
+     */
+    static const size_t MAX_PATH_LEN = CloudConfigPath::MAX_PATH_LEN;
+
+protected:
+
+    /**
+     * @brief Gets the offset in buf of the change byte for an index
+     */
+    size_t getOffset(size_t index) const;
+
+    /**
+     * @brief Buffer of the changes, each a Change byte followed by the null terminated key. Allocated using realloc.
+     */
+    char *buf = 0;
+
+    /**
+     * @brief Allocated size of buf in bytes
+     */
+    size_t bufSize = 0;
+
+    /**
+     * @brief Number of bytes used in buf
+     */
+    size_t bufLen = 0;
+
+    /**
+     * @brief Number of changes in buf
+     */
+    size_t count = 0;
+
+    /**
+     * @brief false if the changes could not be determined
+     */
+    bool complete = true;
+};
+
+/**
+ * @brief Singleton class for managing cloud-based configuration
+ * 
+ */
+class CloudConfig {
+public:
+    /**
+     * @brief Magic bytes used to detect if EEPROM or retained memory has been initialized
+     */
+    static const uint32_t DATA_MAGIC = 0x7251dd53;
+
+    /**
+     * @brief Bit in CloudConfigDataHeader flags indicating the data is in binary format
+     * 
+     * See CloudConfigStorageData::withBinaryFormat().
+     */
+    static const uint8_t FLAG_BINARY = 0x01;
+
+    /**
+     * @brief Value used for updateFrequency to only request configuration data if it has never been saved
+     */
+    static const long UPDATE_ONCE = 0;
+
+    /**
+     * @brief Value used for updateFrequency to request configuration data on every restart
+     * 
+     * Note that this also means after every HIBERNATE sleep wake!
+     */
+    static const long UPDATE_AT_RESTART = -1;
+
+    /**
+     * @brief Enumeration used for the status of updateData
+     */
+    enum class UpdateDataStatus {
+        /**
+         * @brief updateData is not in progress
+         */
+        IDLE,
+
+        /**
+         * @brief updateData is in progress (startData called, but updateData or updateDataFailed not called yet, and not at timeout)
+         */
+        IN_PROGRESS,
+
+        /**
+         * @brief After startData(), updateData() was called so the data was successfully retrieved.
+         */
+        SUCCESS,
+
+        /**
+         * @brief After startData(), updateDataFailed() was called so the data was not retrieved.
+         */
+        FAILURE,
+
+        /**
+         * @brief After startData(), neither updateData() nor updateDataFailed() were called by the timeout value
+         */
+        TIMEOUT
+    };
+
+    /**
+     * @brief States of the main state machine, run from loop()
+     * 
+     * The values are indexes into stateHandlers.
+     */
+    enum class State {
+        START = 0,                      //!< stateStart()
+        WAIT_CLOUD_CONNECTED,           //!< stateWaitCloudConnected()
+        WAIT_AFTER_CLOUD_CONNECTED,     //!< stateWaitAfterCloudConnected()
+        WAIT_TO_UPDATE,                 //!< stateWaitToUpdate()
+        START_UPDATE,                   //!< stateStartUpdate()
+        WAIT_UPDATE_COMPLETE,           //!< stateWaitUpdateComplete()
+        STOPPED                         //!< State machine not running (no update method, or before setup())
+    };
+
+    /**
+     * @brief Enumeration used for the step of a staged commit, see withStagedCommit()
+     */
+    enum class CommitStage {
+        /**
+         * @brief No commit in progress. If there is pending data, it's copied to the storage method and parsed.
+         */
+        IDLE,
+
+        /**
+         * @brief The data has been parsed and needs to be saved
+         */
+        SAVE,
+
+        /**
+         * @brief The data has been saved and the data callback needs to be called
+         */
+        NOTIFY
+    };
+
+    /**
+     * @brief Get the singleton instance of this class
+     * 
+     * You always use CloudConfig::instance() to get a reference to the singleton instance of this
+     * class. You cannot construct one of these as a global or on the stack. The singleton instance
+     * will never be deleted.
+     */
+    static CloudConfig &instance();
+
+    /**
+     * @brief Get a named instance of this class, creating it if necessary
+     * 
+     * @param name The name of the instance. Must be a string constant; the pointer is saved.
+     * 
+     * Each named instance is independent of the others and of CloudConfig::instance(), with its 
+     * own storage method, update method, update frequency, fields, and data callback. This allows
+     * data that changes frequently to be updated without rewriting and parsing data that 
+     * rarely changes. You must call setup() and loop() for each instance. Named instances are 
+     * never deleted.
+     * 
+     * CloudConfigDispatcher can route events to named instances using a single subscription.
+     */
+    static CloudConfig &instance(const char *name);
+
+    /**
+     * @brief Finds an instance by name without creating it
+     * 
+     * @param name The name passed to instance(name), or "" for CloudConfig::instance()
+     * 
+     * @return The instance, or NULL if there is no instance with that name
+     */
+    static CloudConfig *findInstance(const char *name);
+
+    /**
+     * @brief Gets the name of this instance, or "" for CloudConfig::instance()
+     */
+    const char *getName() const { return name; };
+
+
+    /**
+     * @brief Sets the storage method class, required before setup() is called.
+     * 
+     * @param storageMethod The CloudConfigStorage subclass instance to use to store and retrieve the data
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * There can only be one storage method, and once set, cannot be changed or removed. 
+     * 
+     */
+    CloudConfig &withStorageMethod(CloudConfigStorage *storageMethod) { this->storageMethod = storageMethod; return *this; };
+
+    /**
+     * @brief Sets the update method class, not required, but if used, call before setup() is called.
+     * 
+     * @param updateMethod The CloudConfigUpdate subclass instance to use to get data from the cloud
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * There can only be one update method, and once set, cannot be changed or removed. 
+     */
+    CloudConfig &withUpdateMethod(CloudConfigUpdate *updateMethod) { 
+        this->updateMethod = updateMethod; 
+        if (updateMethod) {
+            updateMethod->cloudConfig = this;
+        }
+        return *this; 
+    };
+
+
+    /**
+     * @brief Sets the update frequency in seconds
+     * 
+     * @param updateFrequency update frequency in seconds
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * See also the overload that takes a chrono literal, as well as withUpdateFrequencyOnce() and withUpdateFrequencyAtRestart().
+     * 
+     * Can be called after setup to change the update frequency.
+     */
+    CloudConfig &withUpdateFrequency(long updateFrequency) { this->updateFrequency = updateFrequency; wakeMs = millis(); return *this; };
+
+    /**
+     * @brief Sets the update frequency as a chrono literal
+     * 
+     * @param chronoLiteral update frequency as a chrono literal. For example: 15min (15 minutes) or 24h (24 hours).
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * See also withUpdateFrequencyOnce() and withUpdateFrequencyAtRestart().
+     * 
+     * Can be called after setup to change the update frequency.
+     */
+    CloudConfig &withUpdateFrequency(std::chrono::seconds chronoLiteral) { return withUpdateFrequency((long)chronoLiteral.count()); };
+
+    /**
+     * @brief Sets the update frequency only if there is no saved value. 
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * If there is no saved value, then the update occurs after connecting to the cloud.
+     * 
+     * Should be done before setup() to make sure it takes effect in time.
+     */
+    CloudConfig &withUpdateFrequencyOnce() { this->updateFrequency = UPDATE_ONCE; return *this; };
+
+    /**
+     * @brief Sets the update frequency to update once after cloud connecting after restart.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * This is anything that calls setup() so includes device reset and wake from HIBERNATE sleep mode.
+     * 
+     * Should be done before setup() to make sure it takes effect in time.
+     */
+    CloudConfig &withUpdateFrequencyAtRestart() { this->updateFrequency = UPDATE_AT_RESTART; return *this; };
+
+    /**
+     * @brief Spreads out updates from a fleet of devices by a per-device delay
+     * 
+     * @param maxJitterSec Maximum delay in seconds. 0 (the default) disables jitter.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * Each device gets a fixed delay from 0 to maxJitterSec, derived from its device ID, so it 
+     * does not change across restarts. After connecting to the cloud, the device waits this much 
+     * longer before checking whether an update is needed, and periodic updates are done this much
+     * later than updateFrequency. This keeps many devices that reconnect at the same time from all
+     * requesting data at once.
+     */
+    CloudConfig &withUpdateJitter(long maxJitterSec);
+
+    /**
+     * @brief Spreads out updates from a fleet of devices by a per-device delay, as a chrono literal
+     * 
+     * @param maxJitter Maximum delay as a chrono literal, for example 5min.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     */
+    CloudConfig &withUpdateJitter(std::chrono::seconds maxJitter) { return withUpdateJitter((long)maxJitter.count()); };
+
+    /**
+     * @brief Retry failed updates with exponential backoff
+     * 
+     * @param initialSec Time in seconds to wait after the first failure or timeout before retrying. 0 
+     * (the default) disables retries, so the next attempt is after updateFrequency, as before.
+     * 
+     * @param maxSec Maximum time in seconds between retries. The wait doubles after each consecutive
+     * failure until it reaches this value.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * A successful update resets the wait. The per-device jitter from withUpdateJitter() is added to
+     * the wait as well. Retries are also done when the update frequency is UPDATE_ONCE.
+     */
+    CloudConfig &withUpdateBackoff(long initialSec, long maxSec) { backoffInitialSec = initialSec; backoffMaxSec = maxSec; return *this; };
+
+    /**
+     * @brief Retry failed updates with exponential backoff, as chrono literals
+     * 
+     * @param initial Time to wait after the first failure, for example 1min.
+     * 
+     * @param max Maximum time between retries, for example 1h.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     */
+    CloudConfig &withUpdateBackoff(std::chrono::seconds initial, std::chrono::seconds max) { return withUpdateBackoff((long)initial.count(), (long)max.count()); };
+
+    /**
+     * @brief Gets the per-device delay in seconds set by withUpdateJitter()
+     */
+    long getUpdateJitter() const { return updateJitterSec; };
+
+    /**
+     * @brief Adds a callback to be called after data is loaded or updated
+     * 
+     * @param dataCallback the callback function to call
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * Must be called before setup().
+     * 
+     * The method should have this prototype:
+     *  
+     *   void callback(void);
+     * 
+     * The callback can also be a C++11 lambda, which you can use to call a C++ member function, if desired.
+     */
+    CloudConfig &withDataCallback(std::function<void(void)> dataCallback) { this->dataCallback = dataCallback; return *this; };
+
+    /**
+     * @brief Adds a callback to be called with the keys that changed after data is loaded or updated
+     * 
+     * @param dataChangeCallback Function or lambda, passed the keys that changed. 
+     * 
+     * @param nested true to report changes inside of objects as paths like "a.b", false (the default)
+     * to only report top-level keys.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * Must be called before setup(). This is called at the same times as the callback set using 
+     * withDataCallback(), after it. When data is loaded at startup all of the keys are reported as added.
+     * 
+     * The new data is compared with the old data before it's replaced, which requires a copy of each
+     * on the heap while comparing.
+     */
+    CloudConfig &withDataChangeCallback(std::function<void(const CloudConfigChanges &)> dataChangeCallback, bool nested = false) { this->dataChangeCallback = dataChangeCallback; changesNested = nested; return *this; };
+
+    /**
+     * @brief Gets the keys that changed in the last update
+     * 
+     * Only updated if withDataChangeCallback() is used.
+     */
+    const CloudConfigChanges &getChanges() const { return changes; };
+
+    /**
+     * @brief Enables the counters in CloudConfigMetrics
+     * 
+     * @param variableName If not NULL, a Particle.variable of this name is registered during
+     * setup() that returns getMetricsJson(). Must be a string constant; the pointer is saved.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * Must be called before setup(). Keeping the counters up to date only takes a few
+     * additions per update and one per getter call.
+     */
+    CloudConfig &withMetrics(const char *variableName = NULL) { metricsEnabled = true; metricsVariableName = variableName; return *this; };
+
+    /**
+     * @brief Sets a function to call when a requested update completes, successfully or not
+     * 
+     * @param metricsCallback Function or lambda, passed the updated metrics. Only called if withMetrics() is used.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     */
+    CloudConfig &withMetricsCallback(std::function<void(const CloudConfigMetrics &)> metricsCallback) { this->metricsCallback = metricsCallback; return *this; };
+
+    /**
+     * @brief Gets the counters. All are 0 unless withMetrics() is used.
+     */
+    const CloudConfigMetrics &getMetrics() const { return metrics; };
+
+    /**
+     * @brief Gets the counters as compact JSON, also used for the Particle.variable
+     * 
+     * For example: {"fetchMs":850,"maxFetchMs":1200,"parseUs":320,"maxParseUs":410,"saved":96,"lookupsSec":12,"success":5,"failure":0,"timeout":1}
+     */
+    String getMetricsJson() const;
+
+    /**
+     * @brief Adds a field that is decoded from the configuration data in advance
+     * 
+     * @param field The field, typically a CloudConfigField<> or CloudConfigFieldString<> global variable.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * Must be called before setup(). The field object must remain allocated and cannot be removed.
+     * 
+     * All fields are decoded in setup() after the data is loaded, and again after each updateData() 
+     * before the dataCallback is called. Reading a field is just a member load, with no JSON lookup
+     * or conversion.
+     */
+    CloudConfig &withField(CloudConfigFieldBase &field) { field.next = fields; fields = &field; return *this; };
+
+    /**
+     * @brief Checks new data against the fields added using withField() before storing it
+     * 
+     * @param value true to enable validation. Default: true.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * When enabled, updateData() rejects data that is not a JSON object, has a value for a
+     * field that is the wrong type or out of range (withRange()), or is missing a required 
+     * field (withRequired()). Rejected data is not saved and the update fails as if the update
+     * method called updateDataFailed(), so the previous data and field values are kept. Keys
+     * that are not fields are not checked.
+     * 
+     * With CloudConfigStorageLayered, only the overrides sent in the update are checked.
+     */
+    CloudConfig &withSchemaValidation(bool value = true) { schemaValidation = value; return *this; };
+
+    /**
+     * @brief Keeps a read-only copy of the data so other threads can read it using CloudConfigSnapshot
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * Must be called before setup(). Two copies of the data are kept on the heap. When the data is 
+     * updated, the new data is copied into the copy that is not being read and the two are swapped 
+     * atomically. Readers never block the update, and each reader sees a consistent copy of the data 
+     * for as long as it holds the CloudConfigSnapshot object.
+     * 
+     * If a reader still holds the older copy when the next update arrives, publishing the new copy
+     * is deferred to loop(). The CloudConfig getters such as getInt() still read the storage method 
+     * directly, and should only be used from the thread that calls loop().
+     */
+    CloudConfig &withThreadSafeReads();
+
+    /**
+     * @brief Commit updated data from loop() in steps instead of from updateData()
+     * 
+     * @param timeBudgetMs Maximum time in milliseconds to spend committing data on each call to loop().
+     * The default of 0 does one step per call to loop().
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     * 
+     * Normally updateData() copies, parses, and saves the data, then calls the data callback, in 
+     * whatever context the update method received it. With a staged commit, updateData() only makes 
+     * a copy of the data. Parsing, saving, and calling the data callback are done as separate steps 
+     * from loop(). Another step is started in the same call to loop() if less than timeBudgetMs has
+     * elapsed. If more data arrives before the previous data is parsed, only the newer data is used.
+     */
+    CloudConfig &withStagedCommit(unsigned long timeBudgetMs = 0) { stagedCommit = true; commitTimeBudgetMs = timeBudgetMs; return *this; };
+
+    /**
+     * @brief Commit updated data from loop() in steps instead of from updateData()
+     * 
+     * @param timeBudget Maximum time to spend committing data on each call to loop() as a chrono literal, such as 5ms.
+     * 
+     * @return Returns *this so you can chain together the withXXX() methods, fluent-style.
+     */
+    CloudConfig &withStagedCommit(std::chrono::milliseconds timeBudget) { return withStagedCommit((unsigned long)timeBudget.count()); };
+
+    /**
+     * @brief Returns true if there is data received by updateData() that has not been parsed, saved, and notified yet
+     * 
+     * Always false unless withStagedCommit() is used.
+     */
+    bool isCommitPending() const { return pendingData.load() != 0 || commitStage != CommitStage::IDLE; };
+
+    /**
+     * @brief You must call setup() from your app's global setup after configuring it using the withXXX() methods
+     */
+    void setup();
+
+    /**
+     * @brief You must call this from loop on every call to loop()
+     */
+    void loop();
+
+    //
+    // Convenience wrappers to access storage values
+    // 
+
+    /**
+     * @brief Gets the top level (outer) JSONValue object. 
+     * 
+     * This is typically an object, but could be an array.
+     */
+    JSONValue getJSONValue() { return storageMethod->getJSONValue(); };
+
+    /**
+     * @brief Gets the value for a given key in the top-level outer JSON object
+     * 
+     * @param key The name of the key-value pair
+     * 
+     * @return A JSONValue object for that key. If the key does not exist in that object, an
+     * empty JSONValue object that returns false for isValid() is returned.
+     * 
+     * The getInt(), getBool(), getString() are convenience methods for
+     * getJSONValueForKey(key).toInt(), etc.
+     */
+    JSONValue getJSONValueForKey(const char *key) { return storageMethod->getJSONValueForKey(key); };
+
+    /**
+     * @brief Gets the value for a given key in the a JSON object 
+     * 
+     * @param parentObj A JSONValue for a JSON object to look in
+     * 
+     * @param key The name of the key-value pair
+     * 
+     * @return A JSONValue object for that key. If the key does not exist in that object, an
+     * empty JSONValue object that returns false for isValid() is returned.
+     */
+    JSONValue getJSONValueForKey(JSONValue parentObj, const char *key) { return storageMethod->getJSONValueForKey(parentObj, key); };
+
+    /**
+     * @brief Gets the value for a given index in the a JSON array in the top-level outer JSON array
+     * 
+     * @param index 0 = first entry, 1 = second entry, ...
+     * 
+     * @return A JSONValue object for that key. If the key does not exist in that object, an
+     * empty JSONValue object that returns false for isValid() is returned.
+     * 
+     * This method is not commonly used because the top-level object is usually a JSON object
+     * (surrounded by { }) not a JSON array (surrounded by [ ]).
+     * 
+     * There is no call to determine the length of the array; iterate until an invalid object
+     * is returned.
+     */
+    JSONValue getJSONValueAtIndex(size_t index) { return storageMethod->getJSONValueAtIndex(index); };
+
+    /**
+     * @brief Gets the value for a given index in the a JSON array
+     * 
+     * @param parentObj A JSONValue for a JSON array to look in
+     * 
+     * @param index 0 = first entry, 1 = second entry, ...
      * 
      * @return A JSONValue object for that key. If the key does not exist in that object, an
      * empty JSONValue object that returns false for isValid() is returned.
      * 
-     * The getInt(), getBool(), getString() are convenience methods for
-     * getJSONValueForKey(key).toInt(), etc.
+     * There is no call to determine the length of the array; iterate until an invalid object
+     * is returned.
+     */
+    JSONValue getJSONValueAtIndex(JSONValue parentObj, size_t index) { return storageMethod->getJSONValueAtIndex(parentObj, index); };
+
+    /**
+     * @brief Gets the value at a path, like "f.f1" or "e[2]"
+     * 
+     * @param path The path, see CloudConfigPath. The resolved value is cached in path until the
+     * data is updated.
+     * 
+     * @return A JSONValue object for the value. If it does not exist, an empty JSONValue object 
+     * that returns false for isValid() is returned.
+     */
+    JSONValue getJSONValueAtPath(CloudConfigPath &path) { return storageMethod->getJSONValueAtPath(path); };
+
+    /**
+     * @brief Gets the value at a path as a c-string, like "f.f1" or "e[2]"
+     */
+    JSONValue getJSONValueAtPath(const char *path) { return storageMethod->getJSONValueAtPath(path); };
+
+    /**
+     * @brief Convenience method for getting an integer value at a path. If it does not exist, 0 is returned.
+     */
+    int getInt(CloudConfigPath &path) { countLookup(); return storageMethod->getInt(path); };
+
+    /**
+     * @brief Convenience method for getting a boolean value at a path. If it does not exist, false is returned.
+     */
+    bool getBool(CloudConfigPath &path) { countLookup(); return storageMethod->getBool(path); };
+
+    /**
+     * @brief Convenience method for getting a double value at a path. If it does not exist, 0 is returned.
+     */
+    double getDouble(CloudConfigPath &path) { countLookup(); return storageMethod->getDouble(path); };
+
+    /**
+     * @brief Convenience method for copying a string value at a path into a buffer
+     */
+    bool copyString(CloudConfigPath &path, char *buf, size_t bufSize) { countLookup(); return storageMethod->copyString(path, buf, bufSize); };
+
+    /**
+     * @brief Convenience method for getting a top level JSON integer value by its key name
+     * 
+     * @param key The JSON key to retrieve
+     * 
+     * If the key does not exist, 0 is returned.
+     */
+    int getInt(const char *key) { countLookup(); return storageMethod->getInt(key); };
+
+    /**
+     * @brief Convenience method for getting a top level JSON integer value by its key name
+     * 
+     * @param key The JSON key to retrieve
+     * 
+     * If the key does not exist, false is returned.
+     */
+    bool getBool(const char *key) { countLookup(); return storageMethod->getBool(key); };
+
+    /**
+     * @brief Convenience method for getting a top level JSON integer value by its key name
+     * 
+     * @param key The JSON key to retrieve
+     * 
+     * If the key does not exist, 0 is returned.
+     */
+    double getDouble(const char *key) { countLookup(); return storageMethod->getDouble(key); };
+
+    /**
+     * @brief Convenience method for getting a top level JSON string value by its key name
+     * 
+     * @param key The JSON key to retrieve
+     * 
+     * If the key does not exist, an empty string is returned. The pointer remains valid until
+     * the next time the data is updated, so it's safe to keep until the next data callback.
+     */
+    const char *getString(const char *key) { countLookup(); return storageMethod->getString(key); };
+
+    /**
+     * @brief Update methods call this when they have JSON configuration data
+     * 
+     * The maximum size of the data is dependent on the storage method and how it was configured. 
+     * 
+     * @return false if the data failed schema validation or could not be stored, for example if it
+     * is too large. The current data is kept, updateDataFailed() is called, and the data callback is 
+     * not called. With withStagedCommit(), data that can't be stored is only detected during loop(),
+     * so this returns true and the update fails from there.
+     */
+    virtual bool updateData(const char *json);
+
+    /**
+     * @brief Update methods call this if they tried but failed to get configuration data
+     * 
+     * If you don't call updateData() or updateDataFailed() from the update method, then eventually it will
+     * time out, which will be treated as a failure.
+     */
+    void updateDataFailed();
+
+    /**
+     * @brief Update methods call this when they have data that may be encoded (see CloudConfigPayload)
+     * 
+     * @param data JSON data, or base64 or compressed data beginning with the `b:` or `z:` prefix
+     * 
+     * Encoded data is decoded and passed to updateData(). If it can't be decoded, the update fails as
+     * if updateDataFailed() was called. JSON data is passed to updateData() unchanged.
+     */
+    bool updateDataEncoded(const char *data);
+
+    /**
+     * @brief Update methods call this when the server reports that the data has not changed
+     * 
+     * This completes the update successfully, the same as updateData() with the current data, but
+     * only lastCheck is updated and saved. The data callback is not called.
+     */
+    void updateDataNotModified();
+
+    /**
+     * @brief Gets the hash of the stored data, the dataHash field of CloudConfigDataHeader
+     * 
+     * @return The CRC-32 of the JSON data, or 0 if there is no data.
+     * 
+     * Update methods can send this with a request so the server can tell if the data has changed.
+     */
+    uint32_t getDataHash();
+
+    /**
+     * @brief Gets the largest data the storage method can store (see CloudConfigStorage::getMaxDataSize)
+     * 
+     * @return The size in bytes, or 0 if not limited or not known.
+     */
+    size_t getMaxDataSize() const { return storageMethod ? storageMethod->getMaxDataSize() : 0; };
+
+    /**
+     * @brief Gets the maxSize to pass to CloudConfigPayload::decode() for data that will be stored
+     * 
+     * @return getMaxDataSize() plus the null terminator, or CloudConfigPayload::MAX_DECODED_SIZE if 
+     * the storage method does not have a limit.
+     * 
+     * This keeps a small amount of compressed data from growing a heap buffer to 64 KB, only for 
+     * the data to be rejected as too large for the storage method.
+     */
+    size_t getMaxDecodedSize() const;
+
+    /**
+     * @brief Requests an update from the update method as soon as possible
+     * 
+     * If the cloud is not connected yet, the update is done after connecting and waitAfterCloudConnectedMs.
+     * If an update is already in progress, another one is started after it completes, since the 
+     * data may have changed after the request was made. Multiple calls before the update starts
+     * request only one update.
+     * 
+     * This does not change updateFrequency; the next periodic update is still based on lastCheck.
+     * 
+     * @return The time in milliseconds to stay awake for the update to complete, see getAwakeTimeMs().
+     */
+    unsigned long requestUpdate() { updateRequested = true; wakeMs = millis(); return getAwakeTimeMs(); };
+
+    /**
+     * @brief Gets the time the next update is due
+     * 
+     * @return The time as a Time.now() value (seconds past January 1, 1970, UTC), 0 if an update
+     * will be done as soon as the cloud is connected, or -1 if no update is scheduled.
+     * 
+     * The update is done the first time loop() is called after this time while the cloud is connected,
+     * so if you sleep, you can wake up at this time to update the configuration along with any 
+     * other cloud activity.
+     */
+    long getNextUpdateTime();
+
+    /**
+     * @brief Returns true if an update is due now, or as soon as the cloud is connected
+     */
+    bool isUpdateDue();
+
+    /**
+     * @brief Returns true if an update has been started and has not completed, failed, or timed out yet
+     */
+    bool isUpdateInProgress() const { return state == State::WAIT_UPDATE_COMPLETE && updateDataStatus == UpdateDataStatus::IN_PROGRESS; };
+
+    /**
+     * @brief Gets the maximum time to stay awake for updates that are due or in progress
+     * 
+     * @return Time in milliseconds, or 0 if no update is due or in progress. If the cloud is not
+     * connected yet, this is the time after connecting.
+     * 
+     * This includes waitAfterCloudConnectedMs and the jitter from withUpdateJitter() if the update
+     * has not been started yet and there is valid data, and updateTimeoutMs. The update often completes sooner; you can
+     * go to sleep once isUpdateInProgress() and isUpdateDue() are both false.
+     */
+    unsigned long getAwakeTimeMs();
+
+    /**
+     * @brief Update methods call this when they have a JSON merge patch (RFC 7386) to apply to the data
+     * 
+     * @param patch The merge patch. Keys in the patch are added or replaced, and keys with a null value
+     * are removed. Keys not in the patch are unchanged.
+     * 
+     * @return true if the patch was applied, false if the patch is not valid JSON or the result is too large.
+     * 
+     * The patched data is saved and the data callback is called, the same as updateData().
+     */
+    bool updateDataPatch(const char *patch);
+
+    /**
+     * @brief Update methods call this when they have a merge patch that may be encoded (see CloudConfigPayload)
+     * 
+     * @param data JSON merge patch, or base64 or compressed data beginning with the `b:` or `z:` prefix
+     * 
+     * @return true if the patch was applied, false if it could not be decoded or updateDataPatch() failed.
+     * 
+     * Encoded data is decoded and passed to updateDataPatch(), the same as updateDataEncoded() for 
+     * full updates. JSON data is passed to updateDataPatch() unchanged.
+     */
+    bool updateDataPatchEncoded(const char *data);
+
+    /**
+     * @brief Decodes all of the fields added using withField() from the current data
+     * 
+     * This is called automatically from setup() and updateData(). You don't normally need to call it.
+     */
+    void decodeFields();
+
+    /**
+     * @brief Checks json against the fields added using withField(), see withSchemaValidation()
+     * 
+     * @return true if the data is valid
+     */
+    bool validateFields(const char *json);
+
+    /**
+     * @brief Gets a counter that is incremented every time a new copy of the data is published for CloudConfigSnapshot
+     * 
+     * Only used with withThreadSafeReads().
+     */
+    uint32_t getSnapshotGeneration() const { return snapshotGeneration.load(); };
+
+protected:
+    /**
+     * @brief Constructor - You never instantiate this class directly.
+     * 
+     * Instead, get a singleton instance of a subclass by using CloudConfig::instance().
+     * 
+     * @param name The name of the instance, "" for CloudConfig::instance().
+     */
+    CloudConfig(const char *name = "");
+
+    /**
+     * @brief This class is a singleton and never deleted
+     */
+    virtual ~CloudConfig();
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfig(const CloudConfig&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfig& operator=(const CloudConfig&) = delete;
+
+    /**
+     * @brief Pointer to a state handler member function
+     */
+    typedef void (CloudConfig::*StateHandler)();
+
+    /**
+     * @brief Enters a new state
+     * 
+     * @param newState The state to enter
+     * 
+     * @param waitMs How long to wait before running the state handler. 0 runs it on the next loop().
+     * 
+     * Sets stateTime to millis().
+     */
+    void setState(State newState, unsigned long waitMs = 0) { state = newState; stateTime = millis(); wakeMs = stateTime + waitMs; };
+
+    /**
+     * @brief State handler this is the first state entered
+     * 
+     * May call dataCallback if there is valid saved data
+     * 
+     * Next state: stateWaitCloudConnected
+     */
+    void stateStart();
+
+    /**
+     * @brief State handler to wait for cloud connnected
+     * 
+     * Waits until Particle.connected() is true and also Time.isValid(). The latter is necessary
+     * because the store a timestamp of when we last checked the cloud settings.
+     * 
+     * Previous state: stateStart
+     * Next state: stateWaitAfterCloudConnected
+     */
+    void stateWaitCloudConnected();
+
+    /**
+     * @brief State handler for the waiting time after cloud connected
+     * 
+     * This waits waitAfterCloudConnectedMs, which is configurable within the update
+     * method. Default is 2 seconds.
+     * 
+     * Previous state: stateWaitCloudConnected
+     * Next state: stateStartUpdate if we need to retrieve settings
+     * or stateWaitToUpdate if there is no update required (not time yet)
+     */
+    void stateWaitAfterCloudConnected();
+
+    /**
+     * @brief State handler for waiting to update
+     * 
+     * If updateFrequency is set to a periodic value greater than zero, this state
+     * waits until the time has expired.
+     * 
+     * Previous state: stateWaitAfterCloudConnected
+     * Next state: stateStartUpdate
+     */
+    void stateWaitToUpdate();
+
+    /**
+     * @brief State handler to have the update method actually update settings
+     * 
+     * The startUpdate method of the update method is called in this state.
+     * 
+     * Previous state: stateWaitAfterCloudConnected or stateWaitToUpdate
+     * Next state: stateWaitUpdateComplete
+     */
+    void stateStartUpdate();
+
+    /**
+     * @brief Waits for updateData or updateDataFailed to be called
+     * 
+     * The update method starts the update process when startUpdate() is called. Then
+     * they either call CloudConfig::instance().updateData() or updateDataFailed().
+     * 
+     * If neither is called before updateTimeoutMs expires (default: 60 seconds)
+     * an error is assume to have occurred and is treated as if the updateDataFailed.
+     * 
+     * Previous state: stateStartUpdate
+     * Next state: stateWaitToUpdate
+     */
+    void stateWaitUpdateComplete();
+
+    /**
+     * @brief Gets the number of seconds after lastCheck that the next update is due
+     * 
+     * @return The interval, or -1 if no update will be done. Includes the backoff after a failure 
+     * and the per-device jitter.
+     */
+    long getUpdateInterval() const;
+
+    /**
+     * @brief Gets the time to wait after the cloud connects before deciding whether to update
+     * 
+     * The per-device jitter is only added when there is already valid data. A device without data
+     * updates as soon as waitAfterCloudConnectedMs has elapsed.
+     */
+    unsigned long getConnectedWaitMs() const;
+
+    /**
+     * @brief Copies the current data into the copy not being read and makes it the active copy
+     * 
+     * @return true if published or not using withThreadSafeReads(), false if deferred because a 
+     * reader still holds the copy, or it could not be allocated.
+     */
+    bool publishSnapshot();
+
+    /**
+     * @brief Runs the steps of a staged commit from loop(), see withStagedCommit()
+     */
+    void commitLoop();
+
+protected:
+    /**
+     * @brief Storage object - used to store data in retained memory, EEPROM, or flash file system file
+     */
+    CloudConfigStorage *storageMethod = 0;
+
+    /**
+     * @brief Update object - used to request data from the cloud
+     */
+    CloudConfigUpdate *updateMethod = 0;
+
+    /**
+     * @brief Callback to call when there is data
+     * 
+     * This is called either at startup, if data is located from the storage method and is valid, or
+     * after data is updated from the cloud. For some storage methods like function or subscription, this
+     * can also be called spontaneously when the cloud-side sends new configuration data.
+     */
+    std::function<void(void)> dataCallback = 0;
+
+    /**
+     * @brief Callback to call with the keys that changed, set using withDataChangeCallback()
+     */
+    std::function<void(const CloudConfigChanges &)> dataChangeCallback = 0;
+
+    /**
+     * @brief Whether to report changes inside of objects, set using withDataChangeCallback()
+     */
+    bool changesNested = false;
+
+    /**
+     * @brief Keys that changed in the last update, if dataChangeCallback is set
+     */
+    CloudConfigChanges changes;
+
+    /**
+     * @brief Copies the current data as JSON text if dataChangeCallback is set
+     * 
+     * @return A buffer allocated using malloc, or NULL if dataChangeCallback is not set or the allocation failed.
+     */
+    char *copyJsonTextForChanges();
+
+    /**
+     * @brief Updates changes from the copy of the old data from copyJsonTextForChanges() and the current data
+     * 
+     * @param oldJson The old data. Can be an empty string if there was no data, or NULL if it could not be copied.
+     */
+    void findChanges(const char *oldJson);
+
+    /**
+     * @brief Calls dataCallback and dataChangeCallback, if set
+     */
+    void callDataCallbacks();
+
+    /**
+     * @brief Increments the lookup counter, if metrics are enabled
+     */
+    void countLookup() { if (metricsEnabled) { metrics.lookups++; } };
+
+    /**
+     * @brief Adds the bytes written by the last save to the metrics
+     */
+    void countSavedBytes() { if (metricsEnabled) { metrics.bytesSaved += storageMethod->getLastSaveBytes(); } };
+
+    /**
+     * @brief Updates parseUs from a micros() value taken before setData()
+     */
+    void countParseTime(unsigned long startUs);
+
+    /**
+     * @brief Updates fetchMs if a requested update is in progress. Called when data is received.
+     */
+    void countFetch();
+
+    /**
+     * @brief true if new data is checked against the fields, set using withSchemaValidation()
+     */
+    bool schemaValidation = false;
+
+    /**
+     * @brief true if withMetrics() was called
+     */
+    bool metricsEnabled = false;
+
+    /**
+     * @brief Name of the Particle.variable for the metrics, or NULL for none
+     */
+    const char *metricsVariableName = NULL;
+
+    /**
+     * @brief Counters, updated if metricsEnabled
+     */
+    CloudConfigMetrics metrics;
+
+    /**
+     * @brief Function to call when a requested update completes, set using withMetricsCallback()
+     */
+    std::function<void(const CloudConfigMetrics &)> metricsCallback = 0;
+
+    /**
+     * @brief Value of metrics.lookups at metricsSecondMs, used to calculate lookupsPerSec
+     */
+    uint32_t metricsLastLookups = 0;
+
+    /**
+     * @brief millis() value when lookupsPerSec was last calculated
+     */
+    unsigned long metricsSecondMs = 0;
+
+    /**
+     * @brief Linked list of fields added using withField()
+     */
+    CloudConfigFieldBase *fields = 0;
+
+    /**
+     * @brief How often to update the data from the cloud
+     * 
+     * Values > 0 are in seconds. There are also two special values: UPDATE_ONCE (0) and UPDATE_AT_RESTART (-1);
+     * 
+     * Normally you use the withUpdateFrequency() methods to set this.
+     */
+    long updateFrequency = 0;
+
+    /**
+     * @brief Status of updateData. Used when in stateWaitUpdateComplete.
+     * 
+     * The updateData() and updateDataFailed() methods change this value.
+     */
+    UpdateDataStatus updateDataStatus = UpdateDataStatus::IDLE;
+
+    /**
+     * @brief Per-device delay in seconds, set by withUpdateJitter()
+     */
+    long updateJitterSec = 0;
+
+    /**
+     * @brief Initial retry delay in seconds after a failure, set by withUpdateBackoff(). 0 = no backoff retries.
+     */
+    long backoffInitialSec = 0;
+
+    /**
+     * @brief Maximum retry delay in seconds, set by withUpdateBackoff()
+     */
+    long backoffMaxSec = 0;
+
+    /**
+     * @brief Number of consecutive failed or timed out updates
+     */
+    unsigned int updateFailures = 0;
+
+    /**
+     * @brief Set by requestUpdate(), cleared when the update is started
+     */
+    bool updateRequested = false;
+
+    /**
+     * @brief Current state of the main state machine
+     */
+    State state = State::STOPPED;
+
+    /**
+     * @brief Time value (millis) when the current state was entered
+     */
+    unsigned long stateTime = 0;
+
+    /**
+     * @brief The state handler is not called until millis() reaches this value
+     * 
+     * State handlers set this to when they next need to run, so loop() only has to compare
+     * the time when nothing is due. Anything that could change the outcome of a state, like 
+     * updateData() or withUpdateFrequency(), sets it to the current time.
+     */
+    unsigned long wakeMs = 0;
+
+    /**
+     * @brief Maximum time to wait in stateWaitToUpdate before checking the time again, in milliseconds
+     * 
+     * This limits how late an update can be if the real time clock is set.
+     */
+    static const unsigned long MAX_WAIT_TO_UPDATE_MS = 10 * 60 * 1000;
+
+    /**
+     * @brief How often stateWaitCloudConnected checks for the cloud connection and time, in milliseconds
+     */
+    static const unsigned long CLOUD_CONNECTED_CHECK_MS = 100;
+
+    /**
+     * @brief State handlers, indexed by State
+     */
+    static const StateHandler stateHandlers[];
+
+    /**
+     * @brief Array of two copies of the data for thread-safe reads, or NULL if not enabled
+     */
+    CloudConfigStorageCopy *snapshots = 0;
+
+    /**
+     * @brief Index into snapshots of the copy new readers use
+     */
+    std::atomic<int> activeSnapshot;
+
+    /**
+     * @brief Number of CloudConfigSnapshot objects holding each copy
+     */
+    std::atomic<int> snapshotReaders[2];
+
+    /**
+     * @brief Incremented each time a copy is published
+     */
+    std::atomic<uint32_t> snapshotGeneration;
+
+    /**
+     * @brief true if the data changed but could not be published yet
+     */
+    bool snapshotPending = false;
+
+    /**
+     * @brief true if withStagedCommit() was used
+     */
+    bool stagedCommit = false;
+
+    /**
+     * @brief Time budget for staged commits in milliseconds, see withStagedCommit()
+     */
+    unsigned long commitTimeBudgetMs = 0;
+
+    /**
+     * @brief Current step of staged commit
+     */
+    CommitStage commitStage = CommitStage::IDLE;
+
+    /**
+     * @brief Copy of the data passed to updateData() waiting to be committed, allocated on the heap
+     */
+    std::atomic<char *> pendingData;
+
+    /**
+     * @brief Name passed to instance(name), or "" for CloudConfig::instance()
+     */
+    const char *name;
+
+    /**
+     * @brief Next named instance in the list starting at _namedInstances
+     */
+    CloudConfig *nextInstance = 0;
+
+    /**
+     * @brief Singleton instance of this class
+     */
+    static CloudConfig *_instance;
+
+    /**
+     * @brief Linked list of instances created using instance(name)
+     */
+    static CloudConfig *_namedInstances;
+
+    friend class CloudConfigSnapshot;
+};
+
+/**
+ * @brief Consistent, read-only view of the configuration data that can be used from any thread
+ * 
+ * Requires CloudConfig::withThreadSafeReads(). Create one of these on the stack and read the
+ * data through it:
+ * 
+ * ```
+ * CloudConfigSnapshot snapshot;
+ * int a = snapshot->getInt("a");
+ * const char *b = snapshot->getString("b");
+ * ```
+ * 
+ * The data does not change while the object exists, even if it is updated from the cloud, and 
+ * pointers returned by getString() are valid until it is destroyed. Creating and destroying a 
+ * snapshot never blocks, but keep the object only as long as you need it, as a new copy of the
+ * data can't be published while a reader holds the older copy.
+ * 
+ * If withThreadSafeReads() was not used, this reads the storage method directly.
+ */
+class CloudConfigSnapshot {
+public:
+    /**
+     * @brief Constructor. Takes a snapshot of the CloudConfig::instance() data.
+     */
+    CloudConfigSnapshot() : CloudConfigSnapshot(CloudConfig::instance()) {};
+
+    /**
+     * @brief Constructor. Takes a snapshot of the data of a named instance.
+     * 
+     * @param cloudConfig The instance, for example CloudConfig::instance("tuning")
+     */
+    CloudConfigSnapshot(CloudConfig &cloudConfig);
+
+    /**
+     * @brief Destructor. Releases the snapshot.
+     */
+    ~CloudConfigSnapshot();
+
+    /**
+     * @brief Gets the storage object to read the data from
+     */
+    CloudConfigStorage *operator->() const { return storage; };
+
+    /**
+     * @brief Gets the storage object to read the data from
+     */
+    CloudConfigStorage &getStorage() const { return *storage; };
+
+    /**
+     * @brief Gets the generation of the snapshot, see CloudConfig::getSnapshotGeneration()
+     */
+    uint32_t getGeneration() const { return generation; };
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigSnapshot(const CloudConfigSnapshot&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    CloudConfigSnapshot& operator=(const CloudConfigSnapshot&) = delete;
+
+protected:
+    /**
+     * @brief The instance the snapshot is of
+     */
+    CloudConfig *cloudConfig;
+
+    /**
+     * @brief The storage object for this snapshot
+     */
+    CloudConfigStorage *storage = 0;
+
+    /**
+     * @brief Index into CloudConfig snapshots, or -1 if not using a copy
+     */
+    int index = -1;
+
+    /**
+     * @brief Generation of the copy
+     */
+    uint32_t generation = 0;
+};
+
+/**
+ * @brief Storage method that doesn't use the cloud at all and instead has the configuration as a static string in code
+ * 
+ * This is mainly so you can use the same code base for cloud or local storage, swappable at compile time.
+ * It's a bit of overkill for normal use.
+ */
+class CloudConfigStorageStatic : public CloudConfigStorage {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param jsonData The JSON data to use as the configuration data (string constant)
+     */
+    CloudConfigStorageStatic(const char * const jsonData) : jsonData(jsonData) {};
+
+    /**
+     * @brief Called during setup() to parse the JSON data
+     */
+    virtual void setup() { parse(); };
+
+    /**
+     * @brief Return the static JSON data
+     */
+    const char * const getJsonData() const { return jsonData; };
+
+protected:
+    /**
+     * @brief The value passed to the constructor
+     */
+    const char * const jsonData;
+};
+
+/**
+ * @brief A key and value in a table used by CloudConfigStorageTable
+ * 
+ * The constructors are constexpr, including the hash of the key, so a const array of these
+ * is built by the compiler and stored in flash:
+ * 
+ * ```
+ * constexpr CloudConfigTableEntry configTable[] = {
+ *     {"a", 123},
+ *     {"b", "testing"},
+ *     {"c", true},
+ *     {"d", 12.5}
+ * };
+ * ```
+ */
+struct CloudConfigTableEntry {
+    /**
+     * @brief Integer value
+     * 
+     * @param key The key. Must be a string constant; the pointer is saved.
+     * 
+     * @param value The value
+     */
+    constexpr CloudConfigTableEntry(const char *key, int value) : key(key), hash(hashKey(key)), type(JSON_TYPE_NUMBER), intValue(value), doubleValue(value), stringValue(0) {};
+
+    /**
+     * @brief Double value
+     * 
+     * @param key The key. Must be a string constant; the pointer is saved.
+     * 
+     * @param value The value
+     */
+    constexpr CloudConfigTableEntry(const char *key, double value) : key(key), hash(hashKey(key)), type(JSON_TYPE_NUMBER), intValue((int)value), doubleValue(value), stringValue(0) {};
+
+    /**
+     * @brief Boolean value
+     * 
+     * @param key The key. Must be a string constant; the pointer is saved.
+     * 
+     * @param value The value
+     */
+    constexpr CloudConfigTableEntry(const char *key, bool value) : key(key), hash(hashKey(key)), type(JSON_TYPE_BOOL), intValue(value ? 1 : 0), doubleValue(value ? 1 : 0), stringValue(0) {};
+
+    /**
+     * @brief String value
+     * 
+     * @param key The key. Must be a string constant; the pointer is saved.
+     * 
+     * @param value The value. Must be a string constant; the pointer is saved.
+     */
+    constexpr CloudConfigTableEntry(const char *key, const char *value) : key(key), hash(hashKey(key)), type(JSON_TYPE_STRING), intValue(0), doubleValue(0), stringValue(value) {};
+
+    /**
+     * @brief Same as CloudConfigStorage::hashKey(), but can be evaluated at compile time
+     */
+    static constexpr uint32_t hashKey(const char *key, uint32_t hash = 2166136261) { return *key ? hashKey(key + 1, (hash ^ (uint8_t)*key) * 16777619) : hash; };
+
+    /**
+     * @brief The key
+     */
+    const char *key;
+
+    /**
+     * @brief Hash of the key, from CloudConfigStorage::hashKey()
+     */
+    uint32_t hash;
+
+    /**
+     * @brief JSON_TYPE_NUMBER, JSON_TYPE_BOOL, or JSON_TYPE_STRING
+     */
+    uint8_t type;
+
+    /**
+     * @brief Value for numbers and booleans (1 or 0)
+     */
+    int intValue;
+
+    /**
+     * @brief Value for numbers and booleans (1 or 0)
+     */
+    double doubleValue;
+
+    /**
+     * @brief Value for strings, or NULL for other types
+     */
+    const char *stringValue;
+};
+
+/**
+ * @brief Index of a table of CloudConfigTableEntry sorted by hash, built at compile time
+ * 
+ * @param N The number of entries in the table
+ * 
+ * Pass this to the CloudConfigStorageTable constructor so lookups are a binary search instead
+ * of comparing the hash of each entry. It's 2 bytes per entry in flash:
+ * 
+ * ```
+ * constexpr CloudConfigTableIndex<4> configIndex(configTable);
+ * ```
+ */
+template<size_t N>
+struct CloudConfigTableIndex {
+    static_assert(N <= 0xffff, "too many table entries");
+
+    /**
+     * @brief Constructor. Sorts the entries by hash (insertion sort, done by the compiler when constexpr).
+     * 
+     * @param entries The table to index
+     */
+    constexpr CloudConfigTableIndex(const CloudConfigTableEntry (&entries)[N]) : order() {
+        for(size_t ii = 0; ii < N; ii++) {
+            size_t jj = ii;
+            for(; jj > 0 && entries[order[jj - 1]].hash > entries[ii].hash; jj--) {
+                order[jj] = order[jj - 1];
+            }
+            order[jj] = (uint16_t) ii;
+        }
+    };
+
+    /**
+     * @brief Indexes into the table, sorted by hash
+     */
+    uint16_t order[N];
+};
+
+/**
+ * @brief Storage method for a fixed configuration in a table built at compile time
+ * 
+ * This is an alternative to CloudConfigStorageStatic when the configuration never changes. 
+ * The table of CloudConfigTableEntry is in flash, so there is no JSON data to parse and no RAM 
+ * is used for the data. The keys are hashed at compile time, so a lookup compares the hash of 
+ * each entry and only compares the key when the hash matches. If a CloudConfigTableIndex
+ * is also passed to the constructor, a lookup is a binary search by hash.
+ * 
+ * getInt(), getBool(), getDouble(), getString(), copyString(), and hasKey() work for top-level
+ * keys, including from a CloudConfigPath, and with fields added using withField(). getString() 
+ * returns an empty string for values that are not strings, but copyString() converts numbers 
+ * and booleans to strings.
+ * 
+ * getJsonData() and the methods that return a JSONValue generate the JSON from the table on
+ * first use, which allocates it on the heap. This is also used by thread-safe snapshots 
+ * (CloudConfig::withThreadSafeReads()) and change callbacks (CloudConfig::withDataChangeCallback()).
+ * 
+ * Declare the table constexpr or const, not retained, and don't use an update method.
+ */
+class CloudConfigStorageTable : public CloudConfigStorage {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param entries The table. The pointer is saved.
+     * 
+     * @param numEntries The number of entries in the table
+     */
+    CloudConfigStorageTable(const CloudConfigTableEntry *entries, size_t numEntries) : entries(entries), numEntries(numEntries) {};
+
+    /**
+     * @brief Constructor for an array, which determines the number of entries
+     * 
+     * @param entries The table. The pointer is saved.
+     */
+    template<size_t N>
+    CloudConfigStorageTable(const CloudConfigTableEntry (&entries)[N]) : entries(entries), numEntries(N) {};
+
+    /**
+     * @brief Constructor for an array with an index, so lookups are a binary search
+     * 
+     * @param entries The table. The pointer is saved.
+     * 
+     * @param index The index of the table. The pointer is saved.
+     */
+    template<size_t N>
+    CloudConfigStorageTable(const CloudConfigTableEntry (&entries)[N], const CloudConfigTableIndex<N> &index) : entries(entries), numEntries(N), index(index.order) {};
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~CloudConfigStorageTable() { delete[] jsonData; };
+
+    /**
+     * @brief Called during setup(). There is nothing to load or parse.
+     */
+    virtual void setup() { jsonObjStale = true; };
+
+    /**
+     * @brief Gets the table as JSON, which is generated and allocated on the heap on first use
+     */
+    const char * const getJsonData() const;
+
+    /**
+     * @brief Returns true if the table is not empty
+     */
+    virtual bool hasJsonData() const { return numEntries > 0; };
+
+    // The CloudConfigPath overloads are not hidden by the key overrides below
+    using CloudConfigStorage::hasKey;
+    using CloudConfigStorage::getInt;
+    using CloudConfigStorage::getBool;
+    using CloudConfigStorage::getDouble;
+    using CloudConfigStorage::copyString;
+
+    /**
+     * @brief Returns true if the key is in the table
+     */
+    virtual bool hasKey(const char *key) { return findEntry(key) != NULL; };
+
+    /**
+     * @brief Gets an integer value. Strings are converted using strtol; doubles are truncated.
+     */
+    virtual int getInt(const char *key);
+
+    /**
+     * @brief Gets a boolean value. Numbers are true if not 0, strings if they are "true" or a number that is not 0.
+     */
+    virtual bool getBool(const char *key);
+
+    /**
+     * @brief Gets a double value. Strings are converted using strtod.
+     */
+    virtual double getDouble(const char *key);
+
+    /**
+     * @brief Gets a string value, or an empty string if the key does not exist or is not a string
+     * 
+     * The pointer is to the string in the table, so it's always valid.
+     */
+    virtual const char *getString(const char *key);
+
+    /**
+     * @brief Copies a value into a buffer. Numbers and booleans are converted to strings.
+     */
+    virtual bool copyString(const char *key, char *buf, size_t bufSize);
+
+    /**
+     * @brief Finds the entry for a key
+     * 
+     * @return The entry, or NULL if the key is not in the table
+     */
+    const CloudConfigTableEntry *findEntry(const char *key) const;
+
+protected:
+    /**
+     * @brief The table passed to the constructor
+     */
+    const CloudConfigTableEntry *entries;
+
+    /**
+     * @brief The number of entries in the table
+     */
+    size_t numEntries;
+
+    /**
+     * @brief The order array from the CloudConfigTableIndex, or NULL for no index
+     */
+    const uint16_t *index = 0;
+
+    /**
+     * @brief The table as JSON, allocated by getJsonData(), or NULL if not generated yet
+     */
+    mutable char *jsonData = 0;
+};
+
+/**
+ * @brief Storage method to store data in retained memory
+ * 
+ * Retained memory is preserved across restarts and across all sleep modes including HIBERNATE mode. There is around 3K of retained memory available.
+ */
+class CloudConfigStorageRetained : public CloudConfigStorageData {
+public:
+    /**
+     * @brief Construct a storage method for retained RAM. 
+     * 
+     * @param retainedData A pointer to the retained buffer, typically a CloudConfigData<> struct.
+     * 
+     * @param totalSize The size of the retained data including both the header and data. It's that way so you can use sizeof() easily.
+     * 
+     * You typically allocate one of these as a global variable or using new from setup(). 
+     * 
+     * You cannot delete or copy one of these objects.
+     */
+    CloudConfigStorageRetained(void *retainedData, size_t totalSize) : CloudConfigStorageData((CloudConfigDataHeader *)retainedData, totalSize - sizeof(CloudConfigDataHeader)) {};
+    
+    /**
+     * @brief Called during setup() to validate and parse the JSON data
+     */
+    virtual void setup() { validate(); };
+
+    /**
+     * @brief Retained data doesn't require an explict save
+     */
+    virtual bool save() { return true; };
+};
+
+
+/**
+ * @brief Storage method to store data in the emulated EEPROM
+ * 
+ * This is a good choice for storing data on Gen 2 devices if you have available space in EEPROM. 
+ * 
+ * On Gen 3 devices (Argon, Boron, B  Series SoM, Tracker SoM) the file system is usually a better choice.
+ * Since the emulated EEPROM is just a file on the file system on Gen 3, there is no performance
+ * advantage for using EEPROM over File.
+ * 
+ * @param SIZE the templated maximum size of the JSON data. 
+ * 
+ * The getTotalSize() method of the parent class determines how many bytes of EEPROM are used; it's
+ * the size of the CloudConfigDataHeader plus SIZE. If you use withSlots(), that many bytes are used
+ * for each slot.
+ */
+template<size_t SIZE>
+class CloudConfigStorageEEPROM : public CloudConfigStorageData {
+public:
+    /**
+     * @brief Constructor for EEPROM storage
+     * 
+     * @param eepromOffset Starting offset in EEPROM to store the data. 
+     * 
+     * The getTotalSize() method of the parent class determines how many bytes of EEPROM are used; it's
+     * the size of the CloudConfigDataHeader plus SIZE.
+     */
+    CloudConfigStorageEEPROM(size_t eepromOffset) : CloudConfigStorageData(&dataBuffer.header, SIZE), eepromOffset(eepromOffset) {};
+
+    /**
+     * @brief Rotate saved data across multiple slots in EEPROM
+     * 
+     * @param numSlots Number of slots. The default is 1, which always saves in the same location.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * Each slot is sizeof(CloudConfigDataHeader) + SIZE bytes, the slots are contiguous starting at
+     * eepromOffset. Each time the data changes it's saved to the next slot with an incremented
+     * sequence number in the header, spreading the writes across numSlots times as many bytes.
+     * At setup(), the valid slot with the highest sequence number is loaded. The data is written
+     * before the header, so a slot that was partially written when power was lost fails its
+     * dataHash check and the previous slot is used instead. In binary format (withBinaryFormat())
+     * the dataHash is of the original JSON and can't be checked, so the CRC-32 of the binary data,
+     * which is stored in the binary data header, is checked instead.
+     * 
+     * Must be called before setup().
+     */
+    CloudConfigStorageEEPROM<SIZE> &withSlots(size_t numSlots) { this->numSlots = (numSlots > 0) ? numSlots : 1; return *this; };
+
+    /**
+     * @brief Returns the slot the data was last loaded from or saved to, 0 <= slot < numSlots
+     */
+    size_t getSlot() const { return slot; };
+
+    /**
+     * @brief Called during setup() to load, validate, and parse the JSON data
+     */
+    virtual void setup() { 
+        if (numSlots > 1) {
+            loadNewestSlot();
+        }
+        else {
+            EEPROM.get(eepromOffset, dataBuffer); 
+        }
+        validate(); 
+    };
+
+    /**
+     * @brief Called to save the data in EEPROM when it is updated
+     * 
+     * Only the header and the used data (JSON data up to and including the null terminator) are saved, and
+     * only ranges of bytes that are different than what is already in EEPROM are written.
+     * The number of bytes written is available from getLastSaveBytes(). Returns false if the bytes
+     * written do not read back correctly.
+     * 
+     * When using withSlots(), the data is saved to the next slot.
+     */
+    virtual bool save() { 
+        if (numSlots > 1) {
+            slot = (slot + 1) % numSlots;
+            dataBuffer.header.sequence++;
+        }
+        return saveBytes(sizeof(CloudConfigDataHeader) + getUsedDataSize()); 
+    };
+
+    /**
+     * @brief Saves only the header to EEPROM
+     * 
+     * Typically only the 4 bytes of lastCheck change, so only those are written. When using withSlots(), 
+     * the header is updated in the current slot, since lastCheck is not covered by the dataHash.
+     */
+    virtual bool saveHeader() { return saveBytes(sizeof(CloudConfigDataHeader)); };
+
+protected:
+    /**
+     * @brief Offset in EEPROM of the current slot
+     */
+    size_t getSlotOffset() const { return eepromOffset + slot * sizeof(CloudConfigData<SIZE>); };
+
+    /**
+     * @brief Loads the valid slot with the highest sequence number into dataBuffer
+     * 
+     * The slots are tried newest first by reading only their headers. If none are valid, dataBuffer 
+     * is cleared so validate() reinitializes it and the next save() goes to slot 0.
+     */
+    void loadNewestSlot() {
+        bool haveLimit = false;
+        uint32_t limit = 0;
+
+        for(size_t tries = 0; tries < numSlots; tries++) {
+            // Find the newest slot older than the ones that have already failed
+            bool found = false;
+            uint32_t newest = 0;
+            for(size_t ii = 0; ii < numSlots; ii++) {
+                CloudConfigDataHeader slotHeader;
+                EEPROM.get(eepromOffset + ii * sizeof(CloudConfigData<SIZE>), slotHeader);
+                if (slotHeader.magic != CloudConfig::DATA_MAGIC ||
+                    slotHeader.headerSize != (uint8_t)sizeof(CloudConfigDataHeader) ||
+                    slotHeader.dataSize != (uint16_t)SIZE) {
+                    continue;
+                }
+                if (haveLimit && !isNewerSequence(limit, slotHeader.sequence)) {
+                    continue;
+                }
+                if (!found || isNewerSequence(slotHeader.sequence, newest)) {
+                    found = true;
+                    newest = slotHeader.sequence;
+                    slot = ii;
+                }
+            }
+            if (!found) {
+                break;
+            }
+
+            EEPROM.get(getSlotOffset(), dataBuffer);
+            if (isValidLoadedData(sizeof(dataBuffer))) {
+                return;
+            }
+            Log.info("EEPROM slot %u not valid", (unsigned) slot);
+            haveLimit = true;
+            limit = newest;
+        }
+
+        memset(&dataBuffer, 0, sizeof(dataBuffer));
+        slot = numSlots - 1;
+    }
+
+    /**
+     * @brief Returns true if sequence a is newer than b, allowing for the sequence number wrapping
+     */
+    static bool isNewerSequence(uint32_t a, uint32_t b) { return (int32_t)(a - b) > 0; };
+
+    /**
+     * @brief Writes the bytes that are different from EEPROM
+     * 
+     * @param saveSize Number of bytes to compare and write, starting with the header
+     * 
+     * The data after the header is written before the header so a partially written save leaves
+     * a dataHash that does not match the data. If the data could not be written, the header is
+     * not written either.
+     * 
+     * @return true if the bytes in EEPROM match dataBuffer after writing
+     */
+    bool saveBytes(size_t saveSize) {
+        lastSaveBytes = 0;
+        return saveRange(sizeof(CloudConfigDataHeader), saveSize) &&
+            saveRange(0, (saveSize < sizeof(CloudConfigDataHeader)) ? saveSize : sizeof(CloudConfigDataHeader));
+    };
+
+    /**
+     * @brief Writes the bytes in the range [start, end) of dataBuffer that are different from EEPROM
+     * 
+     * @return true if the bytes written read back correctly
+     */
+    bool saveRange(size_t start, size_t end) {
+        const uint8_t *image = (const uint8_t *)&dataBuffer;
+        size_t offset = getSlotOffset();
+
+        for(size_t ii = start; ii < end; ) {
+            if (EEPROM.read(offset + ii) == image[ii]) {
+                ii++;
+                continue;
+            }
+
+            // Find the end of this range of changed bytes. Byte ii is already known to be different.
+            size_t rangeStart = ii++;
+            while(ii < end && EEPROM.read(offset + ii) != image[ii]) {
+                ii++;
+            }
+            HAL_EEPROM_Put(offset + rangeStart, &image[rangeStart], ii - rangeStart);
+            lastSaveBytes += ii - rangeStart;
+
+            for(size_t jj = rangeStart; jj < ii; jj++) {
+                if (EEPROM.read(offset + jj) != image[jj]) {
+                    Log.error("EEPROM write failed at %u", (unsigned) (offset + jj));
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Offset into the emulated EEPROM to start storing the data.
+     */
+    size_t eepromOffset;
+
+    /**
+     * @brief Number of slots to rotate the data across, set using withSlots()
+     */
+    size_t numSlots = 1;
+
+    /**
+     * @brief Current slot, 0 <= slot < numSlots
+     */
+    size_t slot = 0;
+
+    /**
+     * @brief Copy of the EEPROM data in RAM
+     */
+    CloudConfigData<SIZE> dataBuffer;
+};
+
+#if HAL_PLATFORM_FILESYSTEM
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Base class for storage methods that store data in the flash file system
+ * 
+ * This contains the file I/O common to CloudConfigStorageFile and CloudConfigStorageFileDynamic.
+ * You don't instantiate one of these directly.
+ */
+class CloudConfigStorageFileBase : public CloudConfigStorageData {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param path The pathname (slash separated, like Unix) to the file to store the data in. 
      */
-    JSONValue getJSONValueForKey(const char *key) { return storageMethod->getJSONValueForKey(key); };
+    CloudConfigStorageFileBase(const char *path) : path(path) {};
 
     /**
-     * @brief Gets the value for a given key in the a JSON object 
+     * @brief Enable atomic save mode
      * 
-     * @param parentObj A JSONValue for a JSON object to look in
+     * @param atomicSave true to enable (the default if the parameter is omitted) or false to disable
      * 
-     * @param key The name of the key-value pair
+     * @return Returns *this so you can chain calls, fluent-style.
      * 
-     * @return A JSONValue object for that key. If the key does not exist in that object, an
-     * empty JSONValue object that returns false for isValid() is returned.
+     * In atomic save mode, the data is written to a temporary file (the path with ".tmp" appended), 
+     * flushed using fsync(), then renamed over the original file, so the saved configuration is never
+     * partially written if power is lost during save. This also applies when only the header is
+     * saved, such as the last check time, so saveHeader() writes the whole file in this mode.
      */
-    JSONValue getJSONValueForKey(JSONValue parentObj, const char *key) { return storageMethod->getJSONValueForKey(parentObj, key); };
+    CloudConfigStorageFileBase &withAtomicSave(bool atomicSave = true) { this->atomicSave = atomicSave; return *this; };
 
     /**
-     * @brief Gets the value for a given index in the a JSON array in the top-level outer JSON array
-     * 
-     * @param index 0 = first entry, 1 = second entry, ...
+     * @brief Called during setup() to load, validate, and parse the JSON data
      * 
-     * @return A JSONValue object for that key. If the key does not exist in that object, an
-     * empty JSONValue object that returns false for isValid() is returned.
+     * The header and data must already be set using withData().
+     */
+    virtual void setup();
+
+    /**
+     * @brief Called to save the data to the file when it is updated
      * 
-     * This method is not commonly used because the top-level object is usually a JSON object
-     * (surrounded by { }) not a JSON array (surrounded by [ ]).
+     * Only the header and the JSON data up to and including the null terminator are saved. The
+     * number of bytes written is available from getLastSaveBytes().
      * 
-     * There is no call to determine the length of the array; iterate until an invalid object
-     * is returned.
+     * @return true if the data was successfully written, false if not
      */
-    JSONValue getJSONValueAtIndex(size_t index) { return storageMethod->getJSONValueAtIndex(index); };
+    virtual bool save();
 
     /**
-     * @brief Gets the value for a given index in the a JSON array
+     * @brief Saves only the header by overwriting the beginning of the file
      * 
-     * @param parentObj A JSONValue for a JSON object to look in
+     * If the file does not exist, or atomic save mode is enabled (withAtomicSave()), the whole file 
+     * is saved using save() instead.
+     */
+    virtual bool saveHeader();
+
+    /**
+     * @brief Gets the path of the temporary file used in atomic save mode
+     */
+    String getTempPath() const { return String::format("%s.tmp", path.c_str()); };
+
+protected:
+    /**
+     * @brief Reads the file into the header and data buffer
      * 
-     * @param index 0 = first entry, 1 = second entry, ...
+     * @param fd The open file descriptor, positioned after headerSize bytes
      * 
-     * @return A JSONValue object for that key. If the key does not exist in that object, an
-     * empty JSONValue object that returns false for isValid() is returned.
+     * @param headerBytes The number of bytes of the header already read into header by the caller, or 0
      * 
-     * There is no call to determine the length of the array; iterate until an invalid object
-     * is returned.
+     * If the contents are not valid, the header and data are zeroed so validate() will reinitialize them.
      */
-    JSONValue getJSONValueAtIndex(JSONValue parentObj, size_t index) { return storageMethod->getJSONValueAtIndex(parentObj, index); };
+    void readFile(int fd, size_t headerBytes);
 
     /**
-     * @brief Convenience method for getting a top level JSON integer value by its key name
-     * 
-     * @param key The JSON key to retrieve
-     * 
-     * If the key does not exist, 0 is returned.
+     * @brief The file system path passed to the contructor
      */
-    int getInt(const char *key) { return storageMethod->getJSONValueForKey(key).toInt(); };
+    String path;
 
     /**
-     * @brief Convenience method for getting a top level JSON integer value by its key name
-     * 
-     * @param key The JSON key to retrieve
-     * 
-     * If the key does not exist, false is returned.
+     * @brief true if atomic save mode is enabled using withAtomicSave()
      */
-    bool getBool(const char *key) { return storageMethod->getJSONValueForKey(key).toBool(); };
+    bool atomicSave = false;
+};
 
+/**
+ * @brief Storage method to store data in the flash file system
+ * 
+ * On Gen 3 devices (Argon, Boron, B  Series SoM, Tracker SoM) the file system is usually a good choice.
+ * Since the emulated EEPROM is just a file on the file system on Gen 3, there is no performance
+ * advantage for using EEPROM over File.
+ * 
+ * The file system is 2 MB on most devices, 4 MB on the Tracker.
+ * 
+ * @param SIZE the templated maximum size of the JSON data. 
+ * 
+ * You need for SIZE to be larger enough for the largest configuration you will have, but it does
+ * reserve sizeof(CloudConfigDataHeader) + SIZE bytes of RAM, so you don't want it be excessively
+ * large. For function, subscription and webhook update methods, SIZE can't be larger than 622 bytes.
+ * 
+ * See also CloudConfigStorageFileDynamic, which allocates the buffer based on the size of the data.
+ */
+template<size_t SIZE>
+class CloudConfigStorageFile : public CloudConfigStorageFileBase {
+public:
     /**
-     * @brief Convenience method for getting a top level JSON integer value by its key name
-     * 
-     * @param key The JSON key to retrieve
+     * @brief Constructor for storage of data in a flash file system file
      * 
-     * If the key does not exist, 0 is returned.
+     * @param path The pathname (slash separated, like Unix) to the file to store the data in. 
      */
-    double getDouble(const char *key) { return storageMethod->getJSONValueForKey(key).toDouble(); };
+    CloudConfigStorageFile(const char *path) : CloudConfigStorageFileBase(path) { withData(&dataBuffer.header, SIZE); };
 
+protected:
     /**
-     * @brief Convenience method for getting a top level JSON integer value by its key name
-     * 
-     * @param key The JSON key to retrieve
-     * 
-     * If the key does not exist, an empty string is returned.
+     * @brief Copy of the file data in RAM
      */
-    const char *getString(const char *key) { return storageMethod->getJSONValueForKey(key).toString().data(); };
+    CloudConfigData<SIZE> dataBuffer;
+};
 
+/**
+ * @brief Storage method to store data in the flash file system with a buffer allocated on the heap
+ * 
+ * Instead of reserving a compile-time SIZE, the buffer is allocated during setup() based on the 
+ * size of the saved data and is enlarged as necessary when larger data is received in updateData().
+ * The buffer is never made smaller.
+ * 
+ * If the buffer can't be allocated during setup(), an empty buffer in this object is used instead,
+ * so hasJsonData() returns false, and the file is not overwritten until data is successfully set.
+ */
+class CloudConfigStorageFileDynamic : public CloudConfigStorageFileBase {
+public:
     /**
-     * @brief Update methods call this when they have JSON configuration data
+     * @brief Constructor for storage of data in a flash file system file
      * 
-     * The maximum size of the data is dependent on the storage method and how it was configured. 
+     * @param path The pathname (slash separated, like Unix) to the file to store the data in. 
+     * 
+     * @param maxDataSize The maximum size of the JSON data buffer in bytes, including the null terminator.
+     * Larger values are limited to 65535, the largest size that can be stored in the header.
      */
-    virtual bool updateData(const char *json);
+    CloudConfigStorageFileDynamic(const char *path, size_t maxDataSize = 4096) : CloudConfigStorageFileBase(path), maxDataSize((maxDataSize < 0xffff) ? maxDataSize : 0xffff) {};
 
     /**
-     * @brief Update methods call this if they tried but failed to get configuration data
-     * 
-     * If you don't call updateData() or updateDataFailed() from the update method, then eventually it will
-     * time out, which will be treated as a failure.
+     * @brief Called during setup() to allocate the buffer and load, validate, and parse the JSON data
      */
-    void updateDataFailed();
+    virtual void setup();
 
-protected:
     /**
-     * @brief Constructor - You never instantiate this class directly.
+     * @brief Enlarges the buffer if necessary, then sets the data (see CloudConfigStorageData::setData)
      * 
-     * Instead, get a singleton instance of a subclass by using CloudConfig::instance().
+     * @param json The new JSON data
+     * 
+     * @return false if the buffer could not be allocated or the data is larger than maxDataSize.
      */
-    CloudConfig();
+    virtual bool setData(const char *json);
 
     /**
-     * @brief This class is a singleton and never deleted
+     * @brief Saves the data to the file, unless the buffer could not be allocated
      */
-    virtual ~CloudConfig();
+    virtual bool save() { return !isEmptyBuffer() && CloudConfigStorageFileBase::save(); };
 
     /**
-     * @brief This class is not copyable
+     * @brief Saves the header to the file, unless the buffer could not be allocated
      */
-    CloudConfig(const CloudConfig&) = delete;
+    virtual bool saveHeader() { return !isEmptyBuffer() && CloudConfigStorageFileBase::saveHeader(); };
 
     /**
-     * @brief This class is not copyable
+     * @brief Gets maxDataSize, as the buffer is enlarged as needed
      */
-    CloudConfig& operator=(const CloudConfig&) = delete;
+    virtual size_t getMaxDataSize() const { return maxDataSize; };
 
     /**
-     * @brief State handler this is the first state entered
-     * 
-     * May call dataCallback if there is valid saved data
-     * 
-     * Next state: stateWaitCloudConnected
+     * @brief Minimum size of the data buffer, and the size it's enlarged in multiples of
      */
-    void stateStart();
+    static const size_t ALLOC_INCREMENT = 64;
 
+protected:
     /**
-     * @brief State handler to wait for cloud connnected
+     * @brief Allocate a new buffer of newDataSize and copy the existing header and data into it
      * 
-     * Waits until Particle.connected() is true and also Time.isValid(). The latter is necessary
-     * because the store a timestamp of when we last checked the cloud settings.
+     * @param newDataSize The new size of the data, not including the header
      * 
-     * Previous state: stateStart
-     * Next state: stateWaitAfterCloudConnected
+     * @return true on success or false if the memory could not be allocated
      */
-    void stateWaitCloudConnected();
+    bool allocate(size_t newDataSize);
 
     /**
-     * @brief State handler for the waiting time after cloud connected
-     * 
-     * This waits waitAfterCloudConnectedMs, which is configurable within the update
-     * method. Default is 2 seconds.
-     * 
-     * Previous state: stateWaitCloudConnected
-     * Next state: stateStartUpdate if we need to retrieve settings
-     * or stateWaitToUpdate if there is no update required (not time yet)
+     * @brief Returns true if the buffer could not be allocated, so emptyBuffer is used
      */
-    void stateWaitAfterCloudConnected();
+    bool isEmptyBuffer() const { return header == &emptyBuffer.header; };
 
     /**
-     * @brief State handler for waiting to update
-     * 
-     * If updateFrequency is set to a periodic value greater than zero, this state
-     * waits until the time has expired.
-     * 
-     * Previous state: stateWaitAfterCloudConnected
-     * Next state: stateStartUpdate
+     * @brief The maximum size passed to the constructor, limited to 65535
      */
-    void stateWaitToUpdate();
+    size_t maxDataSize;
 
     /**
-     * @brief State handler to have the update method actually update settings
-     * 
-     * The startUpdate method of the update method is called in this state.
-     * 
-     * Previous state: stateWaitAfterCloudConnected or stateWaitToUpdate
-     * Next state: stateWaitUpdateComplete
+     * @brief Used instead of the allocated buffer if it could not be allocated in setup()
      */
-    void stateStartUpdate();
+    CloudConfigData<1> emptyBuffer;
+};
+
+#endif /* HAL_PLATFORM_FILESYSTEM */
 
+/**
+ * @brief Storage method that layers persisted overrides on top of default values
+ * 
+ * The defaults are typically a CloudConfigStorageStatic with values compiled into the firmware
+ * and the overrides are a retained, EEPROM, or file storage method that update methods write to. 
+ * The cloud then only needs to store and send the values that are different from the defaults.
+ * 
+ * getInt(), getBool(), getDouble(), getString(), copyString() and hasKey() for top level keys
+ * check the key index of the overrides, then the defaults, without merging the data. The 
+ * methods that return a JSONValue and nested paths use the overrides merged into the defaults
+ * as a JSON merge patch (RFC 7386), which is allocated on the heap the first time it's needed
+ * after each update. An override with a null value is treated as missing, so the default is used.
+ */
+class CloudConfigStorageLayered : public CloudConfigStorage {
+public:
     /**
-     * @brief Waits for updateData or updateDataFailed to be called
+     * @brief Constructor
      * 
-     * The update method starts the update process when startUpdate() is called. Then
-     * they either call CloudConfig::instance().updateData() or updateDataFailed().
+     * @param defaults The storage method for the default values, typically CloudConfigStorageStatic
      * 
-     * If neither is called before updateTimeoutMs expires (default: 60 seconds)
-     * an error is assume to have occurred and is treated as if the updateDataFailed.
+     * @param overrides The storage method for the overrides, which is updated by the update method.
      * 
-     * Previous state: stateStartUpdate
-     * Next state: stateWaitToUpdate
+     * You typically allocate one of these using new from setup() and pass it to withStorageMethod().
+     * Both layers are set up by this object's setup(); don't pass them to withStorageMethod().
      */
-    void stateWaitUpdateComplete();
+    CloudConfigStorageLayered(CloudConfigStorage *defaults, CloudConfigStorage *overrides) : defaults(defaults), overrides(overrides) {};
 
-protected:
     /**
-     * @brief Storage object - used to store data in retained memory, EEPROM, or flash file system file
+     * @brief Called during setup() to set up both layers
      */
-    CloudConfigStorage *storageMethod = 0;
+    virtual void setup();
 
     /**
-     * @brief Update object - used to request data from the cloud
+     * @brief Called from loop() to give both layers time
      */
-    CloudConfigUpdate *updateMethod = 0;
+    virtual void loop() { defaults->loop(); overrides->loop(); };
 
     /**
-     * @brief Callback to call when there is data
+     * @brief Called when the data in either layer changes
      * 
-     * This is called either at startup, if data is located from the storage method and is valid, or
-     * after data is updated from the cloud. For some storage methods like function or subscription, this
-     * can also be called spontaneously when the cloud-side sends new configuration data.
+     * Both layers keep their own key index, so this only discards the merged data.
      */
-    std::function<void(void)> dataCallback = 0;
+    virtual void parse();
 
     /**
-     * @brief How often to update the data from the cloud
-     * 
-     * Values > 0 are in seconds. There are also two special values: UPDATE_ONCE (0) and UPDATE_AT_RESTART (-1);
+     * @brief Gets the merged JSON data
      * 
-     * Normally you use the withUpdateFrequency() methods to set this.
+     * If only one layer has data, that layer's data is returned without merging.
      */
-    long updateFrequency = 0;
+    const char * const getJsonData() const;
 
     /**
-     * @brief Status of updateData. Used when in stateWaitUpdateComplete.
+     * @brief Returns true if either layer has data
+     */
+    virtual bool hasJsonData() const { return defaults->hasJsonData() || overrides->hasJsonData(); };
+
+    /**
+     * @brief Returns true if the overrides have data
      * 
-     * The updateData() and updateDataFailed() methods change this value.
+     * The defaults always have data, so only the overrides determine if an update is needed.
      */
-    UpdateDataStatus updateDataStatus = UpdateDataStatus::IDLE;
+    virtual bool hasUpdatedData() const { return overrides->hasUpdatedData(); };
 
     /**
-     * @brief State handler for the main state machine
+     * @brief Gets the header of the overrides, used for lastCheck and the hash of the overrides
      */
-    std::function<void(CloudConfig &)> stateHandler = 0;
+    virtual CloudConfigDataHeader *getDataHeader() { return overrides->getDataHeader(); };
+
+    // The CloudConfigPath overloads are not hidden by the key overrides below
+    using CloudConfigStorage::hasKey;
+    using CloudConfigStorage::getInt;
+    using CloudConfigStorage::getBool;
+    using CloudConfigStorage::getDouble;
+    using CloudConfigStorage::copyString;
 
     /**
-     * @brief Time value (millis) used in some states
+     * @brief Returns true if the key exists in either layer
      */
-    unsigned long stateTime = 0;
+    virtual bool hasKey(const char *key) { return getLayer(key)->hasKey(key); };
 
     /**
-     * @brief Singleton instance of this class
+     * @brief Returns true if the key has a null value in the defaults. A null in the overrides removes the key.
      */
-    static CloudConfig *_instance;
-};
+    virtual bool isNull(const char *key) { return getLayer(key)->isNull(key); };
 
-/**
- * @brief Storage method that doesn't use the cloud at all and instead has the configuration as a static string in code
- * 
- * This is mainly so you can use the same code base for cloud or local storage, swappable at compile time.
- * It's a bit of overkill for normal use.
- */
-class CloudConfigStorageStatic : public CloudConfigStorage {
-public:
     /**
-     * @brief Constructor
-     * 
-     * @param jsonData The JSON data to use as the configuration data (string constant)
+     * @brief Gets a top level int value from the overrides, or the defaults if not overridden
      */
-    CloudConfigStorageStatic(const char * const jsonData) : jsonData(jsonData) {};
+    virtual int getInt(const char *key) { return getLayer(key)->getInt(key); };
 
     /**
-     * @brief Called during setup() to parse the JSON data
+     * @brief Gets a top level bool value from the overrides, or the defaults if not overridden
      */
-    virtual void setup() { parse(); };
+    virtual bool getBool(const char *key) { return getLayer(key)->getBool(key); };
 
     /**
-     * @brief Return the static JSON data
+     * @brief Gets a top level double value from the overrides, or the defaults if not overridden
      */
-    const char * const getJsonData() const { return jsonData; };
+    virtual double getDouble(const char *key) { return getLayer(key)->getDouble(key); };
 
-protected:
     /**
-     * @brief The value passed to the constructor
+     * @brief Gets a top level string value from the overrides, or the defaults if not overridden
      */
-    const char * const jsonData;
-};
+    virtual const char *getString(const char *key) { return getLayer(key)->getString(key); };
 
-/**
- * @brief Storage method to store data in retained memory
- * 
- * Retained memory is preserved across restarts and across all sleep modes including HIBERNATE mode. There is around 3K of retained memory available.
- */
-class CloudConfigStorageRetained : public CloudConfigStorageData {
-public:
     /**
-     * @brief Construct a storage method for retained RAM. 
-     * 
-     * @param retainedData A pointer to the retained buffer, typically a CloudConfigData<> struct.
-     * 
-     * @param totalSize The size of the retained data including both the header and data. It's that way so you can use sizeof() easily.
-     * 
-     * You typically allocate one of these as a global variable or using new from setup(). 
-     * 
-     * You cannot delete or copy one of these objects.
+     * @brief Copies a top level value from the overrides, or the defaults if not overridden
      */
-    CloudConfigStorageRetained(void *retainedData, size_t totalSize) : CloudConfigStorageData((CloudConfigDataHeader *)retainedData, totalSize - sizeof(CloudConfigDataHeader)) {};
-    
+    virtual bool copyString(const char *key, char *buf, size_t bufSize) { return getLayer(key)->copyString(key, buf, bufSize); };
+
+    /**
+     * @brief Replaces the overrides with new data and saves them
+     */
+    virtual bool updateData(const char *json);
+
     /**
-     * @brief Called during setup() to validate and parse the JSON data
+     * @brief Replaces the overrides with new data, but does not save them
      */
-    virtual void setup() { validate(); };
+    virtual bool setData(const char *json);
 
     /**
-     * @brief Retained data doesn't require an explict save
+     * @brief Saves the overrides
      */
-    virtual bool save() { return true; };
-};
-
+    virtual bool saveData() { return overrides->saveData(); };
 
-/**
- * @brief Storage method to store data in the emulated EEPROM
- * 
- * This is a good choice for storing data on Gen 2 devices if you have available space in EEPROM. 
- * 
- * On Gen 3 devices (Argon, Boron, B  Series SoM, Tracker SoM) the file system is usually a better choice.
- * Since the emulated EEPROM is just a file on the file system on Gen 3, there is no performance
- * advantage for using EEPROM over File.
- * 
- * @param SIZE the templated maximum size of the JSON data. 
- * 
- * The getTotalSize() method of the parent class determines how many bytes of EEPROM are used; it's
- * the size of the CloudConfigDataHeader plus SIZE.
- */
-template<size_t SIZE>
-class CloudConfigStorageEEPROM : public CloudConfigStorageData {
-public:
     /**
-     * @brief Constructor for EEPROM storage
-     * 
-     * @param eepromOffset Starting offset in EEPROM to store the data. 
-     * 
-     * The getTotalSize() method of the parent class determines how many bytes of EEPROM are used; it's
-     * the size of the CloudConfigDataHeader plus SIZE.
+     * @brief Saves the header of the overrides
      */
-    CloudConfigStorageEEPROM(size_t eepromOffset) : CloudConfigStorageData(&dataBuffer.header, SIZE), eepromOffset(eepromOffset) {};
+    virtual bool saveHeader() { return overrides->saveHeader(); };
 
     /**
-     * @brief Called during setup() to load, validate, and parse the JSON data
+     * @brief Gets the number of bytes written by the last save of the overrides
      */
-    virtual void setup() { EEPROM.get(eepromOffset, dataBuffer); validate(); };
+    virtual size_t getLastSaveBytes() const { return overrides->getLastSaveBytes(); };
 
     /**
-     * @brief Called to save the data in EEPROM when it is updated
+     * @brief Gets the maximum data size of the overrides, which is where updates are stored
      */
-    virtual bool save() { EEPROM.put(eepromOffset, dataBuffer); return true; };
+    virtual size_t getMaxDataSize() const { return overrides->getMaxDataSize(); };
 
-protected:
     /**
-     * @brief Offset into the emulated EEPROM to start storing the data.
+     * @brief Returns true if json is the same as the overrides
      */
-    size_t eepromOffset;
+    virtual bool isSameData(const char *json) { return overrides->isSameData(json); };
 
+protected:
     /**
-     * @brief Copy of the EEPROM data in RAM
+     * @brief Destructor
      */
-    CloudConfigData<SIZE> dataBuffer;
-};
-
-#if HAL_PLATFORM_FILESYSTEM
-#include <fcntl.h>
-#include <sys/stat.h>
+    virtual ~CloudConfigStorageLayered() { delete[] mergedJson; };
 
-/**
- * @brief Storage method to store data in the flash file system
- * 
- * On Gen 3 devices (Argon, Boron, B  Series SoM, Tracker SoM) the file system is usually a good choice.
- * Since the emulated EEPROM is just a file on the file system on Gen 3, there is no performance
- * advantage for using EEPROM over File.
- * 
- * The file system is 2 MB on most devices, 4 MB on the Tracker.
- * 
- * @param SIZE the templated maximum size of the JSON data. 
- * 
- * You need for SIZE to be larger enough for the largest configuration you will have, but it does
- * reserve sizeof(CloudConfigDataHeader) + SIZE bytes of RAM, so you don't want it be excessively
- * large. For function, subscription and webhook update methods, SIZE can't be larger than 622 bytes.
- */
-template<size_t SIZE>
-class CloudConfigStorageFile : public CloudConfigStorageData {
-public:
     /**
-     * @brief Constructor for storage of data in a flash file system file
+     * @brief Returns the layer to read key from: overrides if it has the key, otherwise defaults
      * 
-     * @param path The pathname (slash separated, like Unix) to the file to store the data in. 
+     * A null value in the overrides removes the key, the same as the merge patch, so the defaults are used.
      */
-    CloudConfigStorageFile(const char *path) : path(path), CloudConfigStorageData(&dataBuffer.header, SIZE) {};
+    CloudConfigStorage *getLayer(const char *key) { return (overrides->hasKey(key) && !overrides->isNull(key)) ? overrides : defaults; };
 
     /**
-     * @brief Called during setup() to load, validate, and parse the JSON data
+     * @brief Merges the overrides into the defaults, saving the result in mergedJson
      */
-    virtual void setup() {
-        int fd = open(path, O_RDWR | O_CREAT);
-        if (fd != -1) {
-            int count = read(fd, &dataBuffer, sizeof(dataBuffer));
-            if (count != sizeof(dataBuffer)) {
-                Log.info("resetting file contents");
-
-                // File contents do not appear to be valid; do not use
-                memset(&dataBuffer, 0, sizeof(dataBuffer));
-            }
-            close(fd);   
-        }
-        validate();
-    }
+    void buildMergedJson() const;
 
     /**
-     * @brief Called to save the data to the file when it is updated
+     * @brief Default values, passed to the constructor
      */
-    virtual bool save() {
-        // Save to file
-        Log.info("save to file");
-        int fd = open(path, O_RDWR | O_CREAT);
-        if (fd != -1) {
-            write(fd, &dataBuffer, sizeof(dataBuffer));
-            close(fd);   
-            Log.info("save to file done");
-        }
-        return true;
-    }
+    CloudConfigStorage *defaults;
 
-protected:
     /**
-     * @brief The file system path passed to the contructor
+     * @brief Overrides, passed to the constructor
      */
-    String path;
+    CloudConfigStorage *overrides;
 
     /**
-     * @brief Copy of the file data in RAM
+     * @brief Merged data allocated with new, or NULL if not used or not built yet since the last parse()
      */
-    CloudConfigData<SIZE> dataBuffer;
+    mutable char *mergedJson = 0;
 };
-#endif /* HAL_PLATFORM_FILESYSTEM */
 
 /**
  * @brief Update configuration via Particle function call
@@ -1054,16 +4457,39 @@ public:
      */
     virtual void setup();
 
+    /**
+     * @brief Method to set the name of a Particle.function to register for merge patch updates
+     * 
+     * @param patchName The name of the function to register
+     * 
+     * This must be called before setup(). Calling it later will have no effect. The parameter to 
+     * this function is a JSON merge patch (RFC 7386) that is applied to the existing data, so you
+     * only need to send the keys that changed. Keys set to null in the patch are removed.
+     */
+    CloudConfigUpdateFunction &withPatchName(const char *patchName) { this->patchName = patchName; return *this; };
+
     /**
      * @brief Function that is called when the Particle.function is called.
      */
     int functionHandler(String param);
 
+    /**
+     * @brief Function that is called when the merge patch Particle.function is called.
+     * 
+     * @return 0 on success or -1 if the patch could not be applied
+     */
+    int patchFunctionHandler(String param);
+
 protected:
     /**
      * @brief Function name passed to constructor or withName. Used during setup().
      */
     String name;
+
+    /**
+     * @brief Merge patch function name passed to withPatchName(). Used during setup().
+     */
+    String patchName;
 };
 
 /**
@@ -1101,6 +4527,22 @@ public:
      */
     CloudConfigUpdateSubscription &withEventName(const char *eventName) { this->eventName = eventName; return *this; };
 
+    /**
+     * @brief Method to set the event name to subscribe to for merge patch updates
+     * 
+     * @param patchEventName The name of the event to subscribe to
+     * 
+     * This must be called before setup(). Calling it later will have no effect. The event data 
+     * is a JSON merge patch (RFC 7386) that is applied to the existing data, so you only need to 
+     * send the keys that changed. Keys set to null in the patch are removed.
+     * 
+     * Only events named exactly patchEventName are patches. patchEventName can begin with eventName 
+     * (for example, "config" and "config-patch"); those events are not treated as full updates.
+     * Other events that begin with patchEventName, such as "config-patch2", are not treated as patches,
+     * but are full updates if they begin with eventName, as subscriptions are a prefix match.
+     */
+    CloudConfigUpdateSubscription &withPatchEventName(const char *patchEventName) { this->patchEventName = patchEventName; return *this; };
+
     /**
      * @brief Called during setup()
      * 
@@ -1110,14 +4552,26 @@ public:
 
     /**
      * @brief Handler called when the event is received
+     * 
+     * This is virtual so subclasses like CloudConfigUpdateWebhook can process the event differently.
      */
-    void subscriptionHandler(const char *eventName, const char *eventData);
+    virtual void subscriptionHandler(const char *eventName, const char *eventData);
+
+    /**
+     * @brief Handler called when the merge patch event is received. Ignores events that only begin with patchEventName.
+     */
+    void patchSubscriptionHandler(const char *eventName, const char *eventData);
 
 protected:
     /**
      * @brief Subscribed event name passed to constructor or withEventName. Used during setup().
      */
     String eventName;
+
+    /**
+     * @brief Merge patch event name passed to withPatchEventName(). Used during setup().
+     */
+    String patchEventName;
 };
 
 /**
@@ -1157,20 +4611,289 @@ public:
      */
     CloudConfigUpdateWebhook &withEventName(const char *eventName);
 
+    /**
+     * @brief Sets the size of each part of a multi-part webhook response
+     * 
+     * @param partSize The part size in bytes. Default: 512.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * Webhook responses larger than this are split into multiple events, hook-response/<event>/0,
+     * hook-response/<event>/1, ... Every part except the last is exactly partSize bytes. You only
+     * need to change this if the cloud changes the size it splits responses at.
+     */
+    CloudConfigUpdateWebhook &withPartSize(size_t partSize) { this->partSize = partSize; return *this; };
+
+    /**
+     * @brief Sets whether the request includes the hash of the data currently stored
+     * 
+     * @param value true to publish {"hash":"<8 hex digits>"} with the request (the default if the parameter 
+     * is omitted), false to publish an empty payload. If this method is not called, an empty payload is published.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * The hash is the CRC-32 of the JSON data, the same as dataHash in CloudConfigDataHeader. If
+     * it matches the current configuration, the server can send the not modified response (see
+     * withNotModifiedResponse()) instead of the whole configuration. No hash is sent if there is
+     * no data yet.
+     * 
+     * This is off by default because it changes the request event data that existing webhooks
+     * receive. Only enable it if your webhook and server handle the hash.
+     */
+    CloudConfigUpdateWebhook &withConditionalRequest(bool value = true) { this->conditionalRequest = value; return *this; };
+
+    /**
+     * @brief Sets the webhook response that means the data has not changed
+     * 
+     * @param response The response. Must be a string constant; the pointer is saved. Default: "304".
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * When this response is received, lastCheck is updated and the update completes successfully
+     * without replacing the data or calling the data callback.
+     */
+    CloudConfigUpdateWebhook &withNotModifiedResponse(const char *response) { this->notModifiedResponse = response; return *this; };
+
+    /**
+     * @brief Called during loop() to discard incomplete multi-part responses after updateTimeoutMs
+     */
+    virtual void loop();
+
     /**
      * @brief Called when a JSON data update is requested
      */
     virtual void startUpdate();
 
+    /**
+     * @brief Handler called when each part of the webhook response is received
+     * 
+     * The parts are reassembled, in any order, and the data is only passed to CloudConfig::updateData()
+     * when all of the parts have been received.
+     * 
+     * The parts are collected in a separate buffer, not the storage buffer, so the current data stays
+     * valid until the new data is complete, and so encoded data can be decoded. The buffer is limited 
+     * to what can be stored, CloudConfig::getMaxDataSize(), plus the base64 overhead if encoded. A 
+     * response that is larger fails instead of allocating up to MAX_PARTS parts.
+     */
+    virtual void subscriptionHandler(const char *eventName, const char *eventData);
+
+    /**
+     * @brief Maximum number of parts in a multi-part response
+     */
+    static const size_t MAX_PARTS = 32;
+
 protected:
+    /**
+     * @brief Discards any partially received multi-part response
+     */
+    void clearParts();
+
+    /**
+     * @brief Returns true if data is complete JSON data, or encoded data that decodes to complete JSON data
+     */
+    bool isCompleteData(const char *data) const;
+
+    /**
+     * @brief Gets the largest response that is accepted, in bytes, or 0 if not limited
+     */
+    size_t getMaxResponseLen() const;
+
     /**
      * @brief Event name passed to constructor or withEventName. Used during setup().
      * 
      * This is not the hook-response event name!
      */
     String requestEventName;
+
+    /**
+     * @brief Whether to publish the hash of the current data with the request, set using withConditionalRequest()
+     */
+    bool conditionalRequest = false;
+
+    /**
+     * @brief Response that means the data has not changed, set using withNotModifiedResponse()
+     */
+    const char *notModifiedResponse = "304";
+
+    /**
+     * @brief Size of each part of a multi-part response, set using withPartSize()
+     */
+    size_t partSize = 512;
+
+    /**
+     * @brief Buffer used to reassemble a multi-part response, allocated using malloc. Only used when there is more than one part.
+     */
+    char *partsBuf = 0;
+
+    /**
+     * @brief Allocated size of parts in bytes
+     */
+    size_t partsBufSize = 0;
+
+    /**
+     * @brief Bit mask of the parts that have been received (bit 0 = part 0)
+     */
+    uint32_t partsReceived = 0;
+
+    /**
+     * @brief Total length of the data, known once the last (short) part has been received. 0 if not known yet.
+     */
+    size_t partsTotalLen = 0;
+
+    /**
+     * @brief millis() value when the first part of the current response was received
+     */
+    unsigned long partsStartMs = 0;
+};
+
+/**
+ * @brief Update configuration from a webhook when a change notification is received
+ * 
+ * Instead of polling the webhook, the device subscribes to a small notification event that
+ * is published when the configuration changes. The event data is the new version, for example
+ * "42". If it's different from the value of the version key (default: "version") in the stored
+ * data, the webhook is requested, the same as CloudConfigUpdateWebhook. 
+ * 
+ * Notifications are coalesced: the request is only made after no notifications have been 
+ * received for the debounce time, so a burst of changes results in a single request.
+ * 
+ * You will typically combine this with withUpdateFrequencyOnce() or a long update frequency
+ * as a backup in case a notification is missed while the device was offline.
+ */
+class CloudConfigUpdateNotify : public CloudConfigUpdateWebhook {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param eventName The name of the event of the webhook
+     * 
+     * @param notifyEventName The name of the change notification event to subscribe to
+     */
+    CloudConfigUpdateNotify(const char *eventName, const char *notifyEventName) : CloudConfigUpdateWebhook(eventName), notifyEventName(notifyEventName) {};
+
+    /**
+     * @brief Sets the key in the configuration data that contains the version
+     * 
+     * @param versionKey The top-level key. Must be a string constant; the pointer is saved. Default: "version".
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * The value, string or number, is compared with the notification event data. If versionKey
+     * is NULL, the notification is compared with the hash of the data instead, as 8 lowercase hex
+     * digits, the same as the hash sent by withConditionalRequest().
+     */
+    CloudConfigUpdateNotify &withVersionKey(const char *versionKey) { this->versionKey = versionKey; return *this; };
+
+    /**
+     * @brief Sets how long to wait after the last notification before requesting the data
+     * 
+     * @param debounceMs Time in milliseconds. Default: 10000 (10 seconds).
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     * 
+     * Each notification restarts the wait.
+     */
+    CloudConfigUpdateNotify &withDebounce(unsigned long debounceMs) { this->debounceMs = debounceMs; return *this; };
+
+    /**
+     * @brief Sets how long to wait after the last notification before requesting the data, as a chrono literal
+     * 
+     * @param chronoLiteral The time, for example 10s.
+     * 
+     * @return Returns *this so you can chain calls, fluent-style.
+     */
+    CloudConfigUpdateNotify &withDebounce(std::chrono::milliseconds chronoLiteral) { return withDebounce((unsigned long)chronoLiteral.count()); };
+
+    /**
+     * @brief Called during setup() to subscribe to the webhook response and notification events
+     */
+    virtual void setup();
+
+    /**
+     * @brief Called during loop() to request the data once the debounce time has passed
+     */
+    virtual void loop();
+
+    /**
+     * @brief Handler called when the notification event is received
+     */
+    void notifyHandler(const char *eventName, const char *eventData);
+
+    /**
+     * @brief Returns true if version is the same as the version of the stored data
+     */
+    bool isCurrentVersion(const char *version);
+
+protected:
+    /**
+     * @brief Notification event name passed to the constructor
+     */
+    String notifyEventName;
+
+    /**
+     * @brief Key containing the version, set using withVersionKey()
+     */
+    const char *versionKey = "version";
+
+    /**
+     * @brief Debounce time in milliseconds, set using withDebounce()
+     */
+    unsigned long debounceMs = 10000;
+
+    /**
+     * @brief Version from the most recent notification that has not been requested yet
+     */
+    String pendingVersion;
+
+    /**
+     * @brief true if a notification was received and the data has not been requested yet
+     */
+    bool notifyPending = false;
+
+    /**
+     * @brief millis() value when the most recent notification was received
+     */
+    unsigned long notifyMs = 0;
 };
 
+/**
+ * @brief Routes events to named CloudConfig instances using a single subscription
+ * 
+ * Events named `<eventName>/<instance name>` contain the data for the named instance, which 
+ * can be JSON or encoded (see CloudConfigPayload). Events named `<eventName>/<instance name>/patch`
+ * contain a JSON merge patch. For example, with the event name "config", the event
+ * "config/tuning" updates CloudConfig::instance("tuning"). Events for instances that don't
+ * exist are ignored.
+ * 
+ * This is separate from each instance's update method, so instances can also have their own
+ * update method to request data, or none if the data is only pushed.
+ */
+class CloudConfigDispatcher {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param eventName The event name prefix to subscribe to. Must be a string constant; the pointer is saved.
+     * 
+     * You typically allocate one of these as a global variable.
+     */
+    CloudConfigDispatcher(const char *eventName) : eventName(eventName) {};
+
+    /**
+     * @brief Subscribes to the events. Call from setup().
+     */
+    void setup();
+
+    /**
+     * @brief Handler called when an event is received
+     */
+    void subscriptionHandler(const char *eventName, const char *eventData);
 
+protected:
+    /**
+     * @brief The event name prefix passed to the constructor
+     */
+    const char *eventName;
+};
 
 #endif /* __CLOUDCONFIGRK_H */
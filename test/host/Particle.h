@@ -0,0 +1,299 @@
+// Host mock of the parts of the Device OS API used by CloudConfigRK
+//
+// This is used to build the library and the 09-benchmark example on a computer, see the Makefile
+// in this directory. It implements JSONValue (parsing, iterators, and JSONWriter), EEPROM, 
+// Particle.subscribe/publish/function/variable, Log, millis(), and Time. File I/O uses the 
+// POSIX functions of the computer, but paths are relative to the mockfs directory so the file
+// storage methods can be used without writing to /usr.
+//
+// It is not a complete or exact implementation: the JSON parser only handles valid JSON and
+// the cloud functions do nothing except log publishes.
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <sys/stat.h>
+
+#define HAL_PLATFORM_FILESYSTEM 1
+#define retained
+#define PLATFORM_ID 12
+
+using namespace std::chrono_literals;
+
+class String {
+public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    const char *c_str() const { return s.c_str(); }
+    operator const char *() const { return s.c_str(); }
+    size_t length() const { return s.size(); }
+    static String format(const char *fmt, ...) { char buf[1024]; va_list ap; va_start(ap, fmt); vsnprintf(buf, sizeof(buf), fmt, ap); va_end(ap); return String(buf); }
+    bool operator==(const char *o) const { return s == o; }
+    String &operator+=(const char *o) { s += o; return *this; }
+    std::string s;
+};
+
+// Log messages go to stderr, so the results a program prints to stdout are not mixed with the 
+// library log. Set mockLogEnabled to false to discard them.
+extern bool mockLogEnabled;
+struct Logger {
+    void vlog(const char *fmt, va_list ap) { if (mockLogEnabled) { vfprintf(stderr, fmt, ap); fprintf(stderr, "\n"); } }
+    void info(const char *fmt, ...) { va_list ap; va_start(ap, fmt); vlog(fmt, ap); va_end(ap); }
+    void trace(const char *fmt, ...) { va_list ap; va_start(ap, fmt); vlog(fmt, ap); va_end(ap); }
+    void warn(const char *fmt, ...) { va_list ap; va_start(ap, fmt); vlog(fmt, ap); va_end(ap); }
+    void error(const char *fmt, ...) { va_list ap; va_start(ap, fmt); vlog(fmt, ap); va_end(ap); }
+};
+extern Logger Log;
+
+unsigned long millis();
+unsigned long micros();
+uint32_t HAL_RNG_GetRandomNumber();
+
+enum PublishFlag { PUBLIC, PRIVATE, NO_ACK, WITH_ACK };
+
+// Particle.connected() returns this, so tests can simulate waiting for the cloud. true by default.
+extern bool mockCloudConnected;
+
+struct ParticleClass {
+    template<class T> bool function(const char *, int (T::*)(String), T *) { return true; }
+    template<class T> bool subscribe(const char *, void (T::*)(const char *, const char *), T *) { return true; }
+    bool subscribe(const char *, void (*)(const char *, const char *)) { return true; }
+    bool publish(const char *name, const char *data) { Log.info("publish %s %s", name, data); return true; }
+    bool publish(const char *name, const char *data, PublishFlag) { return publish(name, data); }
+    bool variable(const char *, const char *) { return true; }
+    bool variable(const char *, std::function<String()>) { return true; }
+    template<class T> bool variable(const char *, String (T::*)() const, T *) { return true; }
+    bool connected() { return mockCloudConnected; }
+};
+extern ParticleClass Particle;
+
+// freeMemory() is a nominal heap size minus the bytes currently allocated using new, so the
+// difference between two calls is the heap used
+// new fails when mockHeapUsed would be larger than mockHeapLimit, to test allocation failures. 0 for no limit.
+// mockHeapUsed is atomic as snapshots can be read from other threads.
+extern std::atomic<size_t> mockHeapUsed;
+extern size_t mockHeapLimit;
+struct SystemClass { String deviceID() { return String("0123456789abcdef01234567"); } uint32_t freeMemory() { return (uint32_t)(16 * 1024 * 1024 - mockHeapUsed); } };
+extern SystemClass System;
+
+// Added to Time.now() and millis() so tests can advance the clock
+extern long mockTimeAdd; extern unsigned long mockMillisAdd;
+struct TimeClass { bool isValid() { return true; } time_t now() { return ::time(0) + mockTimeAdd; } };
+extern TimeClass Time;
+
+struct EEPROMClass {
+    uint8_t mem[4096];
+    bool writeFails = false; // HAL_EEPROM_Put() does not write, to test write failures
+    template<class T> T &get(int idx, T &t) { memcpy(&t, &mem[idx], sizeof(T)); return t; }
+    template<class T> const T &put(int idx, const T &t) { memcpy(&mem[idx], &t, sizeof(T)); return t; }
+    uint8_t read(int idx) { return mem[idx]; }
+    void write(int idx, uint8_t v) { mem[idx] = v; }
+    void update(int idx, uint8_t v) { mem[idx] = v; }
+    size_t length() { return sizeof(mem); }
+};
+extern EEPROMClass EEPROM;
+
+
+//
+// JSON
+//
+enum JSONType { JSON_TYPE_INVALID, JSON_TYPE_NULL, JSON_TYPE_BOOL, JSON_TYPE_NUMBER, JSON_TYPE_STRING, JSON_TYPE_ARRAY, JSON_TYPE_OBJECT };
+
+struct JSONNode {
+    JSONType type = JSON_TYPE_INVALID;
+    std::string text;
+    std::vector<std::pair<std::string, std::shared_ptr<JSONNode>>> children;
+};
+
+class JSONString {
+public:
+    JSONString() {}
+    JSONString(const std::string *s) : p(s) {}
+    const char *data() const { return p ? p->c_str() : ""; }
+    size_t size() const { return p ? p->size() : 0; }
+    bool isEmpty() const { return size() == 0; }
+    operator const char *() const { return data(); }
+    bool operator==(const char *o) const { return strcmp(data(), o) == 0; }
+    const std::string *p = 0;
+};
+
+class JSONValue {
+public:
+    JSONValue() {}
+    JSONValue(std::shared_ptr<JSONNode> n) : n(n) {}
+    JSONType type() const { return n ? n->type : JSON_TYPE_INVALID; }
+    bool isValid() const { return type() != JSON_TYPE_INVALID; }
+    bool isNull() const { return type() == JSON_TYPE_NULL; }
+    bool isBool() const { return type() == JSON_TYPE_BOOL; }
+    bool isNumber() const { return type() == JSON_TYPE_NUMBER; }
+    bool isString() const { return type() == JSON_TYPE_STRING; }
+    bool isArray() const { return type() == JSON_TYPE_ARRAY; }
+    bool isObject() const { return type() == JSON_TYPE_OBJECT; }
+    bool toBool() const { if (!n) return false; if (n->type == JSON_TYPE_BOOL || n->text == "true") return n->text == "true"; return atof(n->text.c_str()) != 0; }
+    int toInt() const { if (!n) return 0; if (n->type == JSON_TYPE_BOOL) return n->text == "true"; return (int)strtol(n->text.c_str(), 0, 10); }
+    double toDouble() const { if (!n) return 0; return strtod(n->text.c_str(), 0); }
+    JSONString toString() const { if (!n || n->type == JSON_TYPE_ARRAY || n->type == JSON_TYPE_OBJECT) return JSONString(); return JSONString(&n->text); }
+    static JSONValue parseCopy(const char *json) { return parseCopy(json, strlen(json)); }
+    static JSONValue parseCopy(const char *json, size_t size) { const char *p = json, *e = json + size; auto r = parseNode(p, e); return r ? JSONValue(r) : JSONValue(); }
+    static JSONValue parse(char *json, size_t size) { return parseCopy(json, size); }
+    std::shared_ptr<JSONNode> n;
+private:
+    static void ws(const char *&p, const char *e) { while (p < e && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r')) p++; }
+    static bool str(const char *&p, const char *e, std::string &out) {
+        if (p >= e || *p != '"') return false;
+        p++;
+        while (p < e && *p != '"') {
+            if (*p != '\\') { out += *p++; continue; }
+            if (++p >= e) return false;
+            char c = *p++;
+            if (c == 'u') {
+                // \uXXXX to UTF-8. Surrogate pairs are not supported.
+                if (e - p < 4) return false;
+                unsigned cp = (unsigned)strtoul(std::string(p, 4).c_str(), 0, 16);
+                p += 4;
+                if (cp < 0x80) { out += (char)cp; }
+                else if (cp < 0x800) { out += (char)(0xc0 | (cp >> 6)); out += (char)(0x80 | (cp & 0x3f)); }
+                else { out += (char)(0xe0 | (cp >> 12)); out += (char)(0x80 | ((cp >> 6) & 0x3f)); out += (char)(0x80 | (cp & 0x3f)); }
+                continue;
+            }
+            out += (c == 'n') ? '\n' : (c == 't') ? '\t' : (c == 'r') ? '\r' : (c == 'b') ? '\b' : (c == 'f') ? '\f' : c;
+        }
+        if (p >= e) return false;
+        p++;
+        return true;
+    }
+    static std::shared_ptr<JSONNode> parseNode(const char *&p, const char *e) {
+        ws(p, e);
+        if (p >= e) return 0;
+        auto node = std::make_shared<JSONNode>();
+        if (*p == '{') {
+            node->type = JSON_TYPE_OBJECT; p++; ws(p, e);
+            if (p < e && *p == '}') { p++; return node; }
+            while (true) {
+                ws(p, e);
+                std::string k;
+                if (!str(p, e, k)) return 0;
+                ws(p, e);
+                if (p >= e || *p != ':') return 0;
+                p++;
+                auto v = parseNode(p, e);
+                if (!v) return 0;
+                node->children.push_back({k, v});
+                ws(p, e);
+                if (p < e && *p == ',') { p++; continue; }
+                if (p < e && *p == '}') { p++; return node; }
+                return 0;
+            }
+        }
+        if (*p == '[') {
+            node->type = JSON_TYPE_ARRAY; p++; ws(p, e);
+            if (p < e && *p == ']') { p++; return node; }
+            while (true) {
+                auto v = parseNode(p, e);
+                if (!v) return 0;
+                node->children.push_back({"", v});
+                ws(p, e);
+                if (p < e && *p == ',') { p++; continue; }
+                if (p < e && *p == ']') { p++; return node; }
+                return 0;
+            }
+        }
+        if (*p == '"') { node->type = JSON_TYPE_STRING; if (!str(p, e, node->text)) return 0; return node; }
+        const char *s = p;
+        while (p < e && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n') p++;
+        node->text.assign(s, p - s);
+        if (node->text == "true" || node->text == "false") node->type = JSON_TYPE_BOOL;
+        else if (node->text == "null") node->type = JSON_TYPE_NULL;
+        else node->type = JSON_TYPE_NUMBER;
+        return node;
+    }
+};
+
+class JSONObjectIterator {
+public:
+    JSONObjectIterator() {}
+    JSONObjectIterator(const JSONValue &v) : v(v) { if (!v.isObject()) this->v = JSONValue(); }
+    bool next() { if (!v.n) return false; if (idx + 1 >= (int)v.n->children.size()) return false; idx++; return true; }
+    JSONString name() const { return JSONString(&v.n->children[idx].first); }
+    JSONValue value() const { return JSONValue(v.n->children[idx].second); }
+    size_t count() const { return v.n ? v.n->children.size() : 0; }
+    JSONValue v; int idx = -1;
+};
+class JSONArrayIterator {
+public:
+    JSONArrayIterator() {}
+    JSONArrayIterator(const JSONValue &v) : v(v) { if (!v.isArray()) this->v = JSONValue(); }
+    bool next() { if (!v.n) return false; if (idx + 1 >= (int)v.n->children.size()) return false; idx++; return true; }
+    JSONValue value() const { return JSONValue(v.n->children[idx].second); }
+    size_t count() const { return v.n ? v.n->children.size() : 0; }
+    JSONValue v; int idx = -1;
+};
+
+class JSONWriter {
+public:
+    JSONWriter &beginArray() { sep(); w("["); first = true; return *this; }
+    JSONWriter &endArray() { w("]"); first = false; return *this; }
+    JSONWriter &beginObject() { sep(); w("{"); first = true; return *this; }
+    JSONWriter &endObject() { w("}"); first = false; return *this; }
+    JSONWriter &name(const char *n) { sep(); w("\""); w(n); w("\":"); first = true; return *this; }
+    JSONWriter &value(bool v) { sep(); w(v ? "true" : "false"); return *this; }
+    JSONWriter &value(int v) { char b[32]; snprintf(b, sizeof(b), "%d", v); sep(); w(b); return *this; }
+    JSONWriter &value(unsigned v) { char b[32]; snprintf(b, sizeof(b), "%u", v); sep(); w(b); return *this; }
+    JSONWriter &value(long v) { char b[32]; snprintf(b, sizeof(b), "%ld", v); sep(); w(b); return *this; }
+    JSONWriter &value(unsigned long v) { char b[32]; snprintf(b, sizeof(b), "%lu", v); sep(); w(b); return *this; }
+    JSONWriter &value(double v) { char b[32]; snprintf(b, sizeof(b), "%g", v); sep(); w(b); return *this; }
+    JSONWriter &value(const char *v) { sep(); w("\""); w(v); w("\""); return *this; }
+    JSONWriter &nullValue() { sep(); w("null"); return *this; }
+    virtual void write(const char *data, size_t size) = 0;
+protected:
+    void sep() { if (!first) w(","); first = false; }
+    void w(const char *s) { write(s, strlen(s)); }
+    bool first = true;
+};
+class JSONBufferWriter : public JSONWriter {
+public:
+    JSONBufferWriter(char *buf, size_t size) : buf(buf), size(size) {}
+    virtual void write(const char *data, size_t n) { for (size_t i = 0; i < n; i++) { if (len < size) buf[len] = data[i]; len++; } }
+    char *buffer() const { return buf; }
+    size_t bufferSize() const { return size; }
+    size_t dataSize() const { return len; }
+    char *buf; size_t size; size_t len = 0;
+};
+inline void HAL_EEPROM_Put(uint32_t index, const void *data, size_t length) { if (!EEPROM.writeFails) memcpy(&EEPROM.mem[index], data, length); }
+inline void HAL_EEPROM_Get(uint32_t index, void *data, size_t length) { memcpy(data, &EEPROM.mem[index], length); }
+
+//
+// POSIX file I/O, relative to the mockfs directory
+//
+int mockOpen(const char *path, int flags, ...);
+int mockRename(const char *from, const char *to);
+int mockUnlink(const char *path);
+#ifndef MOCK_NO_POSIX_MACROS
+#define open mockOpen
+#define rename mockRename
+#define unlink mockUnlink
+#endif
+
+//
+// Used by the examples
+//
+struct SerialLogHandler { };
+struct SerialClass { static bool isConnected() { return true; } };
+extern SerialClass Serial;
+#define SYSTEM_THREAD(x)
+#define waitFor(a, b)
+inline void delay(int) {}
@@ -0,0 +1,112 @@
+// Globals and functions declared in the host mock Particle.h
+
+#define MOCK_NO_POSIX_MACROS
+#include "Particle.h"
+#include <time.h>
+#include <sys/time.h>
+#include <cstddef>
+
+Logger Log; 
+ParticleClass Particle; 
+SystemClass System; 
+TimeClass Time; 
+EEPROMClass EEPROM;
+SerialClass Serial;
+
+unsigned long mockMillisAdd = 0; 
+long mockTimeAdd = 0;
+std::atomic<size_t> mockHeapUsed(0);
+size_t mockHeapLimit = 0;
+bool mockCloudConnected = true;
+bool mockLogEnabled = true;
+
+unsigned long millis() { 
+    struct timeval tv; 
+    gettimeofday(&tv, 0); 
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000 + mockMillisAdd; 
+}
+
+unsigned long micros() { 
+    struct timeval tv; 
+    gettimeofday(&tv, 0); 
+    return tv.tv_sec * 1000000 + tv.tv_usec; 
+}
+
+uint32_t HAL_RNG_GetRandomNumber() { 
+    return rand(); 
+}
+
+//
+// Heap usage. The size is stored before each block so delete can subtract it.
+//
+static const size_t HEAP_HEADER_SIZE = alignof(std::max_align_t);
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    if (mockHeapLimit && mockHeapUsed + size > mockHeapLimit) {
+        return NULL;
+    }
+    char *p = (char *)malloc(size + HEAP_HEADER_SIZE);
+    if (!p) {
+        return NULL;
+    }
+    memcpy(p, &size, sizeof(size));
+    mockHeapUsed += size;
+    return p + HEAP_HEADER_SIZE;
+}
+
+void *operator new(size_t size) {
+    void *p = operator new(size, std::nothrow);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return operator new(size, std::nothrow); }
+
+void operator delete(void *ptr) noexcept {
+    if (ptr) {
+        char *p = (char *)ptr - HEAP_HEADER_SIZE;
+        size_t size;
+        memcpy(&size, p, sizeof(size));
+        mockHeapUsed -= size;
+        free(p);
+    }
+}
+
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+//
+// POSIX file I/O
+//
+static std::string mockPath(const char *path) {
+    std::string result = "mockfs";
+    if (path[0] != '/') {
+        result += "/";
+    }
+    result += path;
+
+    // Create the parent directories
+    for(size_t ii = 1; ii < result.size(); ii++) {
+        if (result[ii] == '/') {
+            mkdir(result.substr(0, ii).c_str(), 0755);
+        }
+    }
+    return result;
+}
+
+int mockOpen(const char *path, int flags, ...) {
+    // Device OS does not require a mode when creating a file
+    return open(mockPath(path).c_str(), flags, 0644);
+}
+
+int mockRename(const char *from, const char *to) {
+    return rename(mockPath(from).c_str(), mockPath(to).c_str());
+}
+
+int mockUnlink(const char *path) {
+    return unlink(mockPath(path).c_str());
+}
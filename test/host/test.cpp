@@ -0,0 +1,499 @@
+// Behavior checks for the library, run on a computer using the host mock Particle.h
+//
+// Each check that fails prints its file, line, and condition, and the program exits with 1 if any
+// check failed. Run with -v to show the library log.
+
+#include "CloudConfigRK.h"
+
+#include <string>
+
+static int numChecks = 0;
+static int numFailures = 0;
+
+#define CHECK(cond) do { \
+        numChecks++; \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            numFailures++; \
+        } \
+    } while(0)
+
+// Exposes protected methods used by the checks
+struct TestStorage : public CloudConfigStorage {
+    static size_t jsonToBinary(const char *json, char *buf, size_t bufSize) { return CloudConfigStorage::jsonToBinary(json, buf, bufSize); }
+    static size_t isValidBinary(const char *data, size_t len) { return CloudConfigStorage::isValidBinary(data, len); }
+};
+
+struct TestField : public CloudConfigField<int> {
+    TestField() : CloudConfigField<int>("t", 0) {}
+    template<class T> static bool getValid(const char *json, T &result) { return getValidValue(JSONValue::parseCopy(json), result); }
+};
+
+struct TestUpdate : public CloudConfigUpdate {
+    int starts = 0;
+    virtual void startUpdate() { starts++; }
+};
+
+struct TestWebhook : public CloudConfigUpdateWebhook {
+    TestWebhook() : CloudConfigUpdateWebhook("test") { withPartSize(8); }
+    size_t getPartsBufSize() const { return partsBufSize; }
+};
+
+//
+// Payload encoding
+//
+static void payloadTests() {
+    struct { const char *encoded; const char *json; } cases[] = {
+        { "b:eyJhIjo3N30=", "{\"a\":77}" },
+        // zlib stored block
+        { "z:eAEBCAD3/3siYSI6Nzd9CjYCRg==", "{\"a\":77}" },
+        // zlib fixed Huffman block
+        { "z:eNqrVkpUsjI3rwUACjYCRg==", "{\"a\":77}" },
+    };
+    for(auto &c : cases) {
+        char *json = CloudConfigPayload::decode(c.encoded);
+        CHECK(json && strcmp(json, c.json) == 0);
+        free(json);
+    }
+
+    // zlib dynamic Huffman block of {"key0":0,"key1":7,...,"key39":273}
+    std::string expected = "{";
+    for(int ii = 0; ii < 40; ii++) {
+        expected += String::format("%s\"key%d\":%d", ii ? "," : "", ii, ii * 7).c_str();
+    }
+    expected += "}";
+    const char *dynamic = "z:eNot0LuNQ0EMQ9FeFDsYUvPvx5ErMBbbuyXxZTfSgfhnn/e32W2vDNhdFbSLXuV2iaoetauGXR9V025n1Yo6VdvumFXH7nQdDmI9RiJSEMwWg3COHAR0BCEkNFEICxCGlS0O4YECESJcJFv+IJPIfl7L34ZUhooplj1bLtNdcpnulst0t1yme+QyXDa53nIxuY5suR4u+Yyaq7pcz11drofLLtfD5ZDrK1uuh8sp19Nd/v8D/3RxpQ==";
+    char *json = CloudConfigPayload::decode(dynamic);
+    CHECK(json && expected == json);
+    free(json);
+
+    // Larger than maxSize
+    CHECK(CloudConfigPayload::decode(dynamic, 100) == NULL);
+
+    // Dynamic Huffman blocks of "x" with hand-built code lengths. zlib rejects the last two.
+    json = CloudConfigPayload::decode("z:eAEFwAEJAAAAgKDbzhcBAHkAeQ==");
+    CHECK(json && strcmp(json, "x") == 0);
+    free(json);
+    // Over-subscribed: lengths 1, 1, and 2
+    CHECK(CloudConfigPayload::decode("z:eAEFwAEJAAAAgKDb0noRAHkAeQ==") == NULL);
+    // Incomplete: two codes of length 2
+    CHECK(CloudConfigPayload::decode("z:eAEFwAEJAAAAgKDbzQ8EAHkAeQ==") == NULL);
+
+    // Encoded updates are limited to what the storage method can store
+    static CloudConfigData<64> data;
+    auto *storage = new CloudConfigStorageRetained(&data, sizeof(data));
+    auto &cc = CloudConfig::instance("decodelimit");
+    cc.withStorageMethod(storage).withUpdateMethod(new TestUpdate()).setup();
+    CHECK(cc.getMaxDecodedSize() == 65);
+    CHECK(cc.updateDataEncoded("b:eyJhIjo3N30=") && storage->getInt("a") == 77);
+    CHECK(!cc.updateDataEncoded(dynamic) && storage->getInt("a") == 77);
+    CHECK(!cc.updateDataPatchEncoded(dynamic) && storage->getInt("a") == 77);
+
+    // Not encoded, bad base64, bad zlib data, and a bad checksum
+    CHECK(CloudConfigPayload::decode("{}") == NULL);
+    CHECK(CloudConfigPayload::decode("b:!!!") == NULL);
+    CHECK(CloudConfigPayload::decode("z:!!!") == NULL);
+    CHECK(CloudConfigPayload::decode("z:eNqrVkpUsjI3rwUACjYCRw==") == NULL);
+}
+
+//
+// JSON merge patch (RFC 7396)
+//
+static void mergePatchTests() {
+    struct { const char *target, *patch, *result; } cases[] = {
+        {"{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}"},
+        {"{\"a\":\"b\"}", "{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}"},
+        {"{\"a\":\"b\"}", "{\"a\":null}", "{}"},
+        {"{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}", "{\"b\":\"c\"}"},
+        {"{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}"},
+        {"{\"a\":\"c\"}", "{\"a\":[\"b\"]}", "{\"a\":[\"b\"]}"},
+        {"{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}", "{\"a\":{\"b\":\"d\"}}"},
+        {"{\"a\":[{\"b\":\"c\"}]}", "{\"a\":[1]}", "{\"a\":[1]}"},
+        {"[\"a\",\"b\"]", "[\"c\",\"d\"]", "[\"c\",\"d\"]"},
+        {"{\"a\":\"b\"}", "[\"c\"]", "[\"c\"]"},
+        {"{\"a\":\"foo\"}", "null", "null"},
+        {"{\"e\":null}", "{\"a\":1}", "{\"e\":null,\"a\":1}"},
+        {"[1,2]", "{\"a\":\"b\",\"c\":null}", "{\"a\":\"b\"}"},
+        {"{}", "{\"a\":{\"bb\":{\"ccc\":null}}}", "{\"a\":{\"bb\":{}}}"},
+        {"", "{\"a\":1,\"b\":null}", "{\"a\":1}"},
+        {"{\"x\": 1.50, \"y\" : true}", "{\"y\":false}", "{\"x\":1.50,\"y\":false}"},
+    };
+    char buf[256];
+    for(auto &c : cases) {
+        bool ok = CloudConfigStorage::mergePatch(c.target, c.patch, buf, strlen(c.target) + strlen(c.patch) + 3);
+        CHECK(ok && strcmp(buf, c.result) == 0);
+    }
+    CHECK(!CloudConfigStorage::mergePatch("{}", "{bad", buf, sizeof(buf)));
+
+    static CloudConfigData<256> data;
+    auto *storage = new CloudConfigStorageRetained(&data, sizeof(data));
+    auto &cc = CloudConfig::instance("patch");
+    cc.withStorageMethod(storage).withUpdateMethod(new TestUpdate()).setup();
+    CHECK(cc.updateData("{\"a\":1,\"b\":2}"));
+    CHECK(cc.updateDataPatch("{\"b\":null,\"c\":3}"));
+    CHECK(strcmp(data.jsonData, "{\"a\":1,\"c\":3}") == 0);
+
+    // Encoded patch of {"a":77}
+    CHECK(cc.updateDataPatchEncoded("b:eyJhIjo3N30="));
+    CHECK(storage->getInt("a") == 77 && storage->getInt("c") == 3);
+    CHECK(!cc.updateDataPatchEncoded("b:!!!"));
+}
+
+//
+// In-place parser
+//
+static void tokenizeTests() {
+    CloudConfigToken tokens[32];
+    const char *invalid[] = { "{\"a\"}", "{\"a\":1,}", "[1,]", "{\"a\" 1}", "{1:2}", "{\"a\":1", "\"abc", "{}{}", "",
+        "{\"t\":tx}", "{\"u\":1.2.3}", "[nul]", "[truee]", "[-]", "[01]", "[1.]", "[.5]", "[1e]", "[1e+]", "[0x10]", "[--1]" };
+    for(const char *json : invalid) {
+        CHECK(CloudConfigStorage::tokenize(json, strlen(json), tokens, 32) < 0);
+    }
+    const char *valid[] = { "{}", "[]", "{\"a\":[]}", "[[1],{\"x\":null}]", "\"s\"", "12", "[true,false,null]",
+        "[0,-0,-12,0.5,1e3,1E-3,-2.5e+10]" };
+    for(const char *json : valid) {
+        CHECK(CloudConfigStorage::tokenize(json, strlen(json), tokens, 32) >= 0);
+    }
+    const char *json = "{\"a\":[1,2],\"b\":3}";
+    CHECK(CloudConfigStorage::tokenize(json, strlen(json), tokens, 32) == 7);
+    CHECK(tokens[0].size == 2 && tokens[2].size == 2 && tokens[2].count == 3);
+}
+
+// The same lookups with JSONValue::parseCopy() (mode 0), the token pool (1), and the binary format (2)
+static void lookupTests() {
+    const char *json = "{\"a\":123,\"b\":\"te\\\"st\\u00e9\",\"c\":true,\"d\":12.5,\"e\":[1,{\"x\":[5,6]},3],"
+        "\"f\":{\"f1\":11,\"f2\":\"s\\nt\",\"g\":{\"h\":true}},\"g\":false, \"h\" : -4 ,\"n\":null}";
+
+    for(int mode = 0; mode < 3; mode++) {
+        static CloudConfigData<512> data;
+        static CloudConfigTokenPool<48> pool;
+        memset(&data, 0, sizeof(data));
+        auto *storage = new CloudConfigStorageRetained(&data, sizeof(data));
+        if (mode == 1) {
+            storage->withTokenPool(pool);
+        }
+        if (mode == 2) {
+            storage->withBinaryFormat();
+        }
+        storage->setup();
+        CHECK(!storage->hasKey("a"));
+        CHECK(storage->updateData(json));
+        CHECK(storage->isBinaryData() == (mode == 2));
+
+        CHECK(storage->getInt("a") == 123 && storage->getInt("h") == -4);
+        CHECK(storage->getBool("c") && !storage->getBool("g"));
+        CHECK(storage->getDouble("d") == 12.5);
+        CHECK(storage->hasKey("n") && storage->isNull("n") && !storage->hasKey("zz"));
+        CHECK(storage->hasKey("f") && !storage->hasKey("f1"));
+        CHECK(storage->getJSONValueForKey("f").isObject());
+
+        char buf[32];
+        CHECK(storage->copyString("b", buf, sizeof(buf)) && strcmp(buf, "te\"st\xc3\xa9") == 0);
+        CHECK(!storage->copyString("zz", buf, sizeof(buf)) && buf[0] == 0);
+        CHECK(storage->copyString("a", buf, sizeof(buf)) && strcmp(buf, "123") == 0);
+
+        // String pool
+        const char *b = storage->getString("b");
+        CHECK(strcmp(b, "te\"st\xc3\xa9") == 0 && b == storage->getString("b"));
+        CHECK(strcmp(storage->getString("a"), "123") == 0 && strcmp(storage->getString("c"), "true") == 0);
+        CHECK(strcmp(storage->getString("f"), "") == 0 && strcmp(storage->getString("zz"), "") == 0);
+
+        // Paths
+        CloudConfigPath f1("f.f1"), e2("e[2]"), e1x1("e[1].x[1]"), fgh("f.g.h"), f2("f.f2"), missing("f.zz"), outOfRange("e[3]");
+        for(int rep = 0; rep < 2; rep++) {
+            // The second time uses the cached token
+            CHECK(storage->getInt(f1) == 11 && storage->getInt(e2) == 3 && storage->getInt(e1x1) == 6);
+            CHECK(storage->getBool(fgh));
+            CHECK(!storage->hasKey(missing) && !storage->hasKey(outOfRange) && storage->hasKey(e2));
+            CHECK(storage->copyString(f2, buf, sizeof(buf)) && strcmp(buf, "s\nt") == 0);
+            CHECK(storage->getJSONValueAtPath("e[1].x[0]").toInt() == 5);
+        }
+
+        // Keys with escapes are found by their unescaped name
+        CHECK(storage->updateData("{\"a\\\"b\":5,\"c\\u00e9\":6,\"o\":{\"k\\/l\":7},\"plain\":8}"));
+        CHECK(storage->getInt("a\"b") == 5 && storage->getInt("c\xc3\xa9") == 6 && storage->getInt("plain") == 8);
+        CHECK(strcmp(storage->getString("a\"b"), "5") == 0);
+        CloudConfigPath escapedPath("o.k/l");
+        CHECK(storage->getInt(escapedPath) == 7);
+        CHECK(!storage->hasKey("a\\\"b") && !storage->hasKey("a"));
+
+        // Updating invalidates the cached tokens
+        CHECK(storage->updateData("{\"f\":{\"f1\":22}}"));
+        CHECK(storage->getInt(f1) == 22 && !storage->hasKey(e2) && !storage->hasKey("a"));
+    }
+
+    CloudConfigPath bad1("a..b"), bad2("e[x]"), bad3("e[1]x");
+    CHECK(!bad1.isValid() && !bad2.isValid() && !bad3.isValid());
+}
+
+//
+// Binary format
+//
+static void binaryTests() {
+    char bin[1024];
+    std::string longStr(300, 'x');
+    std::string json = "{\"i8\":-128,\"i16\":300,\"i32\":-70000,\"i64\":5000000000,\"f\":0.5,\"dbl\":0.1,"
+        "\"thisIsAVeryLongKeyName\":7,\"s\":\"" + longStr + "\",\"j\":[1,2,3],\"t\":true,\"n\":null}";
+
+    size_t len = TestStorage::jsonToBinary(json.c_str(), bin, sizeof(bin));
+    CHECK(len > 0 && len < json.size());
+    CHECK(TestStorage::isValidBinary(bin, len) == len);
+
+    // Truncated data is rejected, and so is data that does not fit
+    CHECK(TestStorage::isValidBinary(bin, len - 1) == 0);
+    CHECK(TestStorage::jsonToBinary(json.c_str(), bin, len - 1) == 0);
+
+    static CloudConfigData<1024> data;
+    memset(&data, 0, sizeof(data));
+    auto *storage = new CloudConfigStorageRetained(&data, sizeof(data));
+    storage->withBinaryFormat().setup();
+    CHECK(storage->updateData(json.c_str()) && storage->isBinaryData());
+    CHECK(storage->getInt("i8") == -128 && storage->getInt("i16") == 300 && storage->getInt("i32") == -70000);
+    CHECK(storage->getDouble("i64") == 5000000000.0 && storage->getDouble("f") == 0.5 && storage->getDouble("dbl") == 0.1);
+    CHECK(storage->getInt("thisIsAVeryLongKeyName") == 7 && !storage->hasKey("thisIsAVeryLongKeyNam"));
+    CHECK(strcmp(storage->getString("s"), longStr.c_str()) == 0);
+    CHECK(storage->getJSONValueForKey("j").isArray());
+
+    char buf[1024];
+    CHECK(storage->getJsonText(buf, sizeof(buf)) == json.size() && json == buf);
+    CHECK(storage->isSameData(json.c_str()));
+
+    // Corrupted data is discarded at validation
+    storage->validate();
+    CHECK(storage->isBinaryData() && storage->getInt("i16") == 300);
+    data.jsonData[20] ^= 1;
+    storage->validate();
+    CHECK(!storage->isBinaryData() && !storage->hasJsonData());
+
+    // Data that is not an object is stored as JSON
+    CHECK(storage->updateData("[1,2]"));
+    CHECK(!storage->isBinaryData() && strcmp(data.jsonData, "[1,2]") == 0);
+}
+
+//
+// Storage methods
+//
+static void eepromTests() {
+    memset(EEPROM.mem, 0xff, sizeof(EEPROM.mem));
+    {
+        CloudConfigStorageEEPROM<128> storage(100);
+        storage.setup();
+        CHECK(storage.updateData("{\"a\":12345}"));
+        CHECK(storage.getLastSaveBytes() > 0);
+
+        // Only the changed bytes are written
+        CHECK(storage.updateData("{\"a\":12346}"));
+        CHECK(storage.getLastSaveBytes() <= 5);
+
+        // Saving fails if the bytes don't read back
+        EEPROM.writeFails = true;
+        CHECK(!storage.updateData("{\"a\":12347}"));
+        EEPROM.writeFails = false;
+    }
+    {
+        CloudConfigStorageEEPROM<128> storage(100);
+        storage.setup();
+        CHECK(storage.getInt("a") == 12346);
+    }
+}
+
+static void eepromSlotTests() {
+    memset(EEPROM.mem, 0xff, sizeof(EEPROM.mem));
+    {
+        CloudConfigStorageEEPROM<64> storage(200);
+        storage.withSlots(3).setup();
+        CHECK(!storage.hasJsonData());
+        for(int ii = 1; ii <= 4; ii++) {
+            CHECK(storage.updateData(String::format("{\"a\":%d}", ii)));
+            CHECK(storage.getSlot() == (size_t)(ii - 1) % 3);
+        }
+    }
+    {
+        CloudConfigStorageEEPROM<64> storage(200);
+        storage.withSlots(3).setup();
+        CHECK(storage.getInt("a") == 4 && storage.getSlot() == 0);
+    }
+
+    // A torn write of the newest slot falls back to the previous one
+    EEPROM.mem[200 + sizeof(CloudConfigDataHeader) + 5] = '9';
+    {
+        CloudConfigStorageEEPROM<64> storage(200);
+        storage.withSlots(3).setup();
+        CHECK(storage.getInt("a") == 3 && storage.getSlot() == 2);
+        CHECK(storage.updateData("{\"a\":5}"));
+        CHECK(storage.getSlot() == 0);
+    }
+    {
+        CloudConfigStorageEEPROM<64> storage(200);
+        storage.withSlots(3).setup();
+        CHECK(storage.getInt("a") == 5);
+    }
+}
+
+static void fileTests() {
+    unlink("configtest.dat");
+    {
+        CloudConfigStorageFile<128> storage("configtest.dat");
+        storage.withAtomicSave().setup();
+        CHECK(!storage.hasJsonData());
+        CHECK(storage.updateData("{\"a\":77}"));
+        CHECK(storage.getLastSaveBytes() == sizeof(CloudConfigDataHeader) + strlen("{\"a\":77}") + 1);
+    }
+    {
+        CloudConfigStorageFile<128> storage("configtest.dat");
+        storage.setup();
+        CHECK(storage.getInt("a") == 77);
+
+        // Too large for the buffer
+        std::string large = "{\"s\":\"" + std::string(200, 'x') + "\"}";
+        CHECK(!storage.updateData(large.c_str()));
+        CHECK(storage.getInt("a") == 77);
+    }
+    unlink("configtest.dat");
+}
+
+//
+// Data that can't be stored
+//
+static void storeFailureTests() {
+    std::string large = "{\"s\":\"" + std::string(100, 'x') + "\"}";
+
+    for(int staged = 0; staged < 2; staged++) {
+        static CloudConfigData<64> data;
+        memset(&data, 0, sizeof(data));
+        auto *storage = new CloudConfigStorageRetained(&data, sizeof(data));
+        auto *update = new TestUpdate();
+        int callbacks = 0;
+        auto &cc = CloudConfig::instance(staged ? "storefailstaged" : "storefail");
+        cc.withStorageMethod(storage).withUpdateMethod(update).withMetrics()
+            .withDataCallback([&callbacks]() { callbacks++; });
+        if (staged) {
+            cc.withStagedCommit();
+        }
+        cc.setup();
+        auto runLoop = [&cc]() {
+            for(int ii = 0; ii < 10; ii++) {
+                cc.loop();
+            }
+        };
+
+        // No data, so an update is started once connected
+        runLoop();
+        mockMillisAdd += 2500;
+        runLoop();
+        CHECK(update->starts == 1 && cc.isUpdateInProgress());
+
+        CHECK(cc.updateData("{\"a\":1}"));
+        runLoop();
+        CHECK(cc.getMetrics().successCount == 1 && callbacks == 1 && storage->getInt("a") == 1);
+        uint32_t bytesSaved = cc.getMetrics().bytesSaved;
+
+        // Too large: the data is kept, nothing is saved, and the update fails
+        cc.requestUpdate();
+        runLoop();
+        CHECK(update->starts == 2);
+        CHECK(cc.updateData(large.c_str()) == (bool)staged);
+        runLoop();
+        CHECK(!cc.isCommitPending() && !cc.isUpdateInProgress());
+        CHECK(cc.getMetrics().failureCount == 1 && cc.getMetrics().successCount == 1);
+        CHECK(callbacks == 1 && cc.getMetrics().bytesSaved == bytesSaved && storage->getInt("a") == 1);
+    }
+}
+
+//
+// Update methods
+//
+static void webhookTests() {
+    static CloudConfigData<256> data;
+    auto *storage = new CloudConfigStorageRetained(&data, sizeof(data));
+    auto *webhook = new TestWebhook();
+    auto &cc = CloudConfig::instance("webhook");
+    cc.withStorageMethod(storage).withUpdateMethod(webhook).setup();
+
+    // {"a":1234,"b":56} is 17 bytes, so parts of 8, 8, and 1 bytes, received out of order
+    webhook->subscriptionHandler("x/hook-response/test/2", "}");
+    webhook->subscriptionHandler("x/hook-response/test/0", "{\"a\":123");
+    CHECK(!storage->hasKey("a"));
+    webhook->subscriptionHandler("x/hook-response/test/1", "4,\"b\":56");
+    CHECK(storage->getInt("a") == 1234 && storage->getInt("b") == 56);
+
+    // A multiple of the part size, so there is no short last part
+    webhook->subscriptionHandler("x/hook-response/test/0", "{\"a\":1,\"");
+    CHECK(storage->getInt("a") == 1234);
+    webhook->subscriptionHandler("x/hook-response/test/1", "b\":2345}");
+    CHECK(storage->getInt("a") == 1 && storage->getInt("b") == 2345);
+
+    // Encoded data of {"a":77} in parts
+    const char *encoded = "z:eJyrVkpUsjI3rwUACjYCRg==";
+    for(size_t ii = 0; ii * 8 < strlen(encoded); ii++) {
+        String name = String::format("x/hook-response/test/%u", (unsigned)ii);
+        webhook->subscriptionHandler(name, std::string(&encoded[ii * 8], std::min((size_t)8, strlen(encoded) - ii * 8)).c_str());
+    }
+    CHECK(storage->getInt("a") == 77);
+
+    // A part past what the storage can hold fails without allocating a buffer for it
+    webhook->subscriptionHandler("x/hook-response/test/31", "}");
+    CHECK(webhook->getPartsBufSize() == 0 && storage->getInt("a") == 77);
+}
+
+//
+// Schema validation
+//
+static void validValueTests() {
+    int ii = 5;
+    long ll = 5;
+    bool bb = false;
+    double dd = 0;
+    CHECK(TestField::getValid("12", ii) && ii == 12);
+    CHECK(TestField::getValid("\"123\"", ii) && ii == 123);
+    CHECK(TestField::getValid("\"-2147483648\"", ii) && ii == -2147483647 - 1);
+    CHECK(!TestField::getValid("5.5", ii) && !TestField::getValid("\"12x\"", ii) && !TestField::getValid("true", ii));
+    CHECK(!TestField::getValid("\"99999999999\"", ii) && !TestField::getValid("\"2147483648\"", ii));
+    CHECK(!TestField::getValid("99999999999", ii));
+    CHECK(!TestField::getValid("\"99999999999\"", ll) && ll == 5);
+    CHECK(TestField::getValid("\"-42\"", ll) && ll == -42);
+    CHECK(TestField::getValid("\"true\"", bb) && bb && !TestField::getValid("1", bb));
+    CHECK(TestField::getValid("\"1.5\"", dd) && dd == 1.5 && !TestField::getValid("\"x\"", dd));
+}
+
+//
+// Thread-safe reads
+//
+static void snapshotTests() {
+    static CloudConfigData<256> data;
+    auto &cc = CloudConfig::instance("snapshot");
+    cc.withStorageMethod(new CloudConfigStorageRetained(&data, sizeof(data))).withUpdateMethod(new TestUpdate()).withThreadSafeReads();
+    cc.setup();
+    CHECK(cc.updateData("{\"a\":1,\"s\":\"x\"}"));
+    {
+        CloudConfigSnapshot s1(cc);
+        const char *str = s1->getString("s");
+        CHECK(s1->getInt("a") == 1 && strcmp(str, "x") == 0);
+
+        // The snapshot does not change, and its strings stay valid
+        CHECK(cc.updateData("{\"a\":2,\"s\":\"y\"}"));
+        CHECK(s1->getInt("a") == 1 && strcmp(str, "x") == 0);
+        CloudConfigSnapshot s2(cc);
+        CHECK(s2->getInt("a") == 2 && strcmp(s2->getString("s"), "y") == 0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    mockLogEnabled = (argc > 1 && strcmp(argv[1], "-v") == 0);
+
+    payloadTests();
+    mergePatchTests();
+    tokenizeTests();
+    lookupTests();
+    binaryTests();
+    eepromTests();
+    eepromSlotTests();
+    fileTests();
+    storeFailureTests();
+    webhookTests();
+    validValueTests();
+    snapshotTests();
+
+    printf("%d checks, %d failed\n", numChecks, numFailures);
+    return numFailures ? 1 : 0;
+}